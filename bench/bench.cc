@@ -15,32 +15,55 @@ using namespace polar_race;
 int threadNR = 1;
 int readNR = 100;
 bool isSkew = 0;
+int cacheMB = 0;
 
 Engine *engine = NULL;
 
 void usage() {
     fprintf(stderr,
-            "Usage: ./bench thread_num[1-64] read_ratio[0-100] isSkew[0|1] \n");
+            "Usage: ./bench thread_num[1-64] read_ratio[0-100] isSkew[0|1] [cache_mb] \n");
     exit(-1);
 }
 
 void parseArgs(int argc, char **argv) {
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         usage();
     }
     threadNR = std::atoi(argv[1]);
     readNR = std::atoi(argv[2]);
     int k = std::atoi(argv[3]);
     isSkew = k;
+    cacheMB = argc == 5 ? std::atoi(argv[4]) : 0;
 
     if (threadNR <= 0 || threadNR > 64) usage();
     if (readNR < 0 || readNR > 100) usage();
     if (k != 0 && k != 1) usage();
+    if (cacheMB < 0) usage();
 
     fprintf(stdout, "thread_num: %d, read ratio: %d%%, isSkew: %s\n", threadNR,
             readNR, isSkew ? "true" : "false");
 }
 
+// every 100th key of the key space, with the same value
+class PreloadSource : public BulkSource {
+public:
+    PreloadSource() { gen_random(v, 4096); }
+    bool Next(PolarString *key, PolarString *value) override {
+        if (next >= KEY_SPACE) {
+            return false;
+        }
+        k = next;
+        next += 100;
+        *key = PolarString((char *)&k, sizeof(uint64_t));
+        *value = v;
+        return true;
+    }
+private:
+    char v[5000];
+    uint64_t k;
+    uint64_t next = 0;
+};
+
 void bench_thread(int id) {
 
     struct zipf_gen_state state;
@@ -74,13 +97,9 @@ int main(int argc, char **argv) {
     RetCode ret = Engine::Open(engine_path, &engine);
     assert(ret == kSucc);
 
-    char v[5000];
-    gen_random(v, 4096);
-    for (int i = 0; i < KEY_SPACE; i += 100) {
-        uint64_t key = i;
-        PolarString k((char *)&key, sizeof(uint64_t));
-        engine->Write(k, v);
-    }
+    PreloadSource preload;
+    ret = engine->BulkLoad(preload);
+    assert(ret == kSucc);
     delete engine;
 
     std::thread ths[MAX_THREAD];
@@ -88,7 +107,9 @@ int main(int argc, char **argv) {
     timespec s, e;
 
     clock_gettime(CLOCK_REALTIME, &s);
-    ret = Engine::Open(engine_path, &engine);
+    Options options;
+    options.cache_size = (uint64_t) cacheMB * 1024 * 1024;
+    ret = Engine::Open(engine_path, options, &engine);
     assert(ret == kSucc);
     for (int i = 0; i < threadNR; ++i) {
         ths[i] = std::thread(bench_thread, i);
@@ -103,6 +124,11 @@ int main(int argc, char **argv) {
                 (double)(e.tv_nsec - s.tv_nsec) / 1000;
     printf("%d thread, %d operations per thread, time: %lfus\n", threadNR, OP_PER_THREAD, us);
     printf("throughput %lf operations/s\n", 1ull * (threadNR * OP_PER_THREAD) * 1000000 / us);
+    CacheStats stats;
+    if (engine->GetCacheStats(&stats) == kSucc && stats.hits + stats.misses > 0) {
+        printf("cache hit rate %.1f%%, %lu values cached\n",
+               100.0 * stats.hits / (stats.hits + stats.misses), stats.entries);
+    }
 
     delete engine;
 
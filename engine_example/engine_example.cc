@@ -14,6 +14,17 @@ RetCode Engine::Open(const std::string& name, Engine** eptr) {
   return EngineExample::Open(name, eptr);
 }
 
+RetCode Engine::Open(const std::string& name, const Options& options,
+    Engine** eptr) {
+  // the example engine has a fixed layout
+  return EngineExample::Open(name, eptr);
+}
+
+RetCode Engine::RebuildIndex(const std::string& name) {
+  // the example engine keeps no index on disk
+  return kNotSupported;
+}
+
 Engine::~Engine() {
 }
 
@@ -70,6 +81,75 @@ RetCode EngineExample::Read(const PolarString& key, std::string* value) {
   return ret;
 }
 
+RetCode EngineExample::Delete(const PolarString& key) {
+  // the linear probing of the door plate cannot take keys out
+  return kNotSupported;
+}
+
+RetCode EngineExample::ReadPinned(const PolarString& key, ReadView* view) {
+  // values are read from files, so hand out a copy
+  std::string value;
+  RetCode ret = Read(key, &value);
+  if (ret == kSucc) {
+    view->Assign(std::move(value));
+  } else {
+    view->Reset();
+  }
+  return ret;
+}
+
+RetCode EngineExample::MultiGet(const std::vector<PolarString>& keys,
+    std::vector<std::string>* values,
+    std::vector<RetCode>* statuses) {
+  values->resize(keys.size());
+  statuses->resize(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    RetCode ret = Read(keys[i], &(*values)[i]);
+    if (ret != kSucc && ret != kNotFound) {
+      return ret;
+    }
+    (*statuses)[i] = ret;
+  }
+  return kSucc;
+}
+
+RetCode EngineExample::Compact() {
+  return kNotSupported;
+}
+
+RetCode EngineExample::Scrub() {
+  return kNotSupported;
+}
+
+RetCode EngineExample::BulkLoad(BulkSource& source) {
+  PolarString key, value;
+  while (source.Next(&key, &value)) {
+    RetCode ret = Write(key, value);
+    if (ret != kSucc) {
+      return ret;
+    }
+  }
+  return kSucc;
+}
+
+RetCode EngineExample::GetCacheStats(CacheStats* stats) {
+  return kNotSupported;
+}
+
+RetCode EngineExample::WriteBatch(const std::vector<PolarString>& keys,
+    const std::vector<PolarString>& values) {
+  if (keys.size() != values.size()) {
+    return kInvalidArgument;
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    RetCode ret = Write(keys[i], values[i]);
+    if (ret != kSucc) {
+      return ret;
+    }
+  }
+  return kSucc;
+}
+
 RetCode EngineExample::Range(const PolarString& lower, const PolarString& upper,
     Visitor &visitor) {
   pthread_mutex_lock(&mu_);
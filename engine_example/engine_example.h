@@ -27,6 +27,26 @@ class EngineExample : public Engine  {
   RetCode Read(const PolarString& key,
       std::string* value) override;
 
+  RetCode Delete(const PolarString& key) override;
+
+  RetCode ReadPinned(const PolarString& key,
+      ReadView* view) override;
+
+  RetCode MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values,
+      std::vector<RetCode>* statuses) override;
+
+  RetCode Compact() override;
+
+  RetCode Scrub() override;
+
+  RetCode BulkLoad(BulkSource& source) override;
+
+  RetCode GetCacheStats(CacheStats* stats) override;
+
+  RetCode WriteBatch(const std::vector<PolarString>& keys,
+      const std::vector<PolarString>& values) override;
+
   RetCode Range(const PolarString& lower,
       const PolarString& upper,
       Visitor &visitor) override;
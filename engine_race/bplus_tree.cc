@@ -0,0 +1,523 @@
+//
+// Created by Harry Chen on 2019/4/22.
+//
+
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bplus_tree.h"
+#include "utils.hpp"
+
+static_assert(sizeof(BPlusLeaf) <= BPLUS_PAGE_SIZE, "B+ tree leaf does not fit in a page");
+static_assert(sizeof(BPlusInner) <= BPLUS_PAGE_SIZE, "B+ tree inner node does not fit in a page");
+
+
+BPlusTree::BPlusTree(const std::string &filename, size_t initial_size,
+                     const std::string &key_filename, size_t key_arena_size):
+    key_arena(key_filename, key_arena_size) {
+    struct stat st = {};
+    int index_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+    assert(index_file_fd > 0);
+    fstat(index_file_fd, &st);
+    index_file_size = (size_t) st.st_size;
+
+    bool need_init = false;
+    if (index_file_size == 0) {
+        // no index yet
+        // at least the header page and the root
+        index_file_size = (size_t) max((int) round_up(initial_size, BPLUS_PAGE_SIZE), 2 * BPLUS_PAGE_SIZE);
+        int ret = ftruncate(index_file_fd, index_file_size);
+        need_init = true;
+        assert(ret == 0);
+    }
+
+    file_map = map_growable(index_file_fd, index_file_size, false);
+    assert(file_map != nullptr);
+    initFileMap();
+
+    // page 0 holds the header, start with an empty leaf as root, which is the first checkpoint
+    if (need_init) {
+        header->page_count = 1;
+        header->height = 1;
+        header->root = allocatePage(true);
+        bool written = checkpoint(index_file_fd) && fdatasync(index_file_fd) == 0;
+        assert(written);
+    }
+    // the private mapping stays valid after the descriptor is closed
+    close(index_file_fd);
+}
+
+BPlusTree::~BPlusTree() {
+    unmap_growable(file_map);
+}
+
+
+const IndexData &BPlusTree::search(const PolarString &key) {
+    auto prefix = key_prefix(key);
+    auto leaf = findLeaf(key, prefix);
+    if (__glibc_unlikely(leaf == -1)) return INDEX_NOT_FOUND;
+    return searchLeaf(leafAt(leaf), key, prefix);
+}
+
+
+const IndexData &BPlusTree::searchLeaf(const BPlusLeaf *leaf, const PolarString &key, int64_t prefix) const {
+    auto count = min(leaf->header.count, BPLUS_LEAF_CAPACITY);
+    auto slot = lowerBound(leaf->prefixes, leaf->keys, count, key, prefix, false);
+    if (__glibc_unlikely(slot == count ||
+                         fast_key_cmp(prefix, key, ordered_prefix(leaf->prefixes[slot]), keyAt(leaf->prefixes, leaf->keys, slot)) != 0)) {
+        return INDEX_NOT_FOUND;
+    }
+    return leaf->data[slot];
+}
+
+
+// an insert splits at most every node on its path, and the root into two
+bool BPlusTree::reserve(size_t key_size) {
+    if (!reservePages(header->height + 2)) {
+        return false;
+    }
+    return key_size <= (size_t) KEY_PREFIX_LENGTH || key_arena.reserve(key_size);
+}
+
+
+IndexData BPlusTree::insert(const PolarString &key, IndexData data) {
+    auto prefix = key_prefix(key);
+    if (pageAt(header->root)->count == (pageAt(header->root)->leaf ? BPLUS_LEAF_CAPACITY : BPLUS_INNER_CAPACITY)) {
+        // grow the tree at the top
+        auto new_root = allocatePage(false);
+        innerAt(new_root)->children[0] = header->root;
+        header->root = new_root;
+        header->height++;
+        splitChild(innerAt(new_root), 0);
+    }
+
+    // split full nodes on the way down, so the parent always has space for a separator
+    auto current = header->root;
+    while (!pageAt(current)->leaf) {
+        auto inner = innerAt(current);
+        auto index = lowerBound(inner->prefixes, inner->keys, inner->header.count, key, prefix, true);
+        auto child = pageAt(inner->children[index]);
+        if (child->count == (child->leaf ? BPLUS_LEAF_CAPACITY : BPLUS_INNER_CAPACITY)) {
+            splitChild(inner, index);
+            if (fast_key_cmp(prefix, key, ordered_prefix(inner->prefixes[index]), keyAt(inner->prefixes, inner->keys, index)) >= 0) {
+                index++;
+            }
+        }
+        current = inner->children[index];
+    }
+
+    auto leaf = leafAt(current);
+    auto count = leaf->header.count;
+    auto slot = lowerBound(leaf->prefixes, leaf->keys, count, key, prefix, false);
+    if (slot < count && fast_key_cmp(prefix, key, ordered_prefix(leaf->prefixes[slot]), keyAt(leaf->prefixes, leaf->keys, slot)) == 0) {
+        // existing key, update in place
+        auto replaced = leaf->data[slot];
+        leaf->data[slot] = data;
+        return replaced;
+    }
+
+    auto move = count - slot;
+    memmove(&leaf->prefixes[slot + 1], &leaf->prefixes[slot], move * sizeof(leaf->prefixes[0]));
+    memmove(&leaf->keys[slot + 1], &leaf->keys[slot], move * sizeof(leaf->keys[0]));
+    memmove(&leaf->data[slot + 1], &leaf->data[slot], move * sizeof(leaf->data[0]));
+    uint64_t offset = key.size() > KEY_PREFIX_LENGTH ? key_arena.append(key.data(), key.size()) : 0;
+    leaf->prefixes[slot] = raw_prefix(key);
+    leaf->keys[slot] = offset << 16 | key.size();
+    leaf->data[slot] = data;
+    leaf->header.count++;
+    return INDEX_NOT_FOUND;
+}
+
+
+// An emptied leaf is unlinked and its page freed for reuse. Underfull leaves
+// are not merged, so entries only ever move within their page, or by a split
+// into the leaf right behind it, which scan relies on.
+IndexData BPlusTree::remove(const PolarString &key) {
+    auto prefix = key_prefix(key);
+    std::pair<int32_t, int> path[MAX_BPLUS_TREE_HEIGHT];
+    int depth = 0;
+    auto current = header->root;
+    while (!pageAt(current)->leaf) {
+        auto inner = innerAt(current);
+        auto index = lowerBound(inner->prefixes, inner->keys, inner->header.count, key, prefix, true);
+        path[depth++] = {current, index};
+        current = inner->children[index];
+    }
+    auto leaf = leafAt(current);
+    auto count = leaf->header.count;
+    auto slot = lowerBound(leaf->prefixes, leaf->keys, count, key, prefix, false);
+    if (slot == count || fast_key_cmp(prefix, key, ordered_prefix(leaf->prefixes[slot]), keyAt(leaf->prefixes, leaf->keys, slot)) != 0) {
+        return INDEX_NOT_FOUND;
+    }
+    auto removed = leaf->data[slot];
+    auto length = leaf->keys[slot] & 0xffff;
+    if (length > KEY_PREFIX_LENGTH && !isSeparator(key, prefix, leaf->keys[slot])) {
+        key_arena.release(leaf->keys[slot] >> 16, length);
+    }
+    auto move = count - slot - 1;
+    memmove(&leaf->prefixes[slot], &leaf->prefixes[slot + 1], move * sizeof(leaf->prefixes[0]));
+    memmove(&leaf->keys[slot], &leaf->keys[slot + 1], move * sizeof(leaf->keys[0]));
+    memmove(&leaf->data[slot], &leaf->data[slot + 1], move * sizeof(leaf->data[0]));
+    leaf->header.count--;
+    if (leaf->header.count == 0 && depth > 0) {
+        unlinkLeaf(path, depth, current);
+    }
+    return removed;
+}
+
+
+void BPlusTree::unlinkLeaf(const std::pair<int32_t, int> *path, int depth, int32_t leaf) {
+    // the deepest inner node that keeps a child once the leaf is gone
+    auto level = depth - 1;
+    while (level >= 0 && innerAt(path[level].first)->header.count == 0) {
+        --level;
+    }
+    if (level < 0) {
+        // the only leaf of the tree stays, as its root
+        for (int i = 0; i < depth; ++i) {
+            freePage(path[i].first);
+        }
+        header->root = leaf;
+        header->height = 1;
+        return;
+    }
+    dropChild(innerAt(path[level].first), path[level].second);
+
+    // the leaf before it is the last one below the child left of the path
+    auto next = leafAt(leaf)->header.next;
+    for (auto i = level; i >= 0; --i) {
+        if (path[i].second > 0) {
+            auto current = innerAt(path[i].first)->children[path[i].second - 1];
+            while (!pageAt(current)->leaf) {
+                current = innerAt(current)->children[innerAt(current)->header.count];
+            }
+            leafAt(current)->header.next = next;
+            break;
+        }
+    }
+    reinterpret_cast<BPlusFreePage*>(pageAt(leaf))->next_incarnation = next == -1 ? 0 : pageAt(next)->incarnation;
+    freePage(leaf);
+    for (auto i = level + 1; i < depth; ++i) {
+        freePage(path[i].first);
+    }
+    // a root left with a single child gives way to it
+    while (!pageAt(header->root)->leaf && innerAt(header->root)->header.count == 0) {
+        auto root = header->root;
+        header->root = innerAt(root)->children[0];
+        header->height--;
+        freePage(root);
+    }
+}
+
+
+// The child goes together with the separator in front of it (or behind it,
+// for the first child), so its range falls to a neighbour. The key stored for
+// the separator is released unless a leaf entry still shares it.
+void BPlusTree::dropChild(BPlusInner *inner, int index) {
+    auto separator = index > 0 ? index - 1 : 0;
+    auto stored = inner->keys[separator];
+    auto length = stored & 0xffff;
+    if (length > KEY_PREFIX_LENGTH) {
+        auto key = keyAt(inner->prefixes, inner->keys, separator);
+        auto prefix = key_prefix(key);
+        auto leaf = leafAt(findLeaf(key, prefix));
+        auto slot = lowerBound(leaf->prefixes, leaf->keys, leaf->header.count, key, prefix, false);
+        if (slot == leaf->header.count || leaf->keys[slot] != stored) {
+            key_arena.release(stored >> 16, length);
+        }
+    }
+    auto move = inner->header.count - separator - 1;
+    memmove(&inner->prefixes[separator], &inner->prefixes[separator + 1], move * sizeof(inner->prefixes[0]));
+    memmove(&inner->keys[separator], &inner->keys[separator + 1], move * sizeof(inner->keys[0]));
+    memmove(&inner->children[index], &inner->children[index + 1], (inner->header.count - index) * sizeof(inner->children[0]));
+    inner->header.count--;
+}
+
+
+void BPlusTree::sync() {
+    key_arena.sync();
+}
+
+
+// pages past the page count have never been used
+void BPlusTree::snapshot(Snapshot *snapshot) {
+    key_arena.seal();
+    copyImage(snapshot, file_map, (size_t) header->page_count * BPLUS_PAGE_SIZE, index_file_size);
+}
+
+
+// Walks the leaves in key order along their chain, limit counts leaves. A
+// split moves entries into a new leaf right behind the one split, and an
+// emptied leaf is freed without moving any entry, so the walk visits every
+// entry that stays in the tree. The cursor is the next leaf and its
+// incarnation: a leaf freed meanwhile leads on to the sibling it had, and the
+// scan only starts over once a page on that way was reused.
+uint64_t BPlusTree::scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) {
+    auto page = cursor == 0 ? firstLeaf() : resumeLeaf(cursor);
+    for (size_t i = 0; i < limit && page != -1; ++i) {
+        auto leaf = leafAt(page);
+        for (int j = 0; j < leaf->header.count; ++j) {
+            visitor(keyAt(leaf->prefixes, leaf->keys, j), leaf->data[j]);
+        }
+        page = leaf->header.next;
+    }
+    // page 0 holds the tree header, a cursor is never 0
+    return page == -1 ? 0 : (uint64_t) pageAt(page)->incarnation << 32 | (uint32_t) page;
+}
+
+
+int32_t BPlusTree::firstLeaf() const {
+    auto current = header->root;
+    while (!pageAt(current)->leaf) {
+        current = innerAt(current)->children[0];
+    }
+    return current;
+}
+
+
+int32_t BPlusTree::resumeLeaf(uint64_t cursor) const {
+    auto page = (int32_t) (uint32_t) cursor;
+    auto incarnation = (uint32_t) (cursor >> 32);
+    while (page != -1) {
+        auto node = pageAt(page);
+        if (node->incarnation != incarnation) {
+            return firstLeaf();
+        }
+        if (node->leaf != BPLUS_FREE) {
+            return page;
+        }
+        incarnation = reinterpret_cast<const BPlusFreePage*>(node)->next_incarnation;
+        page = node->next;
+    }
+    return -1;
+}
+
+
+BPlusTree::Iterator *BPlusTree::seek(const PolarString &lower) {
+    auto prefix = key_prefix(lower);
+    auto leaf = findLeaf(lower, prefix);
+    assert(leaf != -1);
+    auto slot = 0;
+    if (!lower.empty()) {
+        auto node = leafAt(leaf);
+        slot = lowerBound(node->prefixes, node->keys, node->header.count, lower, prefix, false);
+    }
+    return new Iterator(this, leaf, slot);
+}
+
+
+BPlusTree::Iterator::Iterator(BPlusTree *tree, int32_t leaf, int slot): tree(tree), leaf(leaf), slot(slot) {
+    skipExhausted();
+}
+
+
+PolarString BPlusTree::Iterator::key() const {
+    auto node = tree->leafAt(leaf);
+    return tree->keyAt(node->prefixes, node->keys, slot);
+}
+
+
+void BPlusTree::Iterator::next() {
+    slot++;
+    skipExhausted();
+}
+
+
+void BPlusTree::Iterator::skipExhausted() {
+    while (leaf != -1 && slot >= tree->leafAt(leaf)->header.count) {
+        leaf = tree->leafAt(leaf)->header.next;
+        slot = 0;
+    }
+}
+
+
+// May run concurrently with insert (see Database::read), so page numbers and
+// counts are checked against the mapping in use, returns -1 on a torn read.
+int32_t BPlusTree::findLeaf(const PolarString &key, int64_t prefix) const {
+    auto capacity = current_capacity.load(std::memory_order_acquire);
+    auto pages = this->pages;
+    auto current = header->root;
+    for (int depth = 0; ; ++depth) {
+        if (__glibc_unlikely(current <= 0 || (uint32_t) current >= capacity || depth > MAX_BPLUS_TREE_HEIGHT)) {
+            return -1;
+        }
+        auto inner = reinterpret_cast<const BPlusInner*>(pages + (size_t) current * BPLUS_PAGE_SIZE);
+        if (inner->header.leaf) return current;
+        auto count = min(inner->header.count, BPLUS_INNER_CAPACITY);
+        // the binary search starts in the middle of the prefix array
+        __builtin_prefetch(&inner->prefixes[count / 2]);
+        auto index = lowerBound(inner->prefixes, inner->keys, count, key, prefix, true);
+        current = inner->children[index];
+    }
+}
+
+
+// A separator equal to key is on its path, as the last separator not greater
+// than key in its node. Separators stay, so the stored key they share with a
+// leaf entry (see splitChild) outlives the entry.
+bool BPlusTree::isSeparator(const PolarString &key, int64_t prefix, uint64_t stored) const {
+    for (auto current = header->root; !pageAt(current)->leaf; ) {
+        auto inner = innerAt(current);
+        auto index = lowerBound(inner->prefixes, inner->keys, inner->header.count, key, prefix, true);
+        if (index > 0 && inner->keys[index - 1] == stored) {
+            return true;
+        }
+        current = inner->children[index];
+    }
+    return false;
+}
+
+
+void BPlusTree::splitChild(BPlusInner *parent, int index) {
+    auto child_page = parent->children[index];
+    auto child = pageAt(child_page);
+    auto right_page = allocatePage(child->leaf);
+    int64_t separator_prefix;
+    uint64_t separator_key;
+
+    if (child->leaf) {
+        auto left = leafAt(child_page), right = leafAt(right_page);
+        auto half = left->header.count / 2;
+        auto move = left->header.count - half;
+        memcpy(right->prefixes, &left->prefixes[half], move * sizeof(left->prefixes[0]));
+        memcpy(right->keys, &left->keys[half], move * sizeof(left->keys[0]));
+        memcpy(right->data, &left->data[half], move * sizeof(left->data[0]));
+        right->header.count = (uint16_t) move;
+        left->header.count = (uint16_t) half;
+        right->header.next = left->header.next;
+        left->header.next = right_page;
+        separator_prefix = right->prefixes[0];
+        separator_key = right->keys[0];
+    } else {
+        auto left = innerAt(child_page), right = innerAt(right_page);
+        auto half = left->header.count / 2;
+        auto move = left->header.count - half - 1;
+        separator_prefix = left->prefixes[half];
+        separator_key = left->keys[half];
+        memcpy(right->prefixes, &left->prefixes[half + 1], move * sizeof(left->prefixes[0]));
+        memcpy(right->keys, &left->keys[half + 1], move * sizeof(left->keys[0]));
+        memcpy(right->children, &left->children[half + 1], (move + 1) * sizeof(left->children[0]));
+        right->header.count = (uint16_t) move;
+        left->header.count = (uint16_t) half;
+    }
+
+    // the separator shares the stored key of its leaf entry
+    auto move = parent->header.count - index;
+    memmove(&parent->prefixes[index + 1], &parent->prefixes[index], move * sizeof(parent->prefixes[0]));
+    memmove(&parent->keys[index + 1], &parent->keys[index], move * sizeof(parent->keys[0]));
+    memmove(&parent->children[index + 2], &parent->children[index + 1], move * sizeof(parent->children[0]));
+    parent->prefixes[index] = separator_prefix;
+    parent->keys[index] = separator_key;
+    parent->children[index + 1] = right_page;
+    parent->header.count++;
+}
+
+
+PolarString BPlusTree::keyAt(const int64_t *prefixes, const uint64_t *keys, int index) const {
+    auto length = keys[index] & 0xffff;
+    if (length <= KEY_PREFIX_LENGTH) {
+        return {reinterpret_cast<const char*>(&prefixes[index]), length};
+    }
+    return {key_arena.at(keys[index] >> 16, length), length};
+}
+
+
+// first slot whose key is not less than (or with upper, greater than) the given key
+int BPlusTree::lowerBound(const int64_t *prefixes, const uint64_t *keys, int count,
+                          const PolarString &key, int64_t prefix, bool upper) const {
+    // narrow down by prefix with a binary search, and finish with a SIMD scan
+    int low = 0, high = count;
+    while (high - low > 16) {
+        auto mid = (low + high) / 2;
+        if (ordered_prefix(prefixes[mid]) < prefix) low = mid + 1;
+        else high = mid;
+    }
+#ifdef __AVX2__
+    auto needle = _mm256_set1_epi64x(prefix);
+    // ordered_prefix of four stored prefixes at once
+    auto byte_swap = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    auto sign = _mm256_set1_epi64x(INT64_MIN);
+    for (; low + 4 <= high; low += 4) {
+        auto stored = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&prefixes[low]));
+        stored = _mm256_xor_si256(_mm256_shuffle_epi8(stored, byte_swap), sign);
+        auto less = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(needle, stored)));
+        if (less != 0xf) {
+            low += __builtin_popcount(less);
+            high = low;
+            break;
+        }
+    }
+#endif
+    while (low < high && ordered_prefix(prefixes[low]) < prefix) low++;
+
+    // same prefix, compare the whole keys
+    while (low < count && ordered_prefix(prefixes[low]) == prefix) {
+        auto result = fast_key_cmp(prefix, keyAt(prefixes, keys, low), prefix, key);
+        if (result > 0 || (result == 0 && !upper)) break;
+        low++;
+    }
+    return low;
+}
+
+
+bool BPlusTree::reservePages(uint32_t count) {
+    if (__glibc_likely(header->page_count + count <= current_capacity)) return true;
+    // extend the index file size, existing pages stay where they are
+    auto new_size = grown_size(index_file_size, (size_t) (header->page_count + count) * BPLUS_PAGE_SIZE);
+    if (!grow_mapping(-1, file_map, index_file_size, new_size, false)) {
+        return false;
+    }
+    index_file_size = new_size;
+    initFileMap();
+    return true;
+}
+
+
+// freed pages are taken first, the file only grows once there are none
+int32_t BPlusTree::allocatePage(bool leaf) {
+    int32_t page;
+    uint32_t incarnation = 0;
+    if (header->free_page != 0) {
+        page = header->free_page;
+        header->free_page = pageAt(page)->next_free;
+        incarnation = pageAt(page)->incarnation + 1;
+    } else {
+        bool reserved = reservePages(1);
+        assert(reserved);
+        page = (int32_t) header->page_count++;
+    }
+    auto node = pageAt(page);
+    memset(node, 0, BPLUS_PAGE_SIZE);
+    node->leaf = (uint16_t) leaf;
+    node->next = -1;
+    node->incarnation = incarnation;
+    return page;
+}
+
+
+// a freed leaf keeps its sibling, see scan
+void BPlusTree::freePage(int32_t page) {
+    auto node = pageAt(page);
+    node->leaf = BPLUS_FREE;
+    node->count = 0;
+    node->next_free = header->free_page;
+    header->free_page = page;
+}
+
+
+void BPlusTree::initFileMap() {
+    madvise(file_map, index_file_size, MADV_RANDOM);
+    header = reinterpret_cast<BPlusTreeHeader*>(file_map);
+    pages = reinterpret_cast<char*>(file_map);
+    // publish the new capacity only after the new page pointer
+    current_capacity.store((uint32_t) (index_file_size / BPLUS_PAGE_SIZE), std::memory_order_release);
+}
@@ -0,0 +1,138 @@
+//
+// Created by Harry Chen on 2019/4/22.
+//
+
+#ifndef TRIVIALKV_BPLUS_TREE_H
+#define TRIVIALKV_BPLUS_TREE_H
+
+#include <string>
+#include <utility>
+#include <atomic>
+#include <cstddef>
+
+#include "index.h"
+#include "key_arena.h"
+
+const int BPLUS_PAGE_SIZE = 4096;
+const int BPLUS_LEAF_CAPACITY = 127;
+const int BPLUS_INNER_CAPACITY = 200;
+
+struct BPlusNodeHeader {
+    // BPLUS_FREE for a page on the free list
+    uint16_t leaf;
+    uint16_t count;
+    // right sibling of a leaf, -1 for the last leaf; a freed leaf keeps the
+    // sibling it had, so that a scan positioned on it can go on
+    int32_t next;
+    // next page on the free list, 0 for the last one
+    int32_t next_free;
+    // bumped whenever the page is taken from the free list
+    uint32_t incarnation;
+};
+
+const uint16_t BPLUS_FREE = 2;
+
+// a freed page, see BPlusTree::scan
+struct BPlusFreePage {
+    BPlusNodeHeader header;
+    // incarnation of the sibling when the leaf was freed
+    uint32_t next_incarnation;
+};
+
+// keys are kept as an array of integer prefixes (so that a node can be searched
+// with SIMD compares) and an array of references into the key arena, packed as
+// offset << 16 | length; keys no longer than the prefix live in the prefix itself,
+// so prefixes hold the raw key bytes and are compared through ordered_prefix
+struct BPlusLeaf {
+    BPlusNodeHeader header;
+    int64_t prefixes[BPLUS_LEAF_CAPACITY];
+    uint64_t keys[BPLUS_LEAF_CAPACITY];
+    IndexData data[BPLUS_LEAF_CAPACITY];
+};
+
+// separator i is the smallest key of child i + 1
+struct BPlusInner {
+    BPlusNodeHeader header;
+    int64_t prefixes[BPLUS_INNER_CAPACITY];
+    uint64_t keys[BPLUS_INNER_CAPACITY];
+    int32_t children[BPLUS_INNER_CAPACITY + 1];
+};
+
+struct BPlusTreeHeader {
+    uint32_t page_count;
+    int32_t root;
+    uint32_t height;
+    // first page of the free list, 0 if it is empty
+    int32_t free_page;
+};
+
+
+class BPlusTree : public Index {
+public:
+    class Iterator : public Index::Iterator {
+    public:
+        bool valid() const override { return leaf != -1; }
+        PolarString key() const override;
+        const IndexData &data() const override { return tree->leafAt(leaf)->data[slot]; }
+        void next() override;
+    private:
+        friend class BPlusTree;
+        Iterator(BPlusTree *tree, int32_t leaf, int slot);
+        void skipExhausted();
+        BPlusTree *tree;
+        int32_t leaf;
+        int slot;
+    };
+
+    BPlusTree(const std::string &filename, size_t initial_size,
+              const std::string &key_filename, size_t key_arena_size);
+    ~BPlusTree() override;
+    const IndexData &search(const PolarString &key) override;
+    bool reserve(size_t key_size) override;
+    IndexData insert(const PolarString &key, IndexData data) override;
+    IndexData remove(const PolarString &key) override;
+    void sync() override;
+    void snapshot(Snapshot *snapshot) override;
+    void checkpointed() override { key_arena.reuseSealed(); }
+    bool keysAwaitCheckpoint() const override { return key_arena.awaitsCheckpoint(); }
+    Iterator *seek(const PolarString &lower) override;
+    uint64_t scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) override;
+private:
+    void initFileMap();
+    bool reservePages(uint32_t count);
+    int32_t allocatePage(bool leaf);
+    void freePage(int32_t page);
+    void splitChild(BPlusInner *parent, int index);
+    // Removes an emptied leaf from the tree, together with the inner nodes left
+    // without a child. path holds the inner nodes above it and the child taken in each.
+    void unlinkLeaf(const std::pair<int32_t, int> *path, int depth, int32_t leaf);
+    void dropChild(BPlusInner *inner, int index);
+    int32_t firstLeaf() const;
+    int32_t resumeLeaf(uint64_t cursor) const;
+    int32_t findLeaf(const PolarString &key, int64_t prefix) const;
+    bool isSeparator(const PolarString &key, int64_t prefix, uint64_t stored) const;
+    const IndexData &searchLeaf(const BPlusLeaf *leaf, const PolarString &key, int64_t prefix) const;
+    PolarString keyAt(const int64_t *prefixes, const uint64_t *keys, int index) const;
+    int lowerBound(const int64_t *prefixes, const uint64_t *keys, int count,
+                   const PolarString &key, int64_t prefix, bool upper) const;
+
+    BPlusNodeHeader *pageAt(int32_t page) const {
+        return reinterpret_cast<BPlusNodeHeader*>(pages + (size_t) page * BPLUS_PAGE_SIZE);
+    }
+    BPlusLeaf *leafAt(int32_t page) const { return reinterpret_cast<BPlusLeaf*>(pageAt(page)); }
+    BPlusInner *innerAt(int32_t page) const { return reinterpret_cast<BPlusInner*>(pageAt(page)); }
+
+    size_t index_file_size;
+    std::atomic<uint32_t> current_capacity;
+
+    void *file_map;
+    BPlusTreeHeader *header;
+    char *pages;
+
+    KeyArena key_arena;
+};
+
+// far beyond the height of any real tree, anything deeper is a torn read
+const int MAX_BPLUS_TREE_HEIGHT = 16;
+
+#endif //TRIVIALKV_BPLUS_TREE_H
@@ -0,0 +1,187 @@
+//
+// Created by Harry Chen on 2019/5/8.
+//
+
+#include <cstring>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+namespace {
+
+// reflected Castagnoli polynomial
+const uint32_t CRC32C_POLY = 0x82f63b78;
+// sizes of the blocks whose crcs are computed three at a time, powers of two
+const size_t CRC32C_LONG = 8192;
+const size_t CRC32C_SHORT = 256;
+
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, ++matrix) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+void gf2_matrix_square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; ++n) {
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+    }
+}
+
+// operator appending length zero bytes (a power of two) to a crc
+void zeros_operator(uint32_t *even, size_t length) {
+    uint32_t odd[32];
+    // one zero bit
+    odd[0] = CRC32C_POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    // two, then four zero bits
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    // every square doubles the number of zeros, starting with one byte
+    while (true) {
+        gf2_matrix_square(even, odd);
+        length >>= 1;
+        if (length == 0) {
+            return;
+        }
+        gf2_matrix_square(odd, even);
+        length >>= 1;
+        if (length == 0) {
+            break;
+        }
+    }
+    memcpy(even, odd, sizeof(odd));
+}
+
+// product of two polynomials modulo the polynomial, reflected like the crcs
+uint32_t multiply_mod(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+struct Crc32cTables {
+    // crc of a single byte, for the software fallback
+    uint32_t bytes[256];
+    // x^(8 * 2^n) modulo the polynomial, which appends 2^n zero bytes to a crc
+    uint32_t byte_powers[64];
+    // appending CRC32C_LONG (CRC32C_SHORT) zero bytes to a crc, one table per byte of it
+    uint32_t long_zeros[4][256];
+    uint32_t short_zeros[4][256];
+
+    Crc32cTables() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            auto crc = n;
+            for (int k = 0; k < 8; ++k) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            bytes[n] = crc;
+        }
+        fillZeros(long_zeros, CRC32C_LONG);
+        fillZeros(short_zeros, CRC32C_SHORT);
+        // x^8, then squared
+        byte_powers[0] = 1u << 23;
+        for (int n = 1; n < 64; ++n) {
+            byte_powers[n] = multiply_mod(byte_powers[n - 1], byte_powers[n - 1]);
+        }
+    }
+
+    static void fillZeros(uint32_t zeros[][256], size_t length) {
+        uint32_t op[32];
+        zeros_operator(op, length);
+        for (uint32_t n = 0; n < 256; ++n) {
+            zeros[0][n] = gf2_matrix_times(op, n);
+            zeros[1][n] = gf2_matrix_times(op, n << 8);
+            zeros[2][n] = gf2_matrix_times(op, n << 16);
+            zeros[3][n] = gf2_matrix_times(op, n << 24);
+        }
+    }
+};
+
+const Crc32cTables tables;
+
+#ifdef __SSE4_2__
+
+inline uint32_t shift(const uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+inline uint64_t load_word(const char *data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+// The crc32 instruction takes three cycles but can start every cycle, so
+// three blocks are run through it side by side, and their crcs are combined
+// by shifting the first ones over the length of the blocks that follow.
+template<size_t BLOCK>
+inline uint64_t interleave(uint64_t crc, const char *&data, size_t &size, const uint32_t zeros[][256]) {
+    while (size >= BLOCK * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (auto end = data + BLOCK; data < end; data += sizeof(uint64_t)) {
+            crc = _mm_crc32_u64(crc, load_word(data));
+            crc1 = _mm_crc32_u64(crc1, load_word(data + BLOCK));
+            crc2 = _mm_crc32_u64(crc2, load_word(data + BLOCK * 2));
+        }
+        crc = shift(zeros, (uint32_t) crc) ^ crc1;
+        crc = shift(zeros, (uint32_t) crc) ^ crc2;
+        data += BLOCK * 2;
+        size -= BLOCK * 3;
+    }
+    return crc;
+}
+
+#endif
+
+}
+
+
+// The pre- and post-conditioning cancel out, so shifting crc1 over length2
+// zero bytes is all it takes, in one multiplication per bit of length2.
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t length2) {
+    for (int n = 0; length2 != 0; ++n, length2 >>= 1) {
+        if (length2 & 1) {
+            crc1 = multiply_mod(tables.byte_powers[n], crc1);
+        }
+    }
+    return crc1 ^ crc2;
+}
+
+
+uint32_t crc32c(const char *data, size_t size, uint32_t crc) {
+#ifdef __SSE4_2__
+    uint64_t result = crc ^ 0xffffffff;
+    result = interleave<CRC32C_LONG>(result, data, size, tables.long_zeros);
+    result = interleave<CRC32C_SHORT>(result, data, size, tables.short_zeros);
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        result = _mm_crc32_u64(result, load_word(data));
+    }
+    for (; size > 0; ++data, --size) {
+        result = _mm_crc32_u8((uint32_t) result, (uint8_t) *data);
+    }
+    return (uint32_t) result ^ 0xffffffff;
+#else
+    crc ^= 0xffffffff;
+    for (; size > 0; ++data, --size) {
+        crc = tables.bytes[(crc ^ (uint8_t) *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffff;
+#endif
+}
@@ -0,0 +1,18 @@
+//
+// Created by Harry Chen on 2019/5/8.
+//
+
+#ifndef TRIVIALKV_CRC32C_H
+#define TRIVIALKV_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli) of size bytes, continuing the crc of the bytes before
+// them (0 to start). Uses the SSE 4.2 crc32 instruction where available.
+uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0);
+
+// crc of the bytes of crc1 followed by the length2 bytes of crc2
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t length2);
+
+#endif //TRIVIALKV_CRC32C_H
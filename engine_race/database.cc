@@ -8,69 +8,1370 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <glob.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 
 #include "database.h"
+#include "crc32c.h"
+#include "utils.hpp"
 
-Database::Database(const std::string &dir, int id): id(id) {
+Database::Database(const std::string &dir, int id, const Options &options):
+    version(0), relocation_epoch(0), id(id), options(options),
+    slices(new std::atomic<char*>[options.max_slice_count]),
+    slice_pins(new std::atomic<uint32_t>[options.max_slice_count]),
+    slice_dirty(new std::atomic<bool>[options.max_slice_count]),
+    created_files(true),
+    sealed_size(new std::atomic<uint32_t>[options.max_slice_count]),
+    published_size(new uint64_t[options.max_slice_count]()) {
     pthread_rwlock_init(&rwlock, nullptr);
+    pthread_mutex_init(&slice_lock, nullptr);
+    pthread_mutex_init(&compaction_lock, nullptr);
+    pthread_mutex_init(&sync_lock, nullptr);
+    for (uint32_t i = 0; i < options.max_slice_count; ++i) {
+        slices[i].store(nullptr, std::memory_order_relaxed);
+        slice_pins[i].store(0, std::memory_order_relaxed);
+        slice_dirty[i].store(false, std::memory_order_relaxed);
+        sealed_size[i].store(UINT32_MAX, std::memory_order_relaxed);
+    }
     file_prefix = dir + "." + std::to_string(id);
 //    printf("Database shard %d initing...\n", id);
-    initIndex();
     initSlices();
+    initIndex();
+    // Sequence numbers handed out before a crash may not have reached the
+    // metadata, continuing from the clock never hands them out again.
+    struct timespec now = {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    auto clock = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    if (metadata->sequence.load() < clock) {
+        metadata->sequence.store(clock);
+    }
 }
 
 
 Database::~Database() {
+    // nothing is left to replay at the next start
+    checkpoint(true);
+    wal.reset();
     delete index;
-    // unmap all opened files
-    for (int i = 0; i < metadata->sliceCount; ++i) {
-        munmap(slices[i], SLICE_SIZE);
-        close(slice_fd[i]);
+    // unmap all slices that were touched
+    for (uint32_t i = 0; i < metadata->sliceCount; ++i) {
+        auto slice = slices[i].load(std::memory_order_relaxed);
+        if (slice != nullptr) {
+            munmap(slice, options.slice_size);
+        }
     }
+    munmap(slice_usage, options.max_slice_count * sizeof(SliceUsage));
     munmap(metadata, 4096);
-    close(metadata_fd);
+}
+
+bool Database::exists(const std::string &dir, int id) {
+    struct stat st = {};
+    return stat((dir + "." + std::to_string(id) + ".metadata").c_str(), &st) == 0;
 }
 
 RetCode Database::write(const PolarString &key, const PolarString &value) {
-    pthread_rwlock_wrlock(&rwlock);
+    if (__glibc_unlikely(key.size() > MAX_KEY_LENGTH)) {
+        return polar_race::kInvalidArgument;
+    }
 //    printf("DB Shard %d write %s with %s\n", id, key.data(), value.data());
-    auto data_length = (uint16_t) value.size();
-    if (__glibc_unlikely(data_length + metadata->currentOffset > SLICE_SIZE)) {
-        // use a new slice
-        auto new_slice_fd = createNewSlice();
-        mapSlice(new_slice_fd, metadata->currentSliceNumber);
-        currentSlice = slices[metadata->currentSliceNumber];
-    }
-    memcpy(currentSlice + metadata->currentOffset, value.data(), data_length);
-    index->insert(key, {(int32_t) metadata->currentSliceNumber, metadata->currentOffset, data_length});
-    metadata->currentOffset += value.size();
+    uint64_t sequence;
+    if (__glibc_unlikely(isBlob(key.size(), value.size()))) {
+        IndexData location;
+        auto ret = writeBlob(key, value, location);
+        if (ret == polar_race::kSucc) {
+            ret = publish(key, location, sequence);
+        }
+        if (ret == polar_race::kSucc) {
+            ret = sealBlob(key, location, sequence);
+        }
+        return ret;
+    }
+    // the record is copied without any lock, only the index update is serialized
+    uint32_t slice, offset;
+    auto destination = reserve(record_size(key.size(), value.size()), slice, offset);
+    if (__glibc_unlikely(destination == nullptr)) {
+        return polar_race::kFull;
+    }
+    frame(destination, RECORD_VALUE, key, value);
+    return publish(key, {(int32_t) slice, (uint32_t) (offset + sizeof(RecordHeader)), value.size()}, sequence);
+}
+
+// Writes a record into a slice, returns where the next one starts. The checksum
+// holds the crc of the value and the key only, until stamp completes the header.
+char *Database::frame(char *destination, uint8_t type, const PolarString &key, const PolarString &value) {
+    auto header = reinterpret_cast<RecordHeader*>(destination);
+    header->key_length = (uint16_t) key.size();
+    header->type = type;
+    header->reserved = 0;
+    header->value_length = value.size();
+    header->sequence = 0;
+    auto data = destination + sizeof(RecordHeader);
+    memcpy(data, value.data(), value.size());
+    memcpy(data + value.size(), key.data(), key.size());
+    header->checksum = crc32c(data, value.size() + key.size());
+    return destination + record_size(key.size(), value.size());
+}
+
+// Sequence numbers are handed out with the write lock held, so they follow
+// the order of the index updates. The crc of the value is not computed again,
+// the one of the header is put in front of it.
+void Database::stamp(RecordHeader *header, uint64_t sequence) {
+    header->sequence = sequence;
+    auto crc = crc32c(reinterpret_cast<const char*>(header) + sizeof(header->checksum),
+                      sizeof(RecordHeader) - sizeof(header->checksum));
+    header->checksum = crc32c_combine(crc, header->checksum, header->value_length + header->key_length);
+}
+
+uint32_t Database::checksum(const RecordHeader *header) {
+    auto checked = sizeof(RecordHeader) - sizeof(header->checksum) + header->value_length + header->key_length;
+    return crc32c(reinterpret_cast<const char*>(header) + sizeof(header->checksum), checked);
+}
+
+bool Database::framed(const RecordHeader *header, uint64_t space) {
+    return (header->type == RECORD_VALUE || header->type == RECORD_DELETE) &&
+           header->key_length <= MAX_KEY_LENGTH && header->value_length <= space &&
+           record_size(header->key_length, header->value_length) <= space && checksum(header) == header->checksum;
+}
+
+// whether the record of a value in a slice matches its checksum
+bool Database::intact(const IndexData &data) {
+    auto header = reinterpret_cast<const RecordHeader*>(sliceAt(data.slice) + data.offset - sizeof(RecordHeader));
+    if (__glibc_unlikely(header->value_length != data.length || data.offset < sizeof(RecordHeader) ||
+                         data.offset + data.length + header->key_length > options.slice_size)) {
+        return false;
+    }
+    return checksum(header) == header->checksum;
+}
+
+bool Database::framedAt(const PolarString &key, const IndexData &data) {
+    if ((uint32_t) data.slice >= metadata->sliceCount || data.offset < sizeof(RecordHeader) ||
+        data.offset + data.length + key.size() > options.slice_size) {
+        return false;
+    }
+    auto record = sliceAt(data.slice) + data.offset;
+    auto header = reinterpret_cast<const RecordHeader*>(record - sizeof(RecordHeader));
+    return header->type == RECORD_VALUE && header->value_length == data.length &&
+           header->key_length == key.size() && memcmp(record + data.length, key.data(), key.size()) == 0 &&
+           checksum(header) == header->checksum;
+}
+
+// every reading thread verifies one in verify_read_interval of the values it reads
+bool Database::sampleVerify() const {
+    static thread_local uint32_t reads = 0;
+    if (options.verify_read_interval == 0) {
+        return false;
+    }
+    if (++reads < options.verify_read_interval) {
+        return false;
+    }
+    reads = 0;
+    return true;
+}
+
+RetCode Database::publish(const PolarString &key, const IndexData &data, uint64_t &sequence) {
+    pthread_rwlock_wrlock(&rwlock);
+    // readers seeing an odd or changed version retry their search
+    version.fetch_add(1, std::memory_order_acq_rel);
+    auto ret = publishLocked(key, data, sequence);
+    version.fetch_add(1, std::memory_order_release);
     pthread_rwlock_unlock(&rwlock);
+    return ret;
+}
+
+// Nothing is logged while loading, the checkpoint written at the end makes
+// the whole load durable at once. A crash before leaves the loaded values
+// unindexed in the slices, where RebuildIndex can still find them.
+void Database::beginLoad() {
+    pthread_rwlock_wrlock(&rwlock);
+    // optimistic readers fall back to the lock until the load is complete
+    version.fetch_add(1, std::memory_order_acq_rel);
+    index->beginLoad();
+}
+
+RetCode Database::load(const PolarString &key, const PolarString &value) {
+    if (__glibc_unlikely(key.size() > MAX_KEY_LENGTH)) {
+        return polar_race::kInvalidArgument;
+    }
+    IndexData location;
+    if (__glibc_unlikely(isBlob(key.size(), value.size()))) {
+        auto ret = writeBlob(key, value, location);
+        if (ret != polar_race::kSucc) {
+            return ret;
+        }
+    } else {
+        uint32_t slice, offset;
+        auto length = record_size(key.size(), value.size());
+        auto destination = reserve(length, slice, offset);
+        if (__glibc_unlikely(destination == nullptr)) {
+            return polar_race::kFull;
+        }
+        frame(destination, RECORD_VALUE, key, value);
+        location = {(int32_t) slice, (uint32_t) (offset + sizeof(RecordHeader)), value.size()};
+        published_size[slice] += length;
+        slice_dirty[slice].store(true, std::memory_order_relaxed);
+    }
+    if (__glibc_unlikely(!index->reserve(key.size()))) {
+        retire(location, key.size());
+        return polar_race::kFull;
+    }
+    // the write lock is held since beginLoad, the pairs are stamped in the order they are loaded
+    auto sequence = metadata->sequence.fetch_add(1);
+    if (location.slice >= 0) {
+        stamp(headerOf(location), sequence);
+    } else {
+        auto ret = sealBlob(key, location, sequence);
+        if (ret != polar_race::kSucc) {
+            retire(location, key.size());
+            return ret;
+        }
+    }
+    retire(index->load(key, location), key.size());
     return polar_race::kSucc;
 }
 
-RetCode Database::read(const PolarString &key, std::string *value) {
+RetCode Database::endLoad() {
+    index->endLoad([this](const PolarString &key, const IndexData &data) {
+        retire(data, key.size());
+    });
+    version.fetch_add(1, std::memory_order_release);
+    pthread_rwlock_unlock(&rwlock);
+    sync();
+    return checkpoint((size_t) 0) ? polar_race::kSucc : polar_race::kIOError;
+}
+
+// Stamps a new record and indexes it with the write lock held. A record that
+// can not be indexed is left unstamped, so RebuildIndex does not find it either.
+RetCode Database::publishLocked(const PolarString &key, const IndexData &data, uint64_t &sequence) {
+    sequence = metadata->sequence.fetch_add(1);
+    if (data.slice < 0) {
+        return insertLocked(key, data);
+    }
+    auto header = headerOf(data);
+    auto unstamped = *header;
+    stamp(header, sequence);
+    auto ret = insertLocked(key, data);
+    if (__glibc_unlikely(ret != polar_race::kSucc)) {
+        *header = unstamped;
+    }
+    return ret;
+}
+
+// Indexes a value with the write lock held, and accounts for the value it
+// replaces. Without room to log or index it, the value is dead right away.
+RetCode Database::insertLocked(const PolarString &key, const IndexData &data) {
+    if (data.slice >= 0) {
+        published_size[data.slice] += record_size(key.size(), data.length);
+        slice_dirty[data.slice].store(true, std::memory_order_relaxed);
+    }
+    if (__glibc_unlikely(!index->reserve(key.size()) || !wal->append(LOG_INSERT, key, data))) {
+        retire(data, key.size());
+        return polar_race::kFull;
+    }
+    retire(index->insert(key, data), key.size());
+    return polar_race::kSucc;
+}
+
+// the value is no longer indexed, leave its space to compaction
+void Database::retire(const IndexData &data, size_t key_length) {
+    if (data.slice >= 0) {
+        slice_usage[data.slice].deadBytes.fetch_add(record_size(key_length, data.length), std::memory_order_relaxed);
+    } else if (data.slice == BLOB_SLICE) {
+        dead_blobs.push_back(data.offset);
+    }
+}
+
+RetCode Database::remove(const PolarString &key) {
+    if (__glibc_unlikely(key.size() > MAX_KEY_LENGTH)) {
+        return polar_race::kInvalidArgument;
+    }
+    auto ret = polar_race::kNotFound;
+    pthread_rwlock_wrlock(&rwlock);
+    version.fetch_add(1, std::memory_order_acq_rel);
+    if (index_found(index->search(key))) {
+        if (wal->append(LOG_REMOVE, key, INDEX_NOT_FOUND)) {
+            markDeleted(key);
+            retire(index->remove(key), key.size());
+            ret = polar_race::kSucc;
+        } else {
+            ret = polar_race::kFull;
+        }
+    }
+    version.fetch_add(1, std::memory_order_release);
+    pthread_rwlock_unlock(&rwlock);
+    return ret;
+}
+
+// The deletion is recorded in a slice as well, so that rebuilding the index
+// does not bring the key back. The record stays live until compaction finds
+// no older record of the key left, see relocateDeletions; without space for
+// it, the key is deleted all the same.
+void Database::markDeleted(const PolarString &key) {
+    uint32_t slice, offset;
+    auto length = record_size(key.size(), 0);
+    auto destination = reserve(length, slice, offset);
+    if (__glibc_unlikely(destination == nullptr)) {
+        return;
+    }
+    frame(destination, RECORD_DELETE, key, {});
+    stamp(reinterpret_cast<RecordHeader*>(destination), metadata->sequence.fetch_add(1));
+    published_size[slice] += length;
+    slice_dirty[slice].store(true, std::memory_order_relaxed);
+}
+
+std::string Database::blobFilename(uint32_t blob) const {
+    return file_prefix + "." + std::to_string(blob) + ".blob";
+}
+
+// A blob gets a file of its own and is written sequentially, so a large value
+// costs a single index entry and never wastes the tail of a slice. The key
+// follows the value, and a header follows them once sealBlob has written it.
+RetCode Database::writeBlob(const PolarString &key, const PolarString &value, IndexData &location) {
+    auto blob = metadata->blobCount.fetch_add(1);
+    int fd = open(blobFilename(blob).c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        return polar_race::kIOError;
+    }
+    auto written = write_fully(fd, value.data(), value.size()) &&
+                   write_fully(fd, key.data(), key.size(), value.size());
+    if (written && options.durability != Options::kDurabilityNone) {
+        // a blob is large enough for a flush of its own
+        written = fdatasync(fd) == 0;
+    }
+    close(fd);
+    created_files.store(true);
+    if (!written) {
+        return polar_race::kIOError;
+    }
+    location = {BLOB_SLICE, blob, value.size()};
+    return polar_race::kSucc;
+}
+
+// The trailer is only written once the blob is indexed and has its sequence
+// number, a blob without one is left to compaction by RebuildIndex.
+RetCode Database::sealBlob(const PolarString &key, const IndexData &location, uint64_t sequence) {
+    int fd = open(blobFilename(location.offset).c_str(), O_WRONLY);
+    if (fd < 0) {
+        return polar_race::kIOError;
+    }
+    RecordHeader trailer = {0, (uint16_t) key.size(), RECORD_BLOB, 0, location.length, sequence};
+    trailer.checksum = crc32c(key.data(), key.size(), crc32c(reinterpret_cast<const char*>(&trailer) + sizeof(trailer.checksum),
+                                                             sizeof(trailer) - sizeof(trailer.checksum)));
+    auto written = write_fully(fd, reinterpret_cast<const char*>(&trailer), sizeof(trailer), location.length + key.size());
+    if (written && options.durability != Options::kDurabilityNone) {
+        written = fdatasync(fd) == 0;
+    }
+    close(fd);
+    return written ? polar_race::kSucc : polar_race::kIOError;
+}
+
+RetCode Database::copyValue(const IndexData &data, std::string *value) {
+    if (__glibc_likely(data.slice != BLOB_SLICE)) {
+        if (sampleVerify() && __glibc_unlikely(!intact(data))) {
+            return polar_race::kCorruption;
+        }
+        value->assign(sliceAt(data.slice) + data.offset, data.length);
+        return polar_race::kSucc;
+    }
+    int fd = open(blobFilename(data.offset).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return polar_race::kIOError;
+    }
+    posix_fadvise(fd, 0, data.length, POSIX_FADV_SEQUENTIAL);
+    value->resize(data.length);
+    auto read = read_fully(fd, &(*value)[0], data.length);
+    close(fd);
+    return read ? polar_race::kSucc : polar_race::kIOError;
+}
+
+// Blob files are never modified, so a private read-only mapping is all a view
+// needs; pages are faulted in as the value is consumed.
+BlobMapping *Database::mapBlob(const IndexData &data) {
+    int fd = open(blobFilename(data.offset).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto address = mmap(nullptr, data.length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    madvise(address, data.length, MADV_SEQUENTIAL);
+    return new BlobMapping{address, data.length};
+}
+
+void Database::unmapBlob(void *pin) {
+    auto mapping = static_cast<BlobMapping*>(pin);
+    munmap(mapping->address, mapping->size);
+    delete mapping;
+}
+
+// Records of a batch are copied next to each other in key order, using one
+// reservation per slice instead of one per value, and all of them are put
+// into the index under a single lock.
+RetCode Database::writeBatch(const std::vector<PolarString> &keys, const std::vector<PolarString> &values,
+                             std::vector<uint32_t> &batch) {
+    for (auto i: batch) {
+        if (__glibc_unlikely(keys[i].size() > MAX_KEY_LENGTH)) {
+            return polar_race::kInvalidArgument;
+        }
+    }
+    // stable, so the last of several equal keys is inserted last and wins
+    std::stable_sort(batch.begin(), batch.end(), [&keys](uint32_t a, uint32_t b) {
+        return fast_string_cmp(keys[a], keys[b]) < 0;
+    });
+
+    auto ret = polar_race::kSucc;
+    std::vector<IndexData> locations(batch.size());
+    size_t copied = 0;
+    while (copied < batch.size()) {
+        if (__glibc_unlikely(isBlob(keys[batch[copied]].size(), values[batch[copied]].size()))) {
+            ret = writeBlob(keys[batch[copied]], values[batch[copied]], locations[copied]);
+            if (ret != polar_race::kSucc) {
+                break;
+            }
+            ++copied;
+            continue;
+        }
+        // take as many of the following values as fit into one slice
+        size_t end = copied;
+        uint32_t total_length = 0;
+        while (end < batch.size() && !isBlob(keys[batch[end]].size(), values[batch[end]].size()) &&
+               total_length + record_size(keys[batch[end]].size(), values[batch[end]].size()) <= options.slice_size) {
+            total_length += record_size(keys[batch[end]].size(), values[batch[end]].size());
+            ++end;
+        }
+        uint32_t slice, offset;
+        auto destination = reserve(total_length, slice, offset);
+        if (__glibc_unlikely(destination == nullptr)) {
+            ret = polar_race::kFull;
+            break;
+        }
+        for (; copied < end; ++copied) {
+            auto &key = keys[batch[copied]];
+            auto &value = values[batch[copied]];
+            locations[copied] = {(int32_t) slice, (uint32_t) (offset + sizeof(RecordHeader)), value.size()};
+            offset += record_size(key.size(), value.size());
+            destination = frame(destination, RECORD_VALUE, key, value);
+        }
+    }
+
+    // the values written before running out of space are still indexed, later
+    // values of a key get higher sequence numbers, like they win in the index
+    std::vector<std::pair<size_t, uint64_t>> blobs;
+    if (copied > 0) {
+        pthread_rwlock_wrlock(&rwlock);
+        version.fetch_add(1, std::memory_order_acq_rel);
+        for (size_t i = 0; i < copied; ++i) {
+            uint64_t sequence;
+            auto status = publishLocked(keys[batch[i]], locations[i], sequence);
+            if (status != polar_race::kSucc) {
+                ret = status;
+            } else if (locations[i].slice == BLOB_SLICE) {
+                blobs.emplace_back(i, sequence);
+            }
+        }
+        version.fetch_add(1, std::memory_order_release);
+        pthread_rwlock_unlock(&rwlock);
+    }
+    for (auto &blob: blobs) {
+        auto status = sealBlob(keys[batch[blob.first]], locations[blob.first], blob.second);
+        if (status != polar_race::kSucc) {
+            ret = status;
+        }
+    }
+    return ret;
+}
+
+// Records are verified under the read lock in small chunks of the index: a
+// value indexed at that moment cannot be reclaimed before the lock is dropped.
+void Database::scrub(bool throttled, const std::atomic<bool> *cancel, polar_race::ScrubReport *report) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t verified = 0;
+    uint64_t cursor = 0;
+    do {
+        if (cancel != nullptr && cancel->load()) {
+            break;
+        }
+        pthread_rwlock_rdlock(&rwlock);
+        cursor = index->scan(cursor, SCRUB_SCAN_CHUNK, [&](const PolarString &key, const IndexData &data) {
+            if (data.slice < 0) {
+                return;
+            }
+            verified += record_size(key.size(), data.length);
+            auto record = sliceAt(data.slice) + data.offset;
+            auto header = reinterpret_cast<const RecordHeader*>(record - sizeof(RecordHeader));
+            if (__glibc_unlikely(!intact(data) || header->key_length != key.size() ||
+                                 memcmp(record + data.length, key.data(), key.size()) != 0)) {
+                polar_race::CorruptedValue corrupted;
+                corrupted.key = key.ToString();
+                corrupted.shard = (uint32_t) id;
+                corrupted.slice = data.slice;
+                corrupted.offset = data.offset;
+                corrupted.length = data.length;
+                report->corrupted.push_back(std::move(corrupted));
+            }
+        });
+        pthread_rwlock_unlock(&rwlock);
+        if (throttled) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(verified * 1000000 / SCRUB_BYTES_PER_SECOND));
+        }
+    } while (cursor != 0);
+    report->verified_bytes += verified;
+}
+
+// Values are relocated in chunks of one index scan, and a slice is only
+// reclaimed once a complete scan found no more live values in it. Moving
+// values goes through reserve() like any write; the index is updated only
+// for keys that were not overwritten in the meantime.
+RetCode Database::compact(bool throttled, const std::atomic<bool> *cancel, bool *progress) {
+    pthread_mutex_lock(&compaction_lock);
+    *progress = reclaimBlobs();
+
+    std::vector<uint32_t> victims;
+    std::vector<bool> is_victim(options.max_slice_count, false);
     pthread_rwlock_rdlock(&rwlock);
+    auto current = (uint32_t) (metadata->currentPosition.load() >> 32);
+    for (uint32_t i = 0; i < metadata->sliceCount; ++i) {
+        if (i == current || slice_usage[i].state != SLICE_IN_USE ||
+            published_size[i] < sealed_size[i].load() ||
+            slice_usage[i].deadBytes.load() * COMPACTION_DEAD_FRACTION < options.slice_size) {
+            continue;
+        }
+        victims.push_back(i);
+        is_victim[i] = true;
+    }
+    pthread_rwlock_unlock(&rwlock);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t moved = 0;
+    uint64_t cursor = 0;
+    auto ret = polar_race::kSucc;
+    bool complete = !victims.empty();
+    while (complete) {
+        if (cancel != nullptr && cancel->load()) {
+            complete = false;
+            break;
+        }
+        std::vector<Relocation> batch;
+        pthread_rwlock_rdlock(&rwlock);
+        cursor = index->scan(cursor, COMPACTION_SCAN_CHUNK, [&](const PolarString &key, const IndexData &data) {
+            if (data.slice >= 0 && is_victim[data.slice]) {
+                batch.push_back({key.ToString(), data, INDEX_NOT_FOUND, false});
+            }
+        });
+        pthread_rwlock_unlock(&rwlock);
+        if (!batch.empty()) {
+            size_t moved_values = 0;
+            ret = relocate(batch, &moved_values);
+            *progress |= moved_values > 0;
+            if (ret != polar_race::kSucc) {
+                complete = false;
+                break;
+            }
+            for (auto &relocation: batch) {
+                moved += record_size(relocation.key.size(), relocation.from.length);
+            }
+            if (throttled) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(moved * 1000000 / COMPACTION_BYTES_PER_SECOND));
+            }
+        }
+        if (cursor == 0) break;
+    }
+    if (complete) {
+        ret = relocateDeletions(victims);
+        complete = ret == polar_race::kSucc;
+    }
+
+    if (complete) {
+        if (options.durability != Options::kDurabilityNone) {
+            // the moved values must be found at their new places after a crash
+            sync();
+        }
+        for (auto slice: victims) {
+            *progress |= reclaimSlice(slice);
+        }
+    }
+    pthread_mutex_unlock(&compaction_lock);
+    // the key arena reclaims removed keys only after a checkpoint
+    pthread_rwlock_rdlock(&rwlock);
+    auto keys_waiting = index->keysAwaitCheckpoint();
+    pthread_rwlock_unlock(&rwlock);
+    if (keys_waiting) {
+        checkpoint(true);
+    }
+    return ret;
+}
+
+// A deletion record stays live as long as an older record of its key may be
+// left elsewhere: in any other slice started before the record was written, or
+// in a blob not unlinked yet. Such records are moved out of the victims like
+// values, unless the key was written again since.
+RetCode Database::relocateDeletions(const std::vector<uint32_t> &victims) {
+    std::vector<uint64_t> oldest_other(victims.size(), UINT64_MAX);
+    pthread_rwlock_rdlock(&rwlock);
+    bool blobs_left = !dead_blobs.empty();
+    for (size_t i = 0; i < victims.size(); ++i) {
+        for (uint32_t slice = 0; slice < metadata->sliceCount; ++slice) {
+            if (slice != victims[i] && slice_usage[slice].state == SLICE_IN_USE) {
+                oldest_other[i] = std::min(oldest_other[i], slice_usage[slice].startSequence.load());
+            }
+        }
+    }
+    pthread_rwlock_unlock(&rwlock);
+
+    // victims are full and no longer written, they are read without a lock
+    std::vector<Relocation> batch;
+    for (size_t i = 0; i < victims.size(); ++i) {
+        auto base = sliceAt(victims[i]);
+        uint64_t offset = 0;
+        while (offset + sizeof(RecordHeader) <= options.slice_size) {
+            auto header = reinterpret_cast<const RecordHeader*>(base + offset);
+            if (!framed(header, options.slice_size - offset)) {
+                offset += 8;
+                continue;
+            }
+            if (header->type == RECORD_DELETE && (blobs_left || header->sequence >= oldest_other[i])) {
+                auto key = base + offset + sizeof(RecordHeader);
+                batch.push_back({std::string(key, header->key_length),
+                                 {(int32_t) victims[i], (uint32_t) (offset + sizeof(RecordHeader)), 0},
+                                 INDEX_NOT_FOUND, true});
+            }
+            offset += record_size(header->key_length, header->value_length);
+        }
+    }
+    size_t moved = 0;
+    return batch.empty() ? polar_race::kSucc : relocate(batch, &moved);
+}
+
+// Copies the records to the current slice, then points the index at the
+// copies. Values overwritten meanwhile and deletion records do not count as
+// moved: copying them alone frees nothing.
+RetCode Database::relocate(std::vector<Relocation> &batch, size_t *moved) {
+    auto ret = polar_race::kSucc;
+    *moved = 0;
+    size_t copied = 0;
+    for (; copied < batch.size(); ++copied) {
+        auto &relocation = batch[copied];
+        uint32_t slice, offset;
+        auto length = record_size(relocation.key.size(), relocation.from.length);
+        auto destination = reserve(length, slice, offset);
+        if (__glibc_unlikely(destination == nullptr)) {
+            ret = polar_race::kFull;
+            break;
+        }
+        // the checksum moves along, a corrupted record stays corrupted
+        memcpy(destination, sliceAt(relocation.from.slice) + relocation.from.offset - sizeof(RecordHeader), length);
+        relocation.to = {(int32_t) slice, (uint32_t) (offset + sizeof(RecordHeader)), relocation.from.length};
+    }
+
+    pthread_rwlock_wrlock(&rwlock);
+    version.fetch_add(1, std::memory_order_acq_rel);
+    for (size_t i = 0; i < copied; ++i) {
+        auto &relocation = batch[i];
+        auto &current = index->search(relocation.key);
+        if (relocation.deletion) {
+            // the copy is dead right away if the key was written again since
+            auto length = record_size(relocation.key.size(), 0);
+            published_size[relocation.to.slice] += length;
+            slice_dirty[relocation.to.slice].store(true, std::memory_order_relaxed);
+            if (index_found(current)) {
+                slice_usage[relocation.to.slice].deadBytes.fetch_add(length, std::memory_order_relaxed);
+            }
+        } else if (current.slice == relocation.from.slice && current.offset == relocation.from.offset) {
+            // the old value stays indexed, and its slice is not reclaimed
+            if (insertLocked(relocation.key, relocation.to) != polar_race::kSucc) {
+                ret = polar_race::kFull;
+            } else {
+                ++*moved;
+            }
+        } else {
+            // overwritten since the scan, the copy is dead right away
+            auto length = record_size(relocation.key.size(), relocation.to.length);
+            published_size[relocation.to.slice] += length;
+            slice_usage[relocation.to.slice].deadBytes.fetch_add(length, std::memory_order_relaxed);
+        }
+    }
+    version.fetch_add(1, std::memory_order_release);
+    pthread_rwlock_unlock(&rwlock);
+    batch.resize(copied);
+    return ret;
+}
+
+// Punch the slice out of its file and hand it to switchSlice for reuse. The
+// mapping stays valid (it reads zeros), readers that still copy from it notice
+// the epoch change, and pinned views keep it from being reclaimed at all.
+bool Database::reclaimSlice(uint32_t slice) {
+    relocation_epoch.fetch_add(1);
+    if (slice_pins[slice].load() != 0) {
+        // try again on the next compaction
+        return false;
+    }
+    int data_fd = open(sliceFilename(slice).c_str(), O_RDWR);
+    if (data_fd < 0) {
+        return false;
+    }
+    fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, options.slice_size);
+    close(data_fd);
+    pthread_mutex_lock(&slice_lock);
+    slice_usage[slice].deadBytes.store(0);
+    slice_usage[slice].state.store(SLICE_FREE);
+    free_slices.push_back(slice);
+    pthread_mutex_unlock(&slice_lock);
+    return true;
+}
+
+bool Database::reclaimBlobs() {
+    std::vector<uint32_t> blobs;
+    pthread_rwlock_wrlock(&rwlock);
+    blobs.swap(dead_blobs);
+    pthread_rwlock_unlock(&rwlock);
+    if (blobs.empty()) {
+        return false;
+    }
+    if (options.durability != Options::kDurabilityNone) {
+        // whatever replaced the blobs is flushed before they are gone
+        sync();
+    }
+    // readers that looked a blob up before it was replaced retry
+    relocation_epoch.fetch_add(1);
+    for (auto blob: blobs) {
+        unlink(blobFilename(blob).c_str());
+    }
+    // deletion records of their keys may be dropped from now on
+    sync_parent_directory(file_prefix);
+    return true;
+}
+
+// claim length bytes in the current slice, moving on to a new slice when it is full,
+// returns nullptr when the shard has used up all its slices
+char *Database::reserve(uint32_t length, uint32_t &slice, uint32_t &offset) {
+    while (true) {
+        auto position = metadata->currentPosition.fetch_add(length);
+        slice = (uint32_t) (position >> 32);
+        offset = (uint32_t) position;
+        if (__glibc_likely(offset + length <= options.slice_size)) {
+            if (__glibc_unlikely(offset + length == options.slice_size)) {
+                sealed_size[slice].store(options.slice_size);
+            }
+            return sliceAt(slice) + offset;
+        }
+        if (offset < options.slice_size) {
+            // this is the first reservation that did not fit, the slice ends here
+            sealed_size[slice].store(offset);
+        }
+        if (!switchSlice(slice)) {
+            return nullptr;
+        }
+    }
+}
+
+bool Database::switchSlice(uint32_t full_slice) {
+    bool success = true;
+    pthread_mutex_lock(&slice_lock);
+    // only the first writer that overflowed the slice creates the next one
+    if ((metadata->currentPosition.load() >> 32) == full_slice) {
+        auto new_slice = metadata->sliceCount;
+        if (!free_slices.empty()) {
+            // reuse a slice reclaimed by compaction
+            new_slice = free_slices.back();
+            free_slices.pop_back();
+            startSlice(new_slice);
+            metadata->currentPosition.store((uint64_t) new_slice << 32);
+        } else if (new_slice < options.max_slice_count) {
+            createNewSlice();
+            slices[new_slice].store(mapSlice(new_slice), std::memory_order_release);
+            startSlice(new_slice);
+            metadata->currentPosition.store((uint64_t) new_slice << 32);
+        } else {
+            // rewind the failed reservations, so the offset can never overflow into the slice number
+            metadata->currentPosition.store((uint64_t) full_slice << 32 | options.slice_size);
+            success = false;
+        }
+    }
+    pthread_mutex_unlock(&slice_lock);
+    return success;
+}
+
+void Database::startSlice(uint32_t slice) {
+    slice_usage[slice].startSequence.store(metadata->sequence.load());
+    slice_usage[slice].deadBytes.store(0);
+    slice_usage[slice].state.store(SLICE_IN_USE);
+    sealed_size[slice].store(UINT32_MAX);
+    published_size[slice] = 0;
+}
+
+// Values reach the disk before the log records that refer to them: the log is
+// only flushed up to its length before the slices were. Records logged since
+// may reach the disk ahead of their values anyway, see initIndex.
+void Database::sync() {
+    pthread_mutex_lock(&sync_lock);
+    pthread_rwlock_rdlock(&rwlock);
+    auto logged = wal->size();
+    pthread_rwlock_unlock(&rwlock);
+    syncSlices();
+    if (created_files.exchange(false)) {
+        sync_parent_directory(file_prefix);
+    }
+    wal->sync(logged);
+    msync(slice_usage, options.max_slice_count * sizeof(SliceUsage), MS_SYNC);
+    msync(metadata, 4096, MS_SYNC);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+void Database::syncSlices() {
+    for (uint32_t i = 0; i < metadata->sliceCount; ++i) {
+        if (slice_dirty[i].exchange(false)) {
+            msync(sliceAt(i), options.slice_size, MS_SYNC);
+        }
+    }
+}
+
+// The log is switched to the next generation and the index is copied, both
+// while no writer is active, so the checkpoint of that generation holds
+// exactly the updates logged before. The copy is written without the lock. Until the checkpoint
+// is renamed into place, the older checkpoint and logs are still in use
+// (see initIndex), and they are deleted once the metadata refers to it.
+bool Database::checkpoint(bool force) {
+    return checkpoint(force ? 1 : CHECKPOINT_LOG_SIZE);
+}
+
+bool Database::checkpoint(size_t min_log_size) {
+    pthread_mutex_lock(&sync_lock);
+    // readers go on, writers wait until the index is copied in memory
+    pthread_rwlock_rdlock(&rwlock);
+    if (wal->size() < min_log_size) {
+        pthread_rwlock_unlock(&rwlock);
+        pthread_mutex_unlock(&sync_lock);
+        return false;
+    }
+    auto generation = log_generation + 1;
+    auto filename = Index::filename(options.index_type, file_prefix, generation);
+    auto temp_filename = filename + ".tmp";
+    std::unique_ptr<WriteAheadLog> old_wal(new WriteAheadLog(logFilename(generation)));
+    old_wal.swap(wal);
+    log_generation = generation;
+    created_files.store(true);
+    Index::Snapshot snapshot;
+    index->snapshot(&snapshot);
+    // the new log does not mention the blobs replaced before the copy
+    auto dead = dead_blobs;
+    pthread_rwlock_unlock(&rwlock);
+
+    int fd = open(temp_filename.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    auto written = fd >= 0 && Index::writeSnapshot(fd, snapshot) && fdatasync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    snapshot.image.reset();
+    written = written && writeDeadBlobs(deadBlobsFilename(generation), dead);
+    // the checkpoint and the old log refer to values stored up to now
+    syncSlices();
+    if (options.durability != Options::kDurabilityNone) {
+        // updates waiting for a flush were logged to the old log
+        old_wal->sync();
+    }
+    if (written) {
+        // the checkpoint refers to keys stored up to now
+        index->sync();
+        written = rename(temp_filename.c_str(), filename.c_str()) == 0;
+    }
+    if (written) {
+        sync_parent_directory(filename);
+        auto previous = metadata->generation;
+        metadata->generation = generation;
+        msync(metadata, 4096, MS_SYNC);
+        // no checkpoint left to recover from refers to the keys removed before the copy
+        pthread_rwlock_wrlock(&rwlock);
+        index->checkpointed();
+        pthread_rwlock_unlock(&rwlock);
+        old_wal.reset();
+        for (auto i = previous; i < generation; ++i) {
+            unlink(Index::filename(options.index_type, file_prefix, i).c_str());
+            unlink(logFilename(i).c_str());
+            unlink(deadBlobsFilename(i).c_str());
+        }
+    } else {
+        // replayed from the older checkpoint, together with the new log
+        unlink(temp_filename.c_str());
+        unlink(deadBlobsFilename(generation).c_str());
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return written;
+}
+
+// Checkpoints, logs and the key arena of the shard are removed first, so the
+// shard opens with an empty index, which is then filled from the records in
+// the slices and blob files.
+RetCode Database::rebuild(const std::string &dir, int id, const Options &options) {
+    auto file_prefix = dir + "." + std::to_string(id);
+    glob_t files;
+    if (glob((file_prefix + ".*").c_str(), 0, nullptr, &files) == 0) {
+        for (size_t i = 0; i < files.gl_pathc; ++i) {
+            std::string filename = files.gl_pathv[i];
+            auto suffix = filename.substr(filename.rfind('.'));
+            if (suffix == ".index" || suffix == ".bptree" || suffix == ".hash" || suffix == ".log" ||
+                suffix == ".tmp" || suffix == ".keys" || suffix == ".dead") {
+                unlink(filename.c_str());
+            }
+        }
+    }
+    globfree(&files);
+    Database db(dir, id, options);
+    return db.rebuildIndex();
+}
+
+// Of all records of a key, the one with the highest sequence number is the
+// current one, and the key stays deleted if that is a deletion. Slices are
+// read sequentially; a record that is torn or corrupted is skipped 8 bytes
+// at a time until the next one that matches its checksum. Nobody else has
+// the shard yet, so the index is bulk loaded without the lock and without a
+// log, and a checkpoint is written at the end.
+//
+// The latest record of every key is kept in memory until all files are read.
+// Keys are not copied out of the mapped slices, still a rebuild needs about
+// 100 bytes of memory per key of the shard.
+RetCode Database::rebuildIndex() {
+    struct Latest {
+        uint64_t sequence;
+        uint8_t type;
+        IndexData data;
+    };
+    struct KeyHash {
+        size_t operator()(const PolarString &key) const { return key_hash(key); }
+    };
+    std::unordered_map<PolarString, Latest, KeyHash> latest;
+    // keys of blobs, which are not mapped
+    std::deque<std::string> blob_keys;
+    auto consider = [&latest](const RecordHeader *header, const char *key, const IndexData &data) {
+        auto inserted = latest.emplace(PolarString(key, header->key_length), Latest{header->sequence, header->type, data});
+        auto &current = inserted.first->second;
+        if (!inserted.second && current.sequence < header->sequence) {
+            current = {header->sequence, header->type, data};
+        }
+    };
+    auto max_sequence = metadata->sequence.load();
+
+    // bytes of complete records in every slice, the ones not indexed in the end are dead
+    std::vector<uint64_t> framed_size(metadata->sliceCount, 0);
+    auto position = metadata->currentPosition.load();
+    auto current_slice = (uint32_t) (position >> 32);
+    for (uint32_t slice = 0; slice < metadata->sliceCount; ++slice) {
+        if (slice_usage[slice].state == SLICE_FREE) {
+            continue;
+        }
+        uint64_t limit = options.slice_size;
+        if (slice == current_slice && (uint32_t) position < limit) {
+            limit = (uint32_t) position;
+        }
+        auto base = sliceAt(slice);
+        // unlike reads, the scan can use read-ahead
+        madvise(base, options.slice_size, MADV_SEQUENTIAL);
+        uint64_t offset = 0;
+        while (offset + sizeof(RecordHeader) <= limit) {
+            auto header = reinterpret_cast<const RecordHeader*>(base + offset);
+            if (!framed(header, limit - offset)) {
+                offset += 8;
+                continue;
+            }
+            auto value_offset = offset + sizeof(RecordHeader);
+            consider(header, base + value_offset + header->value_length,
+                     {(int32_t) slice, (uint32_t) value_offset, header->value_length});
+            max_sequence = std::max(max_sequence, header->sequence + 1);
+            offset += record_size(header->key_length, header->value_length);
+            framed_size[slice] += record_size(header->key_length, header->value_length);
+        }
+    }
+
+    for (uint32_t blob = 0; blob < metadata->blobCount; ++blob) {
+        int fd = open(blobFilename(blob).c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat st = {};
+        fstat(fd, &st);
+        RecordHeader trailer = {};
+        char key[MAX_KEY_LENGTH];
+        auto size = (uint64_t) st.st_size;
+        if (size >= sizeof(trailer) && read_fully(fd, reinterpret_cast<char*>(&trailer), sizeof(trailer), size - sizeof(trailer)) &&
+            trailer.type == RECORD_BLOB && trailer.key_length <= MAX_KEY_LENGTH &&
+            trailer.value_length + trailer.key_length + sizeof(trailer) == size &&
+            read_fully(fd, key, trailer.key_length, trailer.value_length) &&
+            crc32c(key, trailer.key_length, crc32c(reinterpret_cast<const char*>(&trailer) + sizeof(trailer.checksum),
+                                                  sizeof(trailer) - sizeof(trailer.checksum))) == trailer.checksum) {
+            blob_keys.emplace_back(key, trailer.key_length);
+            consider(&trailer, blob_keys.back().data(), {BLOB_SLICE, blob, trailer.value_length});
+            max_sequence = std::max(max_sequence, trailer.sequence + 1);
+        }
+        close(fd);
+    }
+
+    // sorted, so that an AVL tree is linked bottom-up in a single pass
+    std::vector<std::pair<const PolarString*, const IndexData*>> entries;
+    std::vector<uint64_t> live_size(metadata->sliceCount, 0);
+    for (auto &entry: latest) {
+        if (entry.second.type != RECORD_DELETE) {
+            entries.emplace_back(&entry.first, &entry.second.data);
+        } else {
+            // the latest deletion of a key stays live, see relocateDeletions
+            live_size[entry.second.data.slice] += record_size(entry.first.size(), 0);
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const std::pair<const PolarString*, const IndexData*> &a,
+                                                  const std::pair<const PolarString*, const IndexData*> &b) {
+        return fast_string_cmp(*a.first, *b.first) < 0;
+    });
+    std::vector<bool> live_blob(metadata->blobCount, false);
+    index->beginLoad();
+    for (auto &entry: entries) {
+        if (!index->reserve(entry.first->size())) {
+            index->endLoad([](const PolarString &, const IndexData &) {});
+            return polar_race::kFull;
+        }
+        index->load(*entry.first, *entry.second);
+        if (entry.second->slice >= 0) {
+            live_size[entry.second->slice] += record_size(entry.first->size(), entry.second->length);
+        } else {
+            live_blob[entry.second->offset] = true;
+        }
+    }
+    // the keys are unique, none is dropped
+    index->endLoad([](const PolarString &, const IndexData &) {});
+    for (uint32_t slice = 0; slice < metadata->sliceCount; ++slice) {
+        if (slice_usage[slice].state != SLICE_FREE) {
+            slice_usage[slice].deadBytes.store(framed_size[slice] - live_size[slice]);
+        }
+    }
+    metadata->sequence.store(max_sequence);
+
+    sync();
+    if (!checkpoint((size_t) 0)) {
+        return polar_race::kIOError;
+    }
+    // the checkpoint no longer refers to them
+    for (uint32_t blob = 0; blob < live_blob.size(); ++blob) {
+        if (!live_blob[blob]) {
+            unlink(blobFilename(blob).c_str());
+        }
+    }
+    return polar_race::kSucc;
+}
+
+// Readers do not touch any shared cache line: the index is searched
+// optimistically and the result is kept only if no writer changed the index
+// meanwhile. Values only move when compaction relocates them, which is
+// detected by the relocation epoch after the copy.
+RetCode Database::read(const PolarString &key, std::string *value) {
 //    printf("DB Shard %d read %s\n", id, key.data());
-    auto result = index->search(key);
-    if (__glibc_unlikely(result.slice == -1)) {
+    while (true) {
+        auto epoch = relocation_epoch.load(std::memory_order_acquire);
+        IndexData result;
+        if (__glibc_unlikely(!optimisticSearch(key, result))) {
+            // too much write contention, fall back to the lock
+            pthread_rwlock_rdlock(&rwlock);
+            result = index->search(key);
+            pthread_rwlock_unlock(&rwlock);
+        }
+        if (__glibc_unlikely(!index_found(result))) {
+//            printf("Not Found\n");
+            return polar_race::kNotFound;
+        }
+//        printf("Found %s\n", value->c_str());
+        auto ret = copyValue(result, value);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (__glibc_likely(relocation_epoch.load(std::memory_order_relaxed) == epoch)) {
+            return ret;
+        }
+    }
+}
+
+bool Database::optimisticSearch(const PolarString &key, IndexData &result) {
+    for (int i = 0; i < OPTIMISTIC_READ_RETRIES; ++i) {
+        auto before = version.load(std::memory_order_acquire);
+        if (before & 1) {
+            __builtin_ia32_pause();
+            continue;
+        }
+        result = index->search(key);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The pin is taken before the search is validated: anything retiring a slice
+// changes the index (and thus the version) first and waits for its pins to
+// drop afterwards, so a validated pin always refers to a live slice.
+RetCode Database::readPinned(const PolarString &key, polar_race::ReadView *view) {
+    auto epoch = relocation_epoch.load(std::memory_order_acquire);
+    IndexData result;
+    std::atomic<uint32_t> *pin = nullptr;
+    bool validated = false;
+    for (int i = 0; i < OPTIMISTIC_READ_RETRIES && !validated; ++i) {
+        auto before = version.load(std::memory_order_acquire);
+        if (before & 1) {
+            __builtin_ia32_pause();
+            continue;
+        }
+        result = index->search(key);
+        // a torn search may return anything, keep it within the pin array
+        if (result.slice >= 0 && (uint32_t) result.slice < options.max_slice_count) {
+            pin = &slice_pins[result.slice];
+            pin->fetch_add(1);
+        }
+        validated = version.load() == before;
+        if (!validated && pin != nullptr) {
+            pin->fetch_sub(1);
+            pin = nullptr;
+        }
+    }
+    if (__glibc_unlikely(!validated)) {
+        pthread_rwlock_rdlock(&rwlock);
+        result = index->search(key);
+        // blobs are not in a slice and need no pin
+        if (result.slice >= 0) {
+            pin = &slice_pins[result.slice];
+            pin->fetch_add(1);
+        }
         pthread_rwlock_unlock(&rwlock);
-//        printf("Not Found\n");
+    }
+    if (__glibc_unlikely(!index_found(result))) {
+        view->Reset();
         return polar_race::kNotFound;
     }
-    auto slice = slices[result.slice];
-    value->assign(slice + result.offset, result.length);
-//    printf("Found %s\n", value->c_str());
-    pthread_rwlock_unlock(&rwlock);
+    if (__glibc_unlikely(result.slice == BLOB_SLICE)) {
+        // the mapping keeps the blob alive by itself
+        auto mapping = mapBlob(result);
+        if (mapping == nullptr) {
+            if (relocation_epoch.load() != epoch) {
+                // the blob was overwritten and deleted meanwhile
+                return readPinned(key, view);
+            }
+            view->Reset();
+            return polar_race::kIOError;
+        }
+        view->Pin({(char*) mapping->address, mapping->size}, unmapBlob, mapping);
+        return polar_race::kSucc;
+    }
+    if (sampleVerify() && __glibc_unlikely(!intact(result))) {
+        unpinSlice(pin);
+        view->Reset();
+        return polar_race::kCorruption;
+    }
+    view->Pin({sliceAt(result.slice) + result.offset, result.length}, unpinSlice, pin);
+    return polar_race::kSucc;
+}
+
+void Database::unpinSlice(void *pin) {
+    static_cast<std::atomic<uint32_t>*>(pin)->fetch_sub(1, std::memory_order_release);
+}
+
+// The whole batch is searched at once and validated by a single version
+// check, and the value of the next key is prefetched while one is copied.
+void Database::readBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                         std::vector<std::string> &values, std::vector<RetCode> &statuses) {
+    std::vector<IndexData> results(batch.size());
+    uint64_t epoch;
+    do {
+        epoch = relocation_epoch.load(std::memory_order_acquire);
+        if (__glibc_unlikely(!optimisticSearchBatch(keys, batch, results.data()))) {
+            pthread_rwlock_rdlock(&rwlock);
+            index->searchBatch(keys, batch, results.data());
+            pthread_rwlock_unlock(&rwlock);
+        }
+        copyBatch(batch, results, values, statuses);
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (__glibc_unlikely(relocation_epoch.load(std::memory_order_relaxed) != epoch));
+}
+
+void Database::copyBatch(const std::vector<uint32_t> &batch, const std::vector<IndexData> &results,
+                         std::vector<std::string> &values, std::vector<RetCode> &statuses) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (i + 1 < batch.size() && results[i + 1].slice >= 0) {
+            __builtin_prefetch(sliceAt(results[i + 1].slice) + results[i + 1].offset - sizeof(RecordHeader));
+        }
+        auto &result = results[i];
+        if (__glibc_unlikely(!index_found(result))) {
+            statuses[batch[i]] = polar_race::kNotFound;
+            continue;
+        }
+        statuses[batch[i]] = copyValue(result, &values[batch[i]]);
+    }
+}
+
+bool Database::optimisticSearchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                                     IndexData *results) {
+    for (int i = 0; i < OPTIMISTIC_READ_RETRIES; ++i) {
+        auto before = version.load(std::memory_order_acquire);
+        if (before & 1) {
+            __builtin_ia32_pause();
+            continue;
+        }
+        index->searchBatch(keys, batch, results);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (version.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Database::Iterator::Iterator(Database *db, const PolarString &lower):
+    db(db), resume_key(lower.ToString()) {
+    fill();
+}
+
+Database::Iterator::~Iterator() {
+    release();
+}
+
+RetCode Database::Iterator::value(PolarString *value) const {
+    auto &entry = entries[position];
+    if (__glibc_likely(entry.data.slice != BLOB_SLICE)) {
+        *value = {db->sliceAt(entry.data.slice) + entry.data.offset, entry.data.length};
+        return polar_race::kSucc;
+    }
+    if (entry.blob_map == nullptr) {
+        return polar_race::kIOError;
+    }
+    *value = {(char*) entry.blob_map->address, entry.blob_map->size};
     return polar_race::kSucc;
 }
 
+void Database::Iterator::next() {
+    if (++position == entries.size()) {
+        fill();
+    }
+}
+
+// The pins and mappings are taken with the read lock held: a slice is only
+// reclaimed, and a blob only unlinked, once the index no longer refers to it.
+void Database::Iterator::fill() {
+    release();
+    if (exhausted) {
+        return;
+    }
+    pthread_rwlock_rdlock(&db->rwlock);
+    std::unique_ptr<Index::Iterator> it(db->index->seek(resume_key));
+    if (resume_after && it->valid() && it->key() == PolarString(resume_key)) {
+        it->next();
+    }
+    for (; it->valid() && entries.size() < RANGE_SCAN_CHUNK; it->next()) {
+        auto key = it->key();
+        auto &data = it->data();
+        BlobMapping *blob_map = nullptr;
+        if (data.slice >= 0) {
+            db->slice_pins[data.slice].fetch_add(1);
+        } else {
+            blob_map = db->mapBlob(data);
+        }
+        entries.push_back({keys.size(), key.size(), data, blob_map});
+        keys.append(key.data(), key.size());
+    }
+    exhausted = !it->valid();
+    it.reset();
+    pthread_rwlock_unlock(&db->rwlock);
+    if (!entries.empty()) {
+        auto &last = entries.back();
+        resume_key.assign(keys, last.key_offset, last.key_length);
+        resume_after = true;
+    }
+}
+
+void Database::Iterator::release() {
+    for (auto &entry: entries) {
+        if (entry.data.slice >= 0) {
+            unpinSlice(&db->slice_pins[entry.data.slice]);
+        } else if (entry.blob_map != nullptr) {
+            unmapBlob(entry.blob_map);
+        }
+    }
+    entries.clear();
+    keys.clear();
+    position = 0;
+}
+
+std::string Database::logFilename(uint64_t generation) const {
+    return file_prefix + "." + std::to_string(generation) + ".log";
+}
+
+std::string Database::deadBlobsFilename(uint64_t generation) const {
+    return file_prefix + "." + std::to_string(generation) + ".dead";
+}
+
+// Written before the checkpoint is renamed into place, so a checkpoint never
+// comes without its list. Blobs unlinked since are simply listed in vain.
+bool Database::writeDeadBlobs(const std::string &filename, const std::vector<uint32_t> &blobs) {
+    int fd = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    auto written = write_fully(fd, reinterpret_cast<const char*>(blobs.data()), blobs.size() * sizeof(uint32_t)) &&
+                   fdatasync(fd) == 0;
+    close(fd);
+    return written;
+}
+
+// The index is loaded from its last checkpoint, and the logs written since are
+// replayed onto it in order. Logs are numbered from the generation of that
+// checkpoint on; a checkpoint that a crash kept from being recorded in the
+// metadata is found next to the log of its generation.
 void Database::initIndex() {
-    auto index_filename = file_prefix + ".index";
-    index = new IndexTree(index_filename);
+    auto first = metadata->generation;
+    auto generation = first;
+    auto last_log = first;
+    for (auto i = first + 1; access(logFilename(i).c_str(), F_OK) == 0; ++i) {
+        last_log = i;
+        if (access(Index::filename(options.index_type, file_prefix, i).c_str(), F_OK) == 0) {
+            generation = i;
+        }
+    }
+    unlink((Index::filename(options.index_type, file_prefix, last_log) + ".tmp").c_str());
+    for (auto i = first; i < generation; ++i) {
+        unlink(Index::filename(options.index_type, file_prefix, i).c_str());
+        unlink(logFilename(i).c_str());
+        unlink(deadBlobsFilename(i).c_str());
+    }
+    metadata->generation = generation;
+
+    index = Index::create(options.index_type, file_prefix, generation, options.initial_index_size);
+    // blobs replaced before the checkpoint, those replaced since are found in the logs
+    int dead_fd = open(deadBlobsFilename(generation).c_str(), O_RDONLY);
+    if (dead_fd >= 0) {
+        struct stat st = {};
+        fstat(dead_fd, &st);
+        dead_blobs.resize(st.st_size / sizeof(uint32_t));
+        if (!read_fully(dead_fd, reinterpret_cast<char*>(dead_blobs.data()), dead_blobs.size() * sizeof(uint32_t))) {
+            dead_blobs.clear();
+        }
+        close(dead_fd);
+    }
+    for (auto i = generation; i <= last_log; ++i) {
+        wal.reset(new WriteAheadLog(logFilename(i)));
+        wal->replay([this](uint8_t type, const PolarString &key, const IndexData &data) {
+            // a record that reached the disk without (all of) its value is
+            // a lost update, the key keeps its older value
+            if (type == LOG_INSERT && data.slice >= 0 && !framedAt(key, data)) {
+                return;
+            }
+            auto replaced = type == LOG_INSERT ? index->insert(key, data) : index->remove(key);
+            // dead bytes of slices were counted in the usage file already,
+            // dead blobs are only listed up to the checkpoint
+            if (replaced.slice == BLOB_SLICE) {
+                dead_blobs.push_back(replaced.offset);
+            }
+        });
+    }
+    log_generation = last_log;
 }
 
 void Database::initSlices() {
-    metadata_fd = open((file_prefix + ".metadata").c_str(), O_RDWR|O_CREAT, 0644);
+    int metadata_fd = open((file_prefix + ".metadata").c_str(), O_RDWR|O_CREAT, 0644);
     assert(metadata_fd > 0);
     struct stat st = {};
     fstat(metadata_fd, &st);
@@ -84,42 +1385,92 @@ void Database::initSlices() {
 
     metadata = reinterpret_cast<DatabaseMetadata*>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, metadata_fd, 0));
     assert(metadata != MAP_FAILED);
+    // the mapping stays valid after the descriptor is closed
+    close(metadata_fd);
 
     if (need_init) {
         metadata->sliceCount = 0;
-        slice_fd[0] = createNewSlice();
-        mapSlice(slice_fd[0], 0);
-        currentSlice = slices[0];
-    } else {
-        for (int i = 0; i < metadata->sliceCount; ++i) {
-            auto filename = file_prefix + "." + std::to_string(i) + ".data";
-            slice_fd[i] = open(filename.c_str(), O_RDWR, 0644);
-            assert(slice_fd[i] > 0);
-            mapSlice(slice_fd[i], i);
+        createNewSlice();
+        metadata->currentPosition = 0;
+        metadata->generation = 0;
+        metadata->sequence = 0;
+    }
+    // existing slices are only mapped when they are first read or written,
+    // so opening a shard costs the same however much data it holds
+    initUsage();
+}
+
+// the usage file is created on demand, stores without one start with every slice in use
+void Database::initUsage() {
+    auto size = options.max_slice_count * sizeof(SliceUsage);
+    int usage_fd = open((file_prefix + ".usage").c_str(), O_RDWR|O_CREAT, 0644);
+    assert(usage_fd > 0);
+    struct stat st = {};
+    fstat(usage_fd, &st);
+    if ((size_t) st.st_size < size) {
+        ftruncate(usage_fd, size);
+    }
+    slice_usage = reinterpret_cast<SliceUsage*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, usage_fd, 0));
+    assert(slice_usage != MAP_FAILED);
+    close(usage_fd);
+
+    auto position = metadata->currentPosition.load();
+    auto current = (uint32_t) (position >> 32);
+    auto offset = (uint32_t) position;
+    for (uint32_t i = 0; i < metadata->sliceCount; ++i) {
+        if (slice_usage[i].state == SLICE_FREE) {
+            free_slices.push_back(i);
+        } else if (i != current) {
+            // no writer is left over from before the restart
+            sealed_size[i].store(0);
         }
-//        printf("%d %d %d\n", *sliceCount, *currentSliceNumber, *currentOffset);
-        currentSlice = slices[metadata->sliceCount - 1];
     }
+    // everything reserved in the current slice before the restart is indexed or lost
+    published_size[current] = offset < options.slice_size ? offset : options.slice_size;
+    if (offset >= options.slice_size) {
+        sealed_size[current].store(options.slice_size);
+    }
+}
 
+char *Database::sliceAt(uint32_t slice_number) {
+    auto slice = slices[slice_number].load(std::memory_order_acquire);
+    if (__glibc_likely(slice != nullptr)) {
+        return slice;
+    }
+    pthread_mutex_lock(&slice_lock);
+    slice = slices[slice_number].load(std::memory_order_relaxed);
+    if (slice == nullptr) {
+        slice = mapSlice(slice_number);
+        slices[slice_number].store(slice, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&slice_lock);
+    return slice;
+}
 
+std::string Database::sliceFilename(uint32_t slice_number) const {
+    return file_prefix + "." + std::to_string(slice_number) + ".data";
 }
 
-int Database::createNewSlice() {
-    auto new_slice_id = metadata->sliceCount;
-    auto filename = file_prefix + "." + std::to_string(new_slice_id) + ".data";
+void Database::createNewSlice() {
+    auto filename = sliceFilename(metadata->sliceCount);
     int data_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
     assert(data_fd > 0);
-    ftruncate(data_fd, SLICE_SIZE);
-    metadata->currentSliceNumber = new_slice_id;
-    metadata->currentOffset = 0;
+    ftruncate(data_fd, options.slice_size);
+    close(data_fd);
     metadata->sliceCount++;
-    return data_fd;
+    created_files.store(true);
 }
 
-void Database::mapSlice(int fd, int slice_number) {
-    auto data_mapped = mmap(nullptr, SLICE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+char *Database::mapSlice(uint32_t slice_number) {
+    auto filename = sliceFilename(slice_number);
+    int data_fd = open(filename.c_str(), O_RDWR, 0644);
+    assert(data_fd > 0);
+    auto data_mapped = mmap(nullptr, options.slice_size, PROT_READ | PROT_WRITE, MAP_SHARED, data_fd, 0);
     assert(data_mapped != MAP_FAILED);
-    madvise(data_mapped, SLICE_SIZE, MADV_SEQUENTIAL);
-    slices[slice_number] = (char*) data_mapped;
+    close(data_fd);
+    // values are read one at a time, by keys in no particular order, so
+    // read-ahead would only fault in the values around them
+    madvise(data_mapped, options.slice_size, MADV_RANDOM);
+    return (char*) data_mapped;
 }
 
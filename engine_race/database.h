@@ -6,43 +6,273 @@
 #define TRIVIALKV_DATABASE_H
 
 #include <string>
+#include <memory>
+#include <atomic>
+#include <vector>
 #include "include/engine.h"
-#include "index_tree.h"
+#include "index.h"
+#include "write_ahead_log.h"
 
 using polar_race::PolarString;
 using polar_race::RetCode;
+using polar_race::Options;
 
 struct DatabaseMetadata {
     uint32_t sliceCount;
-    uint32_t currentSliceNumber;
-    uint32_t currentOffset;
+    // number of blob files ever created
+    std::atomic<uint32_t> blobCount;
+    // current slice number in the high half and next free offset in the low half,
+    // so that writers can reserve space with a single fetch-add
+    std::atomic<uint64_t> currentPosition;
+    // generation of the last checkpoint of the index, see Database::checkpoint
+    uint64_t generation;
+    // next sequence number of a record
+    std::atomic<uint64_t> sequence;
+};
+
+// persistent bookkeeping of one slice, kept in <shard>.usage
+struct SliceUsage {
+    // bytes of values in the slice that were overwritten or moved away
+    std::atomic<uint64_t> deadBytes;
+    std::atomic<uint32_t> state;
+    uint32_t reserved;
+    // next sequence number when the slice was started, records written into
+    // it before are only found in older slices
+    std::atomic<uint64_t> startSequence;
+};
+
+const uint32_t SLICE_IN_USE = 0;
+// reclaimed by compaction, waiting to be reused
+const uint32_t SLICE_FREE = 1;
+
+// Values in slices are framed by this header in front of them and their key
+// behind them, so that every record can be verified on its own, and found
+// again without the index. Records start at multiples of 8 bytes.
+struct RecordHeader {
+    // CRC32C of the rest of the header, the value and the key
+    uint32_t checksum;
+    uint16_t key_length;
+    uint8_t type;
+    uint8_t reserved;
+    uint64_t value_length;
+    // orders the records of a key like their index updates, the highest one is the current
+    uint64_t sequence;
+};
+
+const uint8_t RECORD_VALUE = 1;
+// the key was deleted, there is no value
+const uint8_t RECORD_DELETE = 2;
+// last bytes of a blob file, behind the value and the key; the value is not checksummed
+const uint8_t RECORD_BLOB = 3;
+
+inline uint64_t record_size(size_t key_length, uint64_t value_length) {
+    return (sizeof(RecordHeader) + key_length + value_length + 7) & ~(uint64_t) 7;
+}
+
+// read-only mapping of a whole blob file
+struct BlobMapping {
+    void *address;
+    size_t size;
 };
 
 class Database {
 public:
-    Database(const std::string &dir, int id);
+    // Ordered cursor over one shard. Entries are copied RANGE_SCAN_CHUNK at a
+    // time under a short read lock, with their slices pinned and their blobs
+    // mapped, so the values stay valid while the shard takes updates.
+    class Iterator {
+    public:
+        Iterator(Database *db, const PolarString &lower);
+        ~Iterator();
+        Iterator(const Iterator &) = delete;
+        Iterator &operator=(const Iterator &) = delete;
+        bool valid() const { return position < entries.size(); }
+        PolarString key() const {
+            return {keys.data() + entries[position].key_offset, entries[position].key_length};
+        }
+        // fails only if the blob of the current key can not be mapped
+        RetCode value(PolarString *value) const;
+        void next();
+    private:
+        struct Entry {
+            size_t key_offset;
+            size_t key_length;
+            IndexData data;
+            // mapping of a blob, nullptr if it failed
+            BlobMapping *blob_map;
+        };
+        Database *db;
+        // keys of the chunk, one after the other
+        std::string keys;
+        std::vector<Entry> entries;
+        size_t position = 0;
+        // the next chunk starts at this key, or right after it once a chunk ended there
+        std::string resume_key;
+        bool resume_after = false;
+        bool exhausted = false;
+        void fill();
+        void release();
+    };
+
+    Database(const std::string &dir, int id, const Options &options);
+    // whether the shard has been created on disk
+    static bool exists(const std::string &dir, int id);
+    // replaces the index of a shard that is not open by one built from the records in its files
+    static RetCode rebuild(const std::string &dir, int id, const Options &options);
+    // Bulk loading, see Engine::BulkLoad: the shard is locked from beginLoad to
+    // endLoad, which indexes the loaded values and writes a checkpoint.
+    void beginLoad();
+    RetCode load(const PolarString &key, const PolarString &value);
+    RetCode endLoad();
     ~Database();
     RetCode write(const PolarString &key, const PolarString &value);
+    // writes the pairs listed in batch, which is sorted by key in place
+    RetCode writeBatch(const std::vector<PolarString> &keys, const std::vector<PolarString> &values,
+                       std::vector<uint32_t> &batch);
     RetCode read(const PolarString &key, std::string *value);
+    // kNotFound if there is no such key
+    RetCode remove(const PolarString &key);
+    // points view into the slice holding the value, which stays pinned until the view is reset
+    RetCode readPinned(const PolarString &key, polar_race::ReadView *view);
+    // reads keys[batch[i]] into values[batch[i]], setting statuses[batch[i]]
+    void readBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                   std::vector<std::string> &values, std::vector<RetCode> &statuses);
+    // changes with every update of the index, and is odd while one is under way
+    uint64_t indexVersion() const { return version.load(std::memory_order_acquire); }
+    // Moves the live values out of mostly dead slices and reclaims them, together with
+    // overwritten blobs, and sets progress to whether any value was moved or anything
+    // reclaimed. Stops early once cancel is set, fails with kFull if values can not be moved.
+    RetCode compact(bool throttled, const std::atomic<bool> *cancel, bool *progress);
+    // flushes everything indexed so far, values before the log records referring to them
+    void sync();
+    // verifies the records of all values indexed in slices, adds the corrupted ones to report
+    void scrub(bool throttled, const std::atomic<bool> *cancel, polar_race::ScrubReport *report);
+    // writes the index into a new checkpoint once its log has grown to CHECKPOINT_LOG_SIZE
+    // (or has any records at all with force), returns whether a checkpoint was written
+    bool checkpoint(bool force);
 private:
-    static const int MAX_SLICE_COUNT = 1 << 12;
-    static const int SLICE_SIZE = 32 * 1024 * 1024;
+    // a value (or a deletion record) that compaction copies from one slice to another
+    struct Relocation {
+        std::string key;
+        IndexData from;
+        IndexData to;
+        bool deletion;
+    };
+
+    static const int OPTIMISTIC_READ_RETRIES = 8;
+    // values larger than this part of a slice are stored as blobs
+    static const int BLOB_SLICE_FRACTION = 4;
+    // slices with at least this part of their bytes dead are compacted
+    static const int COMPACTION_DEAD_FRACTION = 2;
+    // index entries (or pages) examined under one read lock
+    static const size_t COMPACTION_SCAN_CHUNK = 4096;
+    // the records of these are verified under the read lock, so writers do not wait long
+    static const size_t SCRUB_SCAN_CHUNK = 256;
+    // index entries a Range cursor copies under one read lock
+    static const size_t RANGE_SCAN_CHUNK = 256;
+    static const uint64_t SCRUB_BYTES_PER_SECOND = 64 << 20;
+    // throttle of background compaction, so foreground I/O is not starved
+    static const uint64_t COMPACTION_BYTES_PER_SECOND = 64 << 20;
+    // replaying a log of this size at startup takes well below a second
+    static const size_t CHECKPOINT_LOG_SIZE = 64 << 20;
+    // serializes index updates, and keeps the index still for Range cursors
     pthread_rwlock_t rwlock;
+    // serializes switching to a new slice
+    pthread_mutex_t slice_lock;
+    // serializes compaction runs
+    pthread_mutex_t compaction_lock;
+    // serializes syncs and checkpoints, so that none returns while another is still flushing
+    pthread_mutex_t sync_lock;
+    // seqlock over the index, odd while a writer is modifying it
+    std::atomic<uint64_t> version;
+    // bumped before compaction reuses the space of moved values, readers copying
+    // a value without a pin check it did not change meanwhile
+    std::atomic<uint64_t> relocation_epoch;
     int id;
     std::string file_prefix;
-    IndexTree *index;
-    int slice_fd[MAX_SLICE_COUNT];
-    char *slices[MAX_SLICE_COUNT];
-    char *currentSlice;
+    Options options;
+    Index *index;
+    // updates of the index since its last checkpoint, appended with the write lock held
+    std::unique_ptr<WriteAheadLog> wal;
+    // generation of the log in use, guarded by sync_lock
+    uint64_t log_generation;
+    // sized for max_slice_count up front, so readers never see them move,
+    // each slice is mapped on its first access
+    std::unique_ptr<std::atomic<char*>[]> slices;
+    // number of read views into every slice, a slice must not be reclaimed while pinned
+    std::unique_ptr<std::atomic<uint32_t>[]> slice_pins;
+    // slices holding values indexed since the last sync
+    std::unique_ptr<std::atomic<bool>[]> slice_dirty;
+    // files were created since the last sync, so the directory has to be synced as well
+    std::atomic<bool> created_files;
 
     // memory mapped metadata
-    int metadata_fd;
     DatabaseMetadata *metadata;
+    SliceUsage *slice_usage;
+
+    // Bytes reserved in a slice once it is full (UINT32_MAX while it is not) and bytes
+    // indexed so far. Writers copy values outside of any lock, so a full slice can only
+    // be compacted once both are equal.
+    std::unique_ptr<std::atomic<uint32_t>[]> sealed_size;
+    std::unique_ptr<uint64_t[]> published_size;
+    // reclaimed slices, guarded by slice_lock
+    std::vector<uint32_t> free_slices;
+    // overwritten or deleted blobs to be unlinked, guarded by rwlock
+    std::vector<uint32_t> dead_blobs;
 
+    bool optimisticSearch(const PolarString &key, IndexData &result);
+    RetCode publish(const PolarString &key, const IndexData &data, uint64_t &sequence);
+    RetCode publishLocked(const PolarString &key, const IndexData &data, uint64_t &sequence);
+    RetCode insertLocked(const PolarString &key, const IndexData &data);
+    void retire(const IndexData &data, size_t key_length);
+    RetCode relocate(std::vector<Relocation> &batch, size_t *moved);
+    RetCode relocateDeletions(const std::vector<uint32_t> &victims);
+    bool reclaimSlice(uint32_t slice);
+    bool reclaimBlobs();
+    RetCode copyValue(const IndexData &data, std::string *value);
+    bool isBlob(size_t key_length, uint64_t value_length) const {
+        return record_size(key_length, value_length) > options.slice_size / BLOB_SLICE_FRACTION;
+    }
+    static char *frame(char *destination, uint8_t type, const PolarString &key, const PolarString &value);
+    static void stamp(RecordHeader *header, uint64_t sequence);
+    RecordHeader *headerOf(const IndexData &data) {
+        return reinterpret_cast<RecordHeader*>(sliceAt(data.slice) + data.offset - sizeof(RecordHeader));
+    }
+    static uint32_t checksum(const RecordHeader *header);
+    // whether a record in the space left in a slice is complete and matches its checksum
+    static bool framed(const RecordHeader *header, uint64_t space);
+    bool intact(const IndexData &data);
+    // whether the slice holds the complete record of key at data, matching its checksum
+    bool framedAt(const PolarString &key, const IndexData &data);
+    void syncSlices();
+    void markDeleted(const PolarString &key);
+    RetCode rebuildIndex();
+    bool checkpoint(size_t min_log_size);
+    bool sampleVerify() const;
+    std::string blobFilename(uint32_t blob) const;
+    RetCode writeBlob(const PolarString &key, const PolarString &value, IndexData &location);
+    RetCode sealBlob(const PolarString &key, const IndexData &location, uint64_t sequence);
+    BlobMapping *mapBlob(const IndexData &data);
+    static void unmapBlob(void *pin);
+    static void unpinSlice(void *pin);
+    void copyBatch(const std::vector<uint32_t> &batch, const std::vector<IndexData> &results,
+                   std::vector<std::string> &values, std::vector<RetCode> &statuses);
+    bool optimisticSearchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                               IndexData *results);
+    std::string logFilename(uint64_t generation) const;
+    // blobs that were dead when the checkpoint of a generation was copied
+    std::string deadBlobsFilename(uint64_t generation) const;
+    static bool writeDeadBlobs(const std::string &filename, const std::vector<uint32_t> &blobs);
     void initIndex();
     void initSlices();
-    int createNewSlice();
-    void mapSlice(int fd, int slice_number);
+    void initUsage();
+    char *reserve(uint32_t length, uint32_t &slice, uint32_t &offset);
+    bool switchSlice(uint32_t full_slice);
+    void startSlice(uint32_t slice);
+    char *sliceAt(uint32_t slice_number);
+    std::string sliceFilename(uint32_t slice_number) const;
+    void createNewSlice();
+    char *mapSlice(uint32_t slice_number);
 };
 
 
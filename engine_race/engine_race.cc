@@ -1,11 +1,27 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <vector>
+
 #include "engine_race.h"
+#include "manifest.h"
 #include "utils.hpp"
 
 namespace polar_race {
 
 RetCode Engine::Open(const std::string& name, Engine** eptr) {
-  return EngineRace::Open(name, eptr);
+  return EngineRace::Open(name, Options(), eptr);
+}
+
+RetCode Engine::Open(const std::string& name, const Options& options,
+    Engine** eptr) {
+  return EngineRace::Open(name, options, eptr);
+}
+
+RetCode Engine::RebuildIndex(const std::string& name) {
+  return EngineRace::RebuildIndex(name);
 }
 
 Engine::~Engine() {
@@ -16,39 +32,458 @@ Engine::~Engine() {
  */
 
 // 1. Open engine
-RetCode EngineRace::Open(const std::string &dir, Engine** ptr) {
-  *ptr = new EngineRace(dir);
+RetCode EngineRace::Open(const std::string &dir, const Options &options,
+    Engine** ptr) {
+  *ptr = nullptr;
+  // an existing store keeps the options it was created with
+  auto store_options = options;
+  auto ret = load_manifest(dir, store_options);
+  if (ret != kSucc) {
+    return ret;
+  }
+  *ptr = new EngineRace(dir, store_options);
   return kSucc;
 }
 
 
-EngineRace::EngineRace(const std::string &dir) {
-  for(auto i = 0; i < DATABASE_SHARDS; ++i) {
-    databases[i] = new Database(dir, i);
+// Shards are independent, so they are rebuilt side by side, each reading
+// its own files sequentially.
+RetCode EngineRace::RebuildIndex(const std::string &dir) {
+  if (access((dir + ".manifest").c_str(), F_OK) != 0) {
+    return kNotFound;
+  }
+  Options options;
+  auto ret = load_manifest(dir, options);
+  if (ret != kSucc) {
+    return ret;
+  }
+  std::atomic<int> failed(kSucc);
+  forEachShard(options.shard_count, [&dir, &options, &failed](uint32_t shard) {
+    if (Database::exists(dir, shard)) {
+      auto ret = Database::rebuild(dir, shard, options);
+      if (ret != kSucc) {
+        failed = ret;
+      }
+    }
+  });
+  return (RetCode) failed.load();
+}
+
+
+EngineRace::EngineRace(const std::string &dir, const Options &options)
+  : dir(dir), options(options),
+    databases(new std::atomic<Database*>[options.shard_count]),
+    closing(false) {
+  for (uint32_t i = 0; i < options.shard_count; ++i) {
+    databases[i].store(nullptr, std::memory_order_relaxed);
+  }
+  if (options.cache_size > 0) {
+    cache.reset(new ValueCache(options.cache_size));
+  }
+  compaction_thread = std::thread(&EngineRace::compactionLoop, this);
+  scrub_thread = std::thread(&EngineRace::scrubLoop, this);
+  if (options.durability != Options::kDurabilityNone) {
+    commit_thread = std::thread(&EngineRace::commitLoop, this);
   }
 }
 
 // 2. Close engine
 EngineRace::~EngineRace() {
-  for(auto db: databases) {
-    delete db;
+  {
+    std::lock_guard<std::mutex> guard(compaction_mutex);
+    closing = true;
+  }
+  compaction_wakeup.notify_all();
+  compaction_thread.join();
+  scrub_thread.join();
+  if (commit_thread.joinable()) {
+    // wakes the commit thread for a last flush
+    {
+      std::lock_guard<std::mutex> guard(commit_mutex);
+    }
+    commit_wakeup.notify_all();
+    commit_thread.join();
+  }
+  for (uint32_t i = 0; i < options.shard_count; ++i) {
+    delete databases[i].load(std::memory_order_relaxed);
   }
 }
 
+Database *EngineRace::openShard(uint32_t shard, bool create) {
+  auto db = databases[shard].load(std::memory_order_acquire);
+  if (db != nullptr) {
+    return db;
+  }
+  std::lock_guard<std::mutex> guard(open_lock);
+  db = databases[shard].load(std::memory_order_relaxed);
+  if (db == nullptr && (create || Database::exists(dir, shard))) {
+    db = new Database(dir, shard, options);
+    databases[shard].store(db, std::memory_order_release);
+  }
+  return db;
+}
+
 // 3. Write a key-value pair into engine
+// Updates drop the old value from the cache only after changing the index,
+// see ValueCache::insert.
 RetCode EngineRace::Write(const PolarString &key, const PolarString &value) {
-  return databases[get_shard_number(key)]->write(key, value);
+  auto ret = openShard(shardNumber(key), true)->write(key, value);
+  if (cache) {
+    cache->erase(key, key_hash(key));
+  }
+  return Commit(ret);
 }
 
 // 4. Read value of a key
+//
+// Cached values are copied without searching the index of their shard.
 RetCode EngineRace::Read(const PolarString &key, std::string *value) {
-  return databases[get_shard_number(key)]->read(key, value);
+  uint64_t hash = 0;
+  if (cache) {
+    hash = key_hash(key);
+    if (cache->lookup(key, hash, value)) {
+      return kSucc;
+    }
+  }
+  auto db = openShard(shardNumber(key), false);
+  if (db == nullptr) {
+    // nothing was ever written to this shard
+    return kNotFound;
+  }
+  if (!cache) {
+    return db->read(key, value);
+  }
+  auto version = db->indexVersion();
+  auto ret = db->read(key, value);
+  if (ret == kSucc) {
+    cacheValue(db, version, key, hash, *value);
+  }
+  return ret;
+}
+
+void EngineRace::cacheValue(Database *db, uint64_t version,
+    const PolarString &key, uint64_t hash, const PolarString &value) {
+  cache->insert(key, hash, value, [db, version]() {
+    return version % 2 == 0 && db->indexVersion() == version;
+  });
+}
+
+RetCode EngineRace::Delete(const PolarString &key) {
+  auto db = openShard(shardNumber(key), false);
+  if (db == nullptr) {
+    return kNotFound;
+  }
+  auto ret = db->remove(key);
+  if (cache) {
+    cache->erase(key, key_hash(key));
+  }
+  return Commit(ret);
+}
+
+RetCode EngineRace::ReadPinned(const PolarString &key, ReadView *view) {
+  auto db = openShard(shardNumber(key), false);
+  if (db == nullptr) {
+    view->Reset();
+    return kNotFound;
+  }
+  return db->readPinned(key, view);
+}
+
+RetCode EngineRace::Compact() {
+  for (uint32_t i = 0; i < options.shard_count; ++i) {
+    auto db = databases[i].load(std::memory_order_acquire);
+    if (db == nullptr) {
+      continue;
+    }
+    // a pass may free space that the next one needs to move values into,
+    // a shard without any such space ends the run with kFull
+    bool progress = true;
+    while (progress) {
+      auto ret = db->compact(false, nullptr, &progress);
+      if (ret != kSucc) {
+        return ret;
+      }
+    }
+  }
+  return kSucc;
+}
+
+RetCode EngineRace::Scrub() {
+  ScrubReport report;
+  return Scrub(&report);
+}
+
+RetCode EngineRace::Scrub(ScrubReport *report) {
+  *report = ScrubReport();
+  scrubShards(false, report);
+  return report->corrupted.empty() ? kSucc : kCorruption;
+}
+
+RetCode EngineRace::LastScrub(ScrubReport *report) {
+  std::lock_guard<std::mutex> guard(scrub_mutex);
+  if (!scrubbed) {
+    return kNotFound;
+  }
+  *report = last_scrub;
+  return kSucc;
+}
+
+// In the background, only the shards opened anyway are verified. Every
+// shard reports into a report of its own, which is added once it is done.
+void EngineRace::scrubShards(bool throttled, ScrubReport *report) {
+  std::mutex report_mutex;
+  forEachShard(options.shard_count,
+      [this, throttled, report, &report_mutex](uint32_t shard) {
+    if (closing) {
+      return;
+    }
+    auto db = throttled ? databases[shard].load(std::memory_order_acquire)
+        : openShard(shard, false);
+    if (db != nullptr) {
+      ScrubReport shard_report;
+      db->scrub(throttled, &closing, &shard_report);
+      std::lock_guard<std::mutex> guard(report_mutex);
+      report->verified_bytes += shard_report.verified_bytes;
+      report->corrupted.insert(report->corrupted.end(),
+          shard_report.corrupted.begin(), shard_report.corrupted.end());
+    }
+  });
+}
+
+// Shards are handed out to the threads one at a time, so a large shard
+// does not hold up the others.
+void EngineRace::forEachShard(uint32_t shard_count,
+    const std::function<void(uint32_t shard)> &work) {
+  std::atomic<uint32_t> next(0);
+  auto worker = [shard_count, &work, &next] {
+    for (auto shard = next++; shard < shard_count; shard = next++) {
+      work(shard);
+    }
+  };
+  auto thread_count = std::min<uint32_t>(
+      std::max(std::thread::hardware_concurrency(), 1u), shard_count);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// With kDurabilitySync, a successful update waits for the first flush that
+// starts after it. Updates arriving while a flush is running wait together
+// for the next one, so each flush is shared by all of them.
+RetCode EngineRace::Commit(RetCode ret) {
+  if (ret != kSucc || options.durability != Options::kDurabilitySync) {
+    return ret;
+  }
+  std::unique_lock<std::mutex> lock(commit_mutex);
+  auto ticket = ++commit_requested;
+  commit_wakeup.notify_all();
+  committed.wait(lock, [this, ticket] { return commit_done >= ticket; });
+  return kSucc;
+}
+
+void EngineRace::commitLoop() {
+  std::unique_lock<std::mutex> lock(commit_mutex);
+  bool stop = false;
+  while (!stop) {
+    if (options.durability == Options::kDurabilityPeriodic) {
+      commit_wakeup.wait_for(lock,
+          std::chrono::milliseconds(options.sync_interval_ms),
+          [this] { return closing.load(); });
+    } else {
+      commit_wakeup.wait(lock, [this] {
+        return closing || commit_requested > commit_done;
+      });
+    }
+    stop = closing;
+    auto target = commit_requested;
+    lock.unlock();
+    for (uint32_t i = 0; i < options.shard_count; ++i) {
+      auto db = databases[i].load(std::memory_order_acquire);
+      if (db != nullptr) {
+        db->sync();
+      }
+    }
+    lock.lock();
+    commit_done = target;
+    committed.notify_all();
+  }
+}
+
+void EngineRace::compactionLoop() {
+  std::unique_lock<std::mutex> lock(compaction_mutex);
+  while (!compaction_wakeup.wait_for(lock, kCompactionInterval,
+      [this] { return closing.load(); })) {
+    lock.unlock();
+    for (uint32_t i = 0; i < options.shard_count && !closing; ++i) {
+      auto db = databases[i].load(std::memory_order_acquire);
+      if (db != nullptr) {
+        bool progress;
+        // a full shard is tried again on the next round
+        db->compact(true, &closing, &progress);
+        db->checkpoint(false);
+      }
+    }
+    lock.lock();
+  }
+}
+
+void EngineRace::scrubLoop() {
+  std::unique_lock<std::mutex> lock(compaction_mutex);
+  while (!compaction_wakeup.wait_for(lock, kScrubInterval,
+      [this] { return closing.load(); })) {
+    lock.unlock();
+    ScrubReport report;
+    scrubShards(true, &report);
+    // an interrupted scrub does not cover the store
+    if (!closing) {
+      std::lock_guard<std::mutex> guard(scrub_mutex);
+      last_scrub = std::move(report);
+      scrubbed = true;
+    }
+    lock.lock();
+  }
+}
+
+// positions of the keys belonging to every shard
+std::vector<std::vector<uint32_t>> EngineRace::groupByShard(
+    const std::vector<PolarString> &keys) const {
+  std::vector<std::vector<uint32_t>> batches(options.shard_count);
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    batches[shardNumber(keys[i])].push_back(i);
+  }
+  return batches;
+}
+
+// Keys are grouped by shard, and each shard searches all of its keys in one
+// optimistic pass with interleaved index walks.
+RetCode EngineRace::MultiGet(const std::vector<PolarString> &keys,
+    std::vector<std::string> *values,
+    std::vector<RetCode> *statuses) {
+  values->resize(keys.size());
+  statuses->assign(keys.size(), kNotFound);
+  if (cache) {
+    return CachedMultiGet(keys, values, statuses);
+  }
+  auto batches = groupByShard(keys);
+  for (uint32_t shard = 0; shard < options.shard_count; ++shard) {
+    if (batches[shard].empty()) {
+      continue;
+    }
+    auto db = openShard(shard, false);
+    if (db != nullptr) {
+      db->readBatch(keys, batches[shard], *values, *statuses);
+    }
+  }
+  return kSucc;
+}
+
+// Only the keys missing from the cache are searched in their shards, and
+// the values found there are offered to the cache.
+RetCode EngineRace::CachedMultiGet(const std::vector<PolarString> &keys,
+    std::vector<std::string> *values,
+    std::vector<RetCode> *statuses) {
+  std::vector<uint64_t> hashes(keys.size());
+  std::vector<std::vector<uint32_t>> batches(options.shard_count);
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    hashes[i] = key_hash(keys[i]);
+    if (cache->lookup(keys[i], hashes[i], &(*values)[i])) {
+      (*statuses)[i] = kSucc;
+    } else {
+      batches[shardNumber(keys[i])].push_back(i);
+    }
+  }
+  for (uint32_t shard = 0; shard < options.shard_count; ++shard) {
+    if (batches[shard].empty()) {
+      continue;
+    }
+    auto db = openShard(shard, false);
+    if (db == nullptr) {
+      continue;
+    }
+    auto version = db->indexVersion();
+    db->readBatch(keys, batches[shard], *values, *statuses);
+    for (auto i : batches[shard]) {
+      if ((*statuses)[i] == kSucc) {
+        cacheValue(db, version, keys[i], hashes[i], (*values)[i]);
+      }
+    }
+  }
+  return kSucc;
+}
+
+// Keys are grouped by shard first, so every shard is locked once for all
+// of its keys instead of once per key. Writing stops at the first shard that
+// fails, but whatever was indexed before is flushed like a successful batch
+// before the error is returned.
+RetCode EngineRace::WriteBatch(const std::vector<PolarString> &keys,
+    const std::vector<PolarString> &values) {
+  if (keys.size() != values.size()) {
+    return kInvalidArgument;
+  }
+  auto batches = groupByShard(keys);
+  auto ret = kSucc;
+  for (uint32_t shard = 0; shard < options.shard_count && ret == kSucc;
+      ++shard) {
+    if (batches[shard].empty()) {
+      continue;
+    }
+    ret = openShard(shard, true)->writeBatch(keys, values, batches[shard]);
+    if (cache) {
+      for (auto i : batches[shard]) {
+        cache->erase(keys[i], key_hash(keys[i]));
+      }
+    }
+  }
+  Commit(kSucc);
+  return ret;
+}
+
+// Only the shards the pairs go to are created. A shard is locked at its first
+// pair and stays locked until the whole load is done. Every other operation
+// holds a single shard lock at a time and loads take turns on load_mutex, so
+// locking the shards in the order the pairs come in can not deadlock.
+RetCode EngineRace::BulkLoad(BulkSource &source) {
+  std::lock_guard<std::mutex> guard(load_mutex);
+  std::vector<Database*> loading(options.shard_count, nullptr);
+  auto ret = kSucc;
+  PolarString key, value;
+  while (ret == kSucc && source.Next(&key, &value)) {
+    auto shard = shardNumber(key);
+    if (loading[shard] == nullptr) {
+      loading[shard] = openShard(shard, true);
+      loading[shard]->beginLoad();
+    }
+    ret = loading[shard]->load(key, value);
+  }
+  for (auto db : loading) {
+    if (db == nullptr) {
+      continue;
+    }
+    auto ended = db->endLoad();
+    if (ret == kSucc) {
+      ret = ended;
+    }
+  }
+  if (cache) {
+    // cheaper than dropping the loaded keys one by one
+    cache->clear();
+  }
+  return ret;
+}
+
+RetCode EngineRace::GetCacheStats(CacheStats *stats) {
+  if (!cache) {
+    return kNotSupported;
+  }
+  cache->stats(stats);
+  return kSucc;
 }
 
-/*
- * NOTICE: Implement 'Range' in quarter-final,
- *         you can skip it in preliminary.
- */
 // 5. Applies the given Vistor::Visit function to the result
 // of every key-value pair in the key range [first, last),
 // in order
@@ -56,9 +491,90 @@ RetCode EngineRace::Read(const PolarString &key, std::string *value) {
 // upper=="" is treated as a key after all keys in the database.
 // Therefore the following call will traverse the entire database:
 //   Range("", "", visitor)
+//
+// Every shard is walked in order by its own cursor and the cursors are merged
+// with a min-heap, holding one position per shard. A cursor read-locks its
+// shard only while it copies the next chunk of entries, so writers are not
+// held up by a long scan, and the visitor may write into this engine.
 RetCode EngineRace::Range(const PolarString &lower, const PolarString &upper,
     Visitor &visitor) {
-  return kNotSupported;
+  if (options.index_type == Options::kHashTable) {
+    // hash indexes keep no order
+    return kNotSupported;
+  }
+  if (options.shard_routing == Options::kRouteByPrefix) {
+    return RangeByPrefix(lower, upper, visitor);
+  }
+
+  using Cursor = Database::Iterator;
+  std::vector<std::unique_ptr<Cursor>> cursors(options.shard_count);
+  auto greater = [&cursors](size_t a, size_t b) {
+    return fast_string_cmp(cursors[a]->key(), cursors[b]->key()) > 0;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    auto db = openShard(i, false);
+    if (db == nullptr) {
+      continue;
+    }
+    cursors[i].reset(new Cursor(db, lower));
+    if (cursors[i]->valid()) {
+      heap.push(i);
+    } else {
+      cursors[i].reset();
+    }
+  }
+
+  while (!heap.empty()) {
+    auto shard = heap.top();
+    auto &cursor = cursors[shard];
+    heap.pop();
+    if (!upper.empty() && fast_string_cmp(cursor->key(), upper) >= 0) {
+      // smallest remaining key is out of range
+      break;
+    }
+    PolarString value;
+    auto ret = cursor->value(&value);
+    if (ret != kSucc) {
+      return ret;
+    }
+    visitor.Visit(cursor->key(), value);
+    cursor->next();
+    if (cursor->valid()) {
+      heap.push(shard);
+    } else {
+      cursor.reset();
+    }
+  }
+
+  return kSucc;
+}
+
+// Shards routed by the first key byte hold consecutive key ranges, so they are
+// walked one after the other, from the shard of lower to the shard of upper.
+RetCode EngineRace::RangeByPrefix(const PolarString &lower,
+    const PolarString &upper, Visitor &visitor) {
+  auto first = lower.empty() ? 0 : shardNumber(lower);
+  auto last = upper.empty() ? options.shard_count - 1 : shardNumber(upper);
+  for (auto shard = first; shard <= last; ++shard) {
+    auto db = openShard(shard, false);
+    if (db == nullptr) {
+      continue;
+    }
+    for (Database::Iterator cursor(db, lower); cursor.valid(); cursor.next()) {
+      if (!upper.empty() && fast_string_cmp(cursor.key(), upper) >= 0) {
+        return kSucc;
+      }
+      PolarString value;
+      auto ret = cursor.value(&value);
+      if (ret != kSucc) {
+        return ret;
+      }
+      visitor.Visit(cursor.key(), value);
+    }
+  }
+  return kSucc;
 }
 
 }  // namespace polar_race
@@ -1,19 +1,36 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #ifndef ENGINE_RACE_ENGINE_RACE_H_
 #define ENGINE_RACE_ENGINE_RACE_H_
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include "include/engine.h"
 
 #include "utils.hpp"
 #include "database.h"
+#include "value_cache.h"
 
 namespace polar_race {
 
+// how often the background thread looks for slices worth compacting
+const std::chrono::milliseconds kCompactionInterval(1000);
+// how often the background thread verifies all values, throttled
+const std::chrono::minutes kScrubInterval(10);
+
 class EngineRace : public Engine  {
  public:
-  static RetCode Open(const std::string &dir, Engine **ptr);
+  static RetCode Open(const std::string &dir, const Options &options,
+      Engine **ptr);
+
+  static RetCode RebuildIndex(const std::string &dir);
 
-  explicit EngineRace(const std::string &dir);
+  EngineRace(const std::string &dir, const Options &options);
 
   ~EngineRace() override;
 
@@ -23,16 +40,101 @@ class EngineRace : public Engine  {
   RetCode Read(const PolarString &key,
       std::string *value) override;
 
-  /*
-   * NOTICE: Implement 'Range' in quarter-final,
-   *         you can skip it in preliminary.
-   */
+  RetCode Delete(const PolarString &key) override;
+
+  RetCode ReadPinned(const PolarString &key,
+      ReadView *view) override;
+
+  RetCode MultiGet(const std::vector<PolarString> &keys,
+      std::vector<std::string> *values,
+      std::vector<RetCode> *statuses) override;
+
+  RetCode Compact() override;
+
+  RetCode Scrub() override;
+
+  RetCode Scrub(ScrubReport *report) override;
+
+  RetCode LastScrub(ScrubReport *report) override;
+
+  RetCode WriteBatch(const std::vector<PolarString> &keys,
+      const std::vector<PolarString> &values) override;
+
+  RetCode BulkLoad(BulkSource &source) override;
+
+  RetCode GetCacheStats(CacheStats *stats) override;
+
   RetCode Range(const PolarString &lower,
       const PolarString &upper,
       Visitor &visitor) override;
 
  private:
-    Database *databases[DATABASE_SHARDS] = {nullptr};
+    uint32_t shardNumber(const PolarString &key) const {
+      return get_shard_number(key, options.shard_count, options.shard_routing);
+    }
+
+    RetCode RangeByPrefix(const PolarString &lower, const PolarString &upper,
+        Visitor &visitor);
+
+    RetCode CachedMultiGet(const std::vector<PolarString> &keys,
+        std::vector<std::string> *values,
+        std::vector<RetCode> *statuses);
+
+    std::vector<std::vector<uint32_t>> groupByShard(
+        const std::vector<PolarString> &keys) const;
+
+    // returns nullptr if the shard does not exist and create is false
+    Database *openShard(uint32_t shard, bool create);
+
+    // verifies the shards on parallel threads into report
+    void scrubShards(bool throttled, ScrubReport *report);
+
+    // runs work for every shard, handing the shards out to one thread per core
+    static void forEachShard(uint32_t shard_count,
+        const std::function<void(uint32_t shard)> &work);
+
+    std::string dir;
+    Options options;
+    // shards are opened on their first access
+    std::unique_ptr<std::atomic<Database*>[]> databases;
+    std::mutex open_lock;
+    // one BulkLoad at a time, see there
+    std::mutex load_mutex;
+
+    // hot values, nullptr unless options.cache_size is set
+    std::unique_ptr<ValueCache> cache;
+    // offers a value read from db to the cache, if db did not change since
+    // it had the given version
+    void cacheValue(Database *db, uint64_t version, const PolarString &key,
+        uint64_t hash, const PolarString &value);
+
+    // returns ret once the update it belongs to is durable
+    RetCode Commit(RetCode ret);
+    // flushes the opened shards for Commit, or every sync_interval_ms
+    void commitLoop();
+    std::thread commit_thread;
+    std::mutex commit_mutex;
+    std::condition_variable commit_wakeup;
+    std::condition_variable committed;
+    // updates waiting for a flush, and updates covered by the last flush
+    uint64_t commit_requested = 0;
+    uint64_t commit_done = 0;
+
+    // compacts the opened shards every kCompactionInterval, throttled,
+    // and checkpoints their indexes once their logs have grown
+    void compactionLoop();
+    std::thread compaction_thread;
+    std::atomic<bool> closing;
+    std::mutex compaction_mutex;
+    std::condition_variable compaction_wakeup;
+
+    // scrubs the opened shards every kScrubInterval
+    void scrubLoop();
+    std::thread scrub_thread;
+    // the report of the last completed scrub of scrubLoop, if scrubbed
+    std::mutex scrub_mutex;
+    ScrubReport last_scrub;
+    bool scrubbed = false;
 };
 
 }  // namespace polar_race
@@ -0,0 +1,291 @@
+//
+// Created by Harry Chen on 2019/4/25.
+//
+
+#include <cassert>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "hash_index.h"
+#include "utils.hpp"
+
+
+HashIndex::HashIndex(const std::string &filename, size_t initial_size,
+                     const std::string &key_filename, size_t key_arena_size):
+    key_arena(key_filename, key_arena_size) {
+    struct stat st = {};
+    int index_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+    assert(index_file_fd > 0);
+    fstat(index_file_fd, &st);
+
+    bool need_init = false;
+    auto size = (size_t) st.st_size;
+    // largest power of two number of slots fitting in the initial size
+    auto capacity = MIN_HASH_CAPACITY;
+    while (sizeof(HashIndexHeader) + capacity * 2 * sizeof(HashSlot) <= initial_size) capacity *= 2;
+    if (size == 0) {
+        // no index yet, all slots start zeroed (empty)
+        size = sizeof(HashIndexHeader) + capacity * sizeof(HashSlot);
+        int ret = ftruncate(index_file_fd, size);
+        need_init = true;
+        assert(ret == 0);
+    }
+
+    auto map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, index_file_fd, 0);
+    assert(map != MAP_FAILED);
+    if (need_init) {
+        auto new_header = reinterpret_cast<HashIndexHeader*>(map);
+        new_header->capacity = capacity;
+        new_header->count = 0;
+    }
+    mapTable(map, size);
+    if (need_init) {
+        // the empty table is the first checkpoint
+        bool written = checkpoint(index_file_fd) && fdatasync(index_file_fd) == 0;
+        assert(written);
+    }
+    // the private mapping stays valid after the descriptor is closed
+    close(index_file_fd);
+}
+
+HashIndex::~HashIndex() {
+    munmap(file_map, index_file_size);
+    unmap_all(retired_maps);
+}
+
+
+// May run concurrently with insert (see Database::read): the mask is loaded
+// before the slots so it never exceeds the table in use, and the probe is bounded.
+const IndexData &HashIndex::search(const PolarString &key) {
+    auto hash = slotHash(key);
+    auto mask = this->mask.load(std::memory_order_acquire);
+    auto slots = this->slots;
+    auto position = hash & mask;
+    for (uint64_t distance = 0; distance <= mask; ++distance, position = (position + 1) & mask) {
+        auto &slot = slots[position];
+        // an empty slot, or a slot closer to its home than we are, ends the probe
+        if (slot.hash == 0 || ((position - slot.hash) & mask) < distance) {
+            return INDEX_NOT_FOUND;
+        }
+        if (slot.hash == hash && match(slot, key)) {
+            return slot.data;
+        }
+    }
+    return INDEX_NOT_FOUND;
+}
+
+
+// the home slots of all keys are prefetched before the first probe
+void HashIndex::searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                            IndexData *results) {
+    auto mask = this->mask.load(std::memory_order_acquire);
+    auto slots = this->slots;
+    for (auto i: batch) {
+        __builtin_prefetch(&slots[slotHash(keys[i]) & mask]);
+    }
+    for (size_t i = 0; i < batch.size(); ++i) {
+        results[i] = search(keys[batch[i]]);
+    }
+}
+
+
+bool HashIndex::reserve(size_t key_size) {
+    if (header->count + 1 > header->capacity - (header->capacity >> HASH_LOAD_FACTOR_SHIFT) && !grow()) {
+        return false;
+    }
+    return key_size <= (size_t) KEY_PREFIX_LENGTH || key_arena.reserve(key_size);
+}
+
+
+IndexData HashIndex::insert(const PolarString &key, IndexData data) {
+    if (__glibc_unlikely(header->count + 1 > header->capacity - (header->capacity >> HASH_LOAD_FACTOR_SHIFT))) {
+        bool grown = grow();
+        assert(grown);
+    }
+    HashSlot entry = {};
+    entry.hash = slotHash(key);
+    entry.key_length = (uint16_t) key.size();
+    memcpy(entry.prefix, key.data(), min((int) key.size(), KEY_PREFIX_LENGTH));
+    entry.data = data;
+    auto replaced = INDEX_NOT_FOUND;
+    if (place(slots, mask, entry, &key, &replaced)) {
+        header->count++;
+    }
+    return replaced;
+}
+
+
+// Backward shift deletion: the entries following the removed one move one
+// slot closer to their home, until an empty slot or an entry at its home.
+IndexData HashIndex::remove(const PolarString &key) {
+    auto hash = slotHash(key);
+    auto mask = this->mask.load(std::memory_order_relaxed);
+    auto position = hash & mask;
+    for (uint64_t distance = 0; ; ++distance, position = (position + 1) & mask) {
+        auto &slot = slots[position];
+        if (slot.hash == 0 || ((position - slot.hash) & mask) < distance) {
+            return INDEX_NOT_FOUND;
+        }
+        if (slot.hash == hash && match(slot, key)) {
+            break;
+        }
+    }
+    auto removed = slots[position].data;
+    if (slots[position].key_length > KEY_PREFIX_LENGTH) {
+        key_arena.release(slots[position].key_offset, slots[position].key_length);
+    }
+    for (auto next = (position + 1) & mask;
+         slots[next].hash != 0 && ((next - slots[next].hash) & mask) != 0;
+         position = next, next = (next + 1) & mask) {
+        slots[position] = slots[next];
+    }
+    slots[position] = {};
+    header->count--;
+    return removed;
+}
+
+
+void HashIndex::sync() {
+    key_arena.sync();
+}
+
+
+void HashIndex::snapshot(Snapshot *snapshot) {
+    key_arena.seal();
+    copyImage(snapshot, file_map, index_file_size, index_file_size);
+}
+
+
+// Walks the entries by home slot, limit counts home slots. Entries move between
+// slots on insertion and removal, but never change their home, and Robin Hood
+// probing keeps a cluster sorted by home: the entries at home in [first, end)
+// are found from slot first on, possibly wrapping around, and end at an empty
+// slot or an entry at home past end. The cursor holds the capacity next to the
+// home to continue at, as a table that grew in between is scanned again from
+// the start, which visits some entries twice but never misses one.
+uint64_t HashIndex::scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) {
+    auto capacity = header->capacity;
+    auto mask = capacity - 1;
+    auto shift = (uint64_t) __builtin_ctzll(capacity);
+    uint64_t first = 0;
+    if (cursor != 0 && cursor >> 32 == shift) {
+        first = cursor & 0xffffffffu;
+    }
+    auto end = first + limit < capacity ? first + limit : capacity;
+    auto position = first;
+    for (uint64_t distance = 0; distance <= mask; ++distance, position = (position + 1) & mask) {
+        auto &slot = slots[position];
+        auto home = slot.hash & mask;
+        bool in_range = slot.hash != 0 && home >= first && home < end;
+        if (!in_range && distance >= end - first) {
+            break;
+        }
+        if (in_range) {
+            visitor(slotKey(slot), slot.data);
+        }
+    }
+    return end < capacity ? shift << 32 | end : 0;
+}
+
+
+// Robin Hood insertion: take the slot of any entry that is closer to its home,
+// and carry on with the displaced entry. The key is only stored into the arena
+// once it is known to be new. Returns whether a new slot is used.
+bool HashIndex::place(HashSlot *slots, uint64_t mask, HashSlot &entry, const PolarString *key,
+                      IndexData *replaced) {
+    auto position = entry.hash & mask;
+    for (uint64_t distance = 0; ; ++distance, position = (position + 1) & mask) {
+        auto &slot = slots[position];
+        if (key != nullptr && slot.hash == entry.hash && match(slot, *key)) {
+            // existing key, update in place
+            if (replaced != nullptr) {
+                *replaced = slot.data;
+            }
+            slot.data = entry.data;
+            return false;
+        }
+        auto slot_distance = (position - slot.hash) & mask;
+        if (slot.hash == 0 || slot_distance < distance) {
+            if (key != nullptr && key->size() > KEY_PREFIX_LENGTH) {
+                entry.key_offset = key_arena.append(key->data(), key->size());
+            }
+            key = nullptr;
+            if (slot.hash == 0) {
+                slot = entry;
+                return true;
+            }
+            std::swap(slot, entry);
+            distance = slot_distance;
+        }
+    }
+}
+
+
+PolarString HashIndex::slotKey(const HashSlot &slot) const {
+    if (slot.key_length <= KEY_PREFIX_LENGTH) {
+        return {slot.prefix, slot.key_length};
+    }
+    return {key_arena.at(slot.key_offset, slot.key_length), slot.key_length};
+}
+
+
+bool HashIndex::match(const HashSlot &slot, const PolarString &key) const {
+    if (slot.key_length != key.size()) return false;
+    if (key.size() <= KEY_PREFIX_LENGTH) return memcmp(slot.prefix, key.data(), key.size()) == 0;
+    return memcmp(key_arena.at(slot.key_offset, key.size()), key.data(), key.size()) == 0;
+}
+
+
+uint32_t HashIndex::slotHash(const PolarString &key) {
+    auto hash = (uint32_t) key_hash(key);
+    return hash == 0 ? 1 : hash;
+}
+
+
+// rehash into a table of twice the size, which reaches the disk with the next checkpoint
+bool HashIndex::grow() {
+    auto capacity = header->capacity * 2;
+    auto size = sizeof(HashIndexHeader) + capacity * sizeof(HashSlot);
+
+    auto old_map = file_map;
+    auto old_size = index_file_size;
+    auto old_slots = slots;
+    auto old_capacity = header->capacity;
+    auto count = header->count;
+
+    // readers keep probing the old table until the new one is published
+    auto new_map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (new_map == MAP_FAILED) {
+        return false;
+    }
+    auto new_header = reinterpret_cast<HashIndexHeader*>(new_map);
+    auto new_slots = reinterpret_cast<HashSlot*>(new_header + 1);
+    new_header->capacity = capacity;
+    new_header->count = count;
+    for (uint64_t i = 0; i < old_capacity; ++i) {
+        if (old_slots[i].hash != 0) {
+            auto entry = old_slots[i];
+            place(new_slots, capacity - 1, entry, nullptr);
+        }
+    }
+
+    retired_maps.emplace_back(old_map, old_size);
+    mapTable(new_map, size);
+    return true;
+}
+
+
+void HashIndex::mapTable(void *map, size_t size) {
+    madvise(map, size, MADV_RANDOM);
+    file_map = map;
+    index_file_size = size;
+    header = reinterpret_cast<HashIndexHeader*>(file_map);
+    slots = reinterpret_cast<HashSlot*>(header + 1);
+    // publish the new mask only after the new slots
+    mask.store(header->capacity - 1, std::memory_order_release);
+}
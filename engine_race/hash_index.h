@@ -0,0 +1,72 @@
+//
+// Created by Harry Chen on 2019/4/25.
+//
+
+#ifndef TRIVIALKV_HASH_INDEX_H
+#define TRIVIALKV_HASH_INDEX_H
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+
+#include "index.h"
+#include "key_arena.h"
+
+struct HashSlot {
+    // low 32 bits of the key hash, never 0 so that 0 marks an empty slot
+    uint32_t hash;
+    uint16_t key_length;
+    char prefix[KEY_PREFIX_LENGTH];
+    uint64_t key_offset;
+    IndexData data;
+};
+
+struct HashIndexHeader {
+    uint64_t capacity;
+    uint64_t count;
+};
+
+
+// open addressing table with Robin Hood probing, for shards that only need point lookups
+class HashIndex : public Index {
+public:
+    HashIndex(const std::string &filename, size_t initial_size,
+              const std::string &key_filename, size_t key_arena_size);
+    ~HashIndex() override;
+    const IndexData &search(const PolarString &key) override;
+    void searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                     IndexData *results) override;
+    bool reserve(size_t key_size) override;
+    IndexData insert(const PolarString &key, IndexData data) override;
+    IndexData remove(const PolarString &key) override;
+    void sync() override;
+    void snapshot(Snapshot *snapshot) override;
+    void checkpointed() override { key_arena.reuseSealed(); }
+    bool keysAwaitCheckpoint() const override { return key_arena.awaitsCheckpoint(); }
+    Iterator *seek(const PolarString &lower) override { return nullptr; }
+    uint64_t scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) override;
+private:
+    void mapTable(void *map, size_t size);
+    bool grow();
+    bool place(HashSlot *slots, uint64_t mask, HashSlot &entry, const PolarString *key,
+               IndexData *replaced = nullptr);
+    PolarString slotKey(const HashSlot &slot) const;
+    bool match(const HashSlot &slot, const PolarString &key) const;
+    static uint32_t slotHash(const PolarString &key);
+
+    size_t index_file_size;
+
+    void *file_map;
+    MappingList retired_maps;
+    HashIndexHeader *header;
+    HashSlot *slots;
+    std::atomic<uint64_t> mask;
+
+    KeyArena key_arena;
+};
+
+const uint64_t MIN_HASH_CAPACITY = 64;
+// grow when more than 7/8 of the slots are used
+const int HASH_LOAD_FACTOR_SHIFT = 3;
+
+#endif //TRIVIALKV_HASH_INDEX_H
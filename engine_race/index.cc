@@ -0,0 +1,73 @@
+//
+// Created by Harry Chen on 2019/4/22.
+//
+
+#include <unistd.h>
+#include <cstring>
+
+#include "index.h"
+#include "index_tree.h"
+#include "bplus_tree.h"
+#include "hash_index.h"
+#include "utils.hpp"
+
+
+Index *Index::create(IndexType type, const std::string &file_prefix, uint64_t generation,
+                     size_t initial_size) {
+    // the key arena is usually much smaller than the nodes referring to it
+    auto key_arena_size = initial_size < INIT_KEY_ARENA_SIZE ? initial_size : INIT_KEY_ARENA_SIZE;
+    // keys are only ever appended, so all checkpoints share one arena
+    auto key_filename = file_prefix + ".keys";
+    auto index_filename = filename(type, file_prefix, generation);
+    switch (type) {
+        case polar_race::Options::kBPlusTree:
+            return new BPlusTree(index_filename, initial_size, key_filename, key_arena_size);
+        case polar_race::Options::kHashTable:
+            return new HashIndex(index_filename, initial_size, key_filename, key_arena_size);
+        case polar_race::Options::kAVLTree:
+        default:
+            return new IndexTree(index_filename, initial_size, key_filename, key_arena_size);
+    }
+}
+
+
+std::string Index::filename(IndexType type, const std::string &file_prefix, uint64_t generation) {
+    auto prefix = file_prefix + "." + std::to_string(generation);
+    switch (type) {
+        case polar_race::Options::kBPlusTree:
+            return prefix + ".bptree";
+        case polar_race::Options::kHashTable:
+            return prefix + ".hash";
+        case polar_race::Options::kAVLTree:
+        default:
+            return prefix + ".index";
+    }
+}
+
+
+void Index::copyImage(Snapshot *snapshot, const void *image, size_t used, size_t size) {
+    snapshot->image.reset(new char[used]);
+    memcpy(snapshot->image.get(), image, used);
+    snapshot->used = used;
+    snapshot->size = size;
+}
+
+
+bool Index::writeSnapshot(int fd, const Snapshot &snapshot) {
+    return write_fully(fd, snapshot.image.get(), snapshot.used) && ftruncate(fd, snapshot.size) == 0;
+}
+
+
+bool Index::checkpoint(int fd) {
+    Snapshot image;
+    snapshot(&image);
+    return writeSnapshot(fd, image);
+}
+
+
+void Index::searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                        IndexData *results) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+        results[i] = search(keys[batch[i]]);
+    }
+}
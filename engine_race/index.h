@@ -0,0 +1,110 @@
+//
+// Created by Harry Chen on 2019/4/22.
+//
+
+#ifndef TRIVIALKV_INDEX_H
+#define TRIVIALKV_INDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "include/engine.h"
+
+using polar_race::PolarString;
+using IndexType = polar_race::Options::IndexType;
+
+// values too large for a slice live in a blob file of their own,
+// marked by BLOB_SLICE with the blob number in offset
+struct IndexData {
+    int32_t slice;
+    uint32_t offset;
+    uint64_t length;
+};
+
+const IndexData INDEX_NOT_FOUND = {-1, 0, 0};
+const int32_t BLOB_SLICE = -2;
+
+inline bool index_found(const IndexData &data) {
+    return data.slice != INDEX_NOT_FOUND.slice;
+}
+
+const int MAX_KEY_LENGTH = 1024;
+const int KEY_PREFIX_LENGTH = 8;
+
+// Mapping from keys to value locations inside one shard. The index is loaded
+// from a checkpoint and mapped privately, updates only reach the disk through
+// the next checkpoint; the ones in between are in the log of the shard.
+class Index {
+public:
+    // in-order cursor, only valid while the index is not modified
+    class Iterator {
+    public:
+        virtual ~Iterator() = default;
+        virtual bool valid() const = 0;
+        virtual PolarString key() const = 0;
+        virtual const IndexData &data() const = 0;
+        virtual void next() = 0;
+    };
+
+    // open the checkpoint of the given generation (or an empty index of initial_size bytes
+    // if there is none) of the index type stored in files named by prefix
+    static Index *create(IndexType type, const std::string &file_prefix, uint64_t generation,
+                         size_t initial_size);
+    static std::string filename(IndexType type, const std::string &file_prefix, uint64_t generation);
+
+    virtual ~Index() = default;
+    virtual const IndexData &search(const PolarString &key) = 0;
+    // results[i] = search(keys[batch[i]]), indexes may overlap the lookups
+    virtual void searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                             IndexData *results);
+    // Makes room for inserting or loading one more key of key_size bytes,
+    // false if the index can not grow any more. Called before each of them.
+    virtual bool reserve(size_t key_size) = 0;
+    // returns the data replaced by this insert, INDEX_NOT_FOUND for a new key
+    virtual IndexData insert(const PolarString &key, IndexData data) = 0;
+    // returns the data of the removed key, INDEX_NOT_FOUND if there is no such key
+    virtual IndexData remove(const PolarString &key) = 0;
+    // flush the keys stored so far to disk, may run concurrently with updates
+    virtual void sync() = 0;
+    // a private copy of the image of the index, the first used of its size bytes
+    struct Snapshot {
+        std::unique_ptr<char[]> image;
+        size_t used = 0;
+        size_t size = 0;
+    };
+    // copy the entries for a new checkpoint, without any concurrent update
+    virtual void snapshot(Snapshot *snapshot) = 0;
+    // write a snapshot into fd, the file of a new checkpoint, while updates go on
+    static bool writeSnapshot(int fd, const Snapshot &snapshot);
+    // snapshot and write at once
+    bool checkpoint(int fd);
+    // The checkpoint written last is recorded, so the space of keys removed
+    // before it was written can be reused. Called without any concurrent update.
+    virtual void checkpointed() = 0;
+    // whether enough key space waits for the next checkpoint to be reused
+    virtual bool keysAwaitCheckpoint() const = 0;
+    // Visits the entries from cursor on, in an order of the index and about limit of
+    // them at a time, and returns the cursor to continue with, 0 at the end.
+    // An entry that stays in the index while the index is scanned chunk by
+    // chunk (unlocking in between) is visited at least once.
+    using ScanVisitor = std::function<void(const PolarString &key, const IndexData &data)>;
+    virtual uint64_t scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) = 0;
+    // Entries loaded between beginLoad and endLoad, without any search in
+    // between, may be kept aside and indexed all at once by endLoad, which
+    // hands the ones replaced by a later entry with the same key to dropped.
+    // By default they are inserted one by one.
+    virtual void beginLoad() {}
+    virtual IndexData load(const PolarString &key, const IndexData &data) { return insert(key, data); }
+    virtual void endLoad(const ScanVisitor &dropped) {}
+    // position at the first key not less than lower ("" for the smallest key),
+    // unordered indexes return nullptr
+    virtual Iterator *seek(const PolarString &lower) = 0;
+protected:
+    // copies the first used bytes of the image, the file keeps its size so that the index has the same capacity
+    static void copyImage(Snapshot *snapshot, const void *image, size_t used, size_t size);
+};
+
+#endif //TRIVIALKV_INDEX_H
@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <cassert>
 #include <new>
+#include <algorithm>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,9 +16,11 @@
 #include "utils.hpp"
 
 
-IndexTree::IndexTree(const std::string &filename) {
+IndexTree::IndexTree(const std::string &filename, size_t initial_size,
+                     const std::string &key_filename, size_t key_arena_size):
+    key_arena(key_filename, key_arena_size) {
     struct stat st = {};
-    index_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+    int index_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
     assert(index_file_fd > 0);
     fstat(index_file_fd, &st);
     index_file_size = (size_t) st.st_size;
@@ -25,57 +28,401 @@ IndexTree::IndexTree(const std::string &filename) {
     bool need_init = false;
     if (index_file_size == 0) {
         // no index yet
-        int ret = ftruncate(index_file_fd, INIT_INDEX_FILE_SIZE);
+        int ret = ftruncate(index_file_fd, initial_size);
         need_init = true;
         assert(ret == 0);
-        index_file_size = INIT_INDEX_FILE_SIZE;
+        index_file_size = initial_size;
     }
 
-    // round to page size
-    auto map_size = (size_t) round_up(index_file_size, 4096);
-    current_capacity = (uint32_t) (map_size - 2 * sizeof(uint32_t)) / sizeof(Node);
-
     // load index from file
-    file_map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_file_fd, 0);
-    assert(file_map != MAP_FAILED);
+    file_map = map_growable(index_file_fd, index_file_size, false);
+    assert(file_map != nullptr);
     initFileMap();
 
-    // init an empty tree
+    // init an empty tree, which is the first checkpoint
     if (need_init) {
         *root_node = -1;
         *node_count = 0;
+        *free_node = -1;
+        bool written = checkpoint(index_file_fd) && fdatasync(index_file_fd) == 0;
+        assert(written);
     }
+    // the private mapping stays valid after the descriptor is closed
+    close(index_file_fd);
 
+    flat_prefix = static_cast<int64_t*>(aligned_alloc(64, FLAT_TREE_SLOTS * sizeof(int64_t)));
+    flat_node = static_cast<int32_t*>(aligned_alloc(64, 2 * FLAT_TREE_SLOTS * sizeof(int32_t)));
+    assert(flat_prefix != nullptr && flat_node != nullptr);
+    memset(flat_prefix, 0, FLAT_TREE_SLOTS * sizeof(int64_t));
+    memset(flat_node, 0xff, 2 * FLAT_TREE_SLOTS * sizeof(int32_t));
+    copyFlat(1, *root_node);
 }
 
 IndexTree::~IndexTree() {
-    munmap(file_map, index_file_size);
-    close(index_file_fd);
+    free(flat_prefix);
+    free(flat_node);
+    unmap_growable(file_map);
 }
 
 
+// May run concurrently with insert (see Database::read), so node indices are
+// checked against the capacity of the mapping in use and the walk is bounded.
+// Below the flat copy, both children are prefetched while the node is compared.
 const IndexTree::NodeData &IndexTree::search(const PolarString &key) {
-    auto current = *root_node;
-    while (current != -1) {
-        auto result = fast_string_cmp(key.data(), nodes[current].key);
+    auto prefix = key_prefix(key);
+    auto capacity = current_capacity.load(std::memory_order_acquire);
+    auto nodes = this->nodes;
+    auto current = searchFlat(key, prefix, capacity);
+    for (int depth = 0; current != -1; ++depth) {
+        if (__glibc_unlikely((uint32_t) current >= capacity || depth > MAX_INDEX_TREE_HEIGHT)) {
+            return INDEX_NOT_FOUND;
+        }
+        auto &node = nodes[current];
+        __builtin_prefetch(&nodes[node.left]);
+        __builtin_prefetch(&nodes[node.right]);
+        auto result = compare(key, prefix, node);
         if (result == 0) break;
-        current = result < 0 ? nodes[current].left : nodes[current].right;
+        current = result < 0 ? node.left : node.right;
     }
     if (__glibc_unlikely(current == -1)) return INDEX_NOT_FOUND;
     else return nodes[current].data;
 }
 
 
-void IndexTree::insert(const PolarString &key, IndexData data) {
-    // fill in a new node
+// Keeps up to SEARCH_GROUP_SIZE walks in flight and moves each of them down
+// one level per round, prefetching the node it goes to next. The cache miss
+// of one walk is then overlapped with the comparisons of the others, and a
+// finished walk is immediately replaced by the next key.
+void IndexTree::searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                            IndexData *results) {
+    struct Walk {
+        size_t item;
+        int64_t prefix;
+        int32_t current;
+        int depth;
+    };
+    auto capacity = current_capacity.load(std::memory_order_acquire);
+    auto nodes = this->nodes;
+    size_t next_item = 0;
+    auto start = [&](Walk &walk) {
+        if (next_item == batch.size()) {
+            return false;
+        }
+        auto &key = keys[batch[next_item]];
+        auto prefix = key_prefix(key);
+        walk = {next_item, prefix, searchFlat(key, prefix, capacity), 0};
+        __builtin_prefetch(&nodes[walk.current]);
+        ++next_item;
+        return true;
+    };
+
+    Walk walks[SEARCH_GROUP_SIZE];
+    int active = 0;
+    while (active < SEARCH_GROUP_SIZE && start(walks[active])) {
+        ++active;
+    }
+    while (active > 0) {
+        for (int i = 0; i < active; ) {
+            auto &walk = walks[i];
+            auto current = walk.current;
+            if (__glibc_likely(current != -1 && (uint32_t) current < capacity && walk.depth <= MAX_INDEX_TREE_HEIGHT)) {
+                auto &node = nodes[current];
+                auto result = compare(keys[batch[walk.item]], walk.prefix, node);
+                if (result != 0) {
+                    walk.current = result < 0 ? node.left : node.right;
+                    ++walk.depth;
+                    __builtin_prefetch(&nodes[walk.current]);
+                    ++i;
+                    continue;
+                }
+                results[walk.item] = node.data;
+            } else {
+                results[walk.item] = INDEX_NOT_FOUND;
+            }
+            if (start(walk)) {
+                ++i;
+            } else {
+                // no more keys, close the gap with the last walk
+                walk = walks[--active];
+            }
+        }
+    }
+}
+
+
+// Returns the node of the key if it is in the flat copy, and the node the walk
+// goes on with otherwise (-1 if the key is not in the tree). Prefetching the
+// slots three levels down keeps the walk ahead of the cache misses.
+int32_t IndexTree::searchFlat(const PolarString &key, int64_t prefix, uint32_t capacity) const {
+    size_t slot = 1;
+    while (slot < FLAT_TREE_SLOTS) {
+        if (slot * 8 < FLAT_TREE_SLOTS) {
+            __builtin_prefetch(&flat_prefix[slot * 8]);
+        }
+        auto slot_prefix = flat_prefix[slot];
+        int result = prefix < slot_prefix ? -1 : prefix > slot_prefix ? 1 : 0;
+        if (__glibc_unlikely(result == 0)) {
+            // only the rest of the keys can tell them apart
+            auto node = flat_node[slot];
+            if (node == -1 || (uint32_t) node >= capacity) {
+                return node;
+            }
+            result = compare(key, prefix, nodes[node]);
+            if (result == 0) {
+                return node;
+            }
+        }
+        slot = slot * 2 + (result > 0);
+    }
+    return flat_node[slot];
+}
+
+
+// copies the subtree of node into the flat slots from slot down
+void IndexTree::copyFlat(size_t slot, int32_t node) {
+    if (slot >= 2 * FLAT_TREE_SLOTS || (node == -1 && flat_node[slot] == -1)) {
+        return;
+    }
+    flat_node[slot] = node;
+    if (slot >= FLAT_TREE_SLOTS) {
+        return;
+    }
+    flat_prefix[slot] = node == -1 ? 0 : key_prefix(nodes[node].prefix);
+    copyFlat(slot * 2, node == -1 ? -1 : nodes[node].left);
+    copyFlat(slot * 2 + 1, node == -1 ? -1 : nodes[node].right);
+}
+
+
+// An update relinks only the nodes on the path of its key (and, for a removed
+// node with two children, the subtree it leaves behind), and every rotation
+// puts another node at the top of its subtree. So the flat copy is updated by
+// following the path of the key, and copying the subtree of the first slot
+// that no longer holds the node the tree has there.
+void IndexTree::refreshFlat(const PolarString &key, int64_t prefix) {
+    size_t slot = 1;
+    auto current = *root_node;
+    while (slot < 2 * FLAT_TREE_SLOTS) {
+        if (flat_node[slot] != current) {
+            copyFlat(slot, current);
+            return;
+        }
+        if (current == -1) {
+            return;
+        }
+        auto result = compare(key, prefix, nodes[current]);
+        if (result == 0) {
+            return;
+        }
+        slot = slot * 2 + (result > 0);
+        current = result < 0 ? nodes[current].left : nodes[current].right;
+    }
+}
+
+
+IndexTree::Iterator *IndexTree::seek(const PolarString &lower) {
+    auto it = new Iterator(this);
+    auto current = *root_node;
+    if (lower.empty()) {
+        it->pushLeft(current);
+        return it;
+    }
+    auto prefix = key_prefix(lower);
+    while (current != -1) {
+        if (compare(lower, prefix, nodes[current]) <= 0) {
+            it->path.push_back(current);
+            current = nodes[current].left;
+        } else {
+            current = nodes[current].right;
+        }
+    }
+    return it;
+}
+
+
+void IndexTree::Iterator::next() {
+    auto current = path.back();
+    path.pop_back();
+    pushLeft(tree->nodes[current].right);
+}
+
+
+void IndexTree::Iterator::pushLeft(int32_t node) {
+    while (node != -1) {
+        path.push_back(node);
+        node = tree->nodes[node].left;
+    }
+}
+
+
+// loaded keys are always appended (see load)
+bool IndexTree::reserve(size_t key_size) {
+    if ((*free_node == -1 || load_first >= 0) && *node_count >= current_capacity && !growNodes()) {
+        return false;
+    }
+    return key_size <= (size_t) KEY_PREFIX_LENGTH || key_arena.reserve(key_size);
+}
+
+
+IndexData IndexTree::insert(const PolarString &key, IndexData data) {
+    // fill in a new node, the key is stored only when it is really new
     auto new_root = allocateNode();
     auto node = new (&nodes[new_root]) Node();
     node->data = data;
-    memcpy(node->key, key.data(), key.size());
-    node->key[key.size()] = '\0';
     // insert it to the tree
     int change;
-    _insert(*root_node, new_root, change);
+    auto replaced = INDEX_NOT_FOUND;
+    auto prefix = key_prefix(key);
+    _insert(*root_node, new_root, key, prefix, change, replaced);
+    if (replaced.slice != INDEX_NOT_FOUND.slice) {
+        // the key existed and was updated in place, hand back the unused node
+        freeNode(new_root);
+    } else {
+        refreshFlat(key, prefix);
+    }
+    return replaced;
+}
+
+
+IndexData IndexTree::remove(const PolarString &key) {
+    int32_t removed = -1;
+    auto prefix = key_prefix(key);
+    _remove(*root_node, key, prefix, removed);
+    if (removed == -1) {
+        return INDEX_NOT_FOUND;
+    }
+    refreshFlat(key, prefix);
+    auto data = nodes[removed].data;
+    freeNode(removed);
+    return data;
+}
+
+
+void IndexTree::sync() {
+    key_arena.sync();
+}
+
+
+// nodes past the node count have never been used
+void IndexTree::snapshot(Snapshot *snapshot) {
+    key_arena.seal();
+    copyImage(snapshot, file_map, INDEX_TREE_HEADER_SIZE + *node_count * sizeof(Node), index_file_size);
+}
+
+
+void IndexTree::fillNode(Node &node, const PolarString &key) {
+    memcpy(node.prefix, key.data(), min((int) key.size(), KEY_PREFIX_LENGTH));
+    node.key_length = (uint16_t) key.size();
+    if (key.size() > KEY_PREFIX_LENGTH) {
+        node.key_offset = key_arena.append(key.data(), key.size());
+    }
+}
+
+
+// Only an empty tree is built from the loaded keys, anything else takes
+// them one insert at a time.
+void IndexTree::beginLoad() {
+    if (*root_node == -1) {
+        load_first = *node_count;
+        load_sorted = true;
+    }
+}
+
+
+// The nodes are appended behind each other without linking them, and are
+// only linked by endLoad.
+IndexData IndexTree::load(const PolarString &key, const IndexData &data) {
+    if (load_first < 0) {
+        return insert(key, data);
+    }
+    auto node = appendNode();
+    auto _new = new (&nodes[node]) Node();
+    fillNode(*_new, key);
+    _new->data = data;
+    if (load_sorted && node > load_first && compare(key, key_prefix(key), nodes[node - 1]) <= 0) {
+        load_sorted = false;
+    }
+    return INDEX_NOT_FOUND;
+}
+
+
+// Keys that came in ascending order are linked into a perfectly balanced
+// tree in a single pass over their nodes. Other keys are sorted first, and
+// of equal keys only the last one loaded stays.
+void IndexTree::endLoad(const ScanVisitor &dropped) {
+    if (load_first < 0) {
+        return;
+    }
+    size_t count = *node_count - load_first;
+    // empty for keys in ascending order, their nodes are in order already
+    std::vector<int32_t> order;
+    if (!load_sorted) {
+        order.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            order[i] = (int32_t) (load_first + i);
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+            return compare(nodeKey(nodes[a]), key_prefix(nodes[a].prefix), nodes[b]) < 0;
+        });
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto &node = nodes[order[i]];
+            if (i + 1 < count && compare(nodeKey(node), key_prefix(node.prefix), nodes[order[i + 1]]) == 0) {
+                dropped(nodeKey(node), node.data);
+                freeNode(order[i]);
+            } else {
+                order[kept++] = order[i];
+            }
+        }
+        order.resize(kept);
+        count = kept;
+    }
+    int height;
+    *root_node = link(order, 0, count, height);
+    load_first = -1;
+    copyFlat(1, *root_node);
+}
+
+
+// links the nodes order[begin, end) into a subtree, returns its root
+int32_t IndexTree::link(const std::vector<int32_t> &order, size_t begin, size_t end, int &height) {
+    if (begin == end) {
+        height = 0;
+        return -1;
+    }
+    auto middle = begin + (end - begin) / 2;
+    auto root = order.empty() ? (int32_t) (load_first + middle) : order[middle];
+    int left_height, right_height;
+    nodes[root].left = link(order, begin, middle, left_height);
+    nodes[root].right = link(order, middle + 1, end, right_height);
+    nodes[root].balance_factor = (int16_t) (right_height - left_height);
+    height = max(left_height, right_height) + 1;
+    return root;
+}
+
+
+// Entries never move between nodes (removal relinks nodes instead of copying
+// keys), so walking the node array visits every entry once.
+uint64_t IndexTree::scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) {
+    auto end = cursor + limit < *node_count ? cursor + limit : *node_count;
+    for (auto i = cursor; i < end; ++i) {
+        if (nodes[i].data.slice != INDEX_NOT_FOUND.slice) {
+            visitor(nodeKey(nodes[i]), nodes[i].data);
+        }
+    }
+    return end < *node_count ? end : 0;
+}
+
+
+int IndexTree::compare(const PolarString &key, int64_t prefix, const Node &node) const {
+    return fast_key_cmp(prefix, key, key_prefix(node.prefix), nodeKey(node));
+}
+
+
+PolarString IndexTree::nodeKey(const Node &node) const {
+    if (node.key_length <= KEY_PREFIX_LENGTH) {
+        return {node.prefix, node.key_length};
+    }
+    return {key_arena.at(node.key_offset, node.key_length), node.key_length};
 }
 
 
@@ -179,9 +526,11 @@ int IndexTree::rotateTwice(int32_t &root, int direction) {
 }
 
 
-bool IndexTree::_insert(int32_t &root, int32_t new_node, int &balance_change) {
+bool IndexTree::_insert(int32_t &root, int32_t new_node, const PolarString &key, int64_t prefix, int &balance_change,
+                        IndexData &replaced) {
 
     if (root == -1) {
+        fillNode(nodes[new_node], key);
         root = new_node;
         balance_change = 1;
         return false;
@@ -194,20 +543,19 @@ bool IndexTree::_insert(int32_t &root, int32_t new_node, int &balance_change) {
 
 //    printf("Insert querying: %d left %d right %d key %s\n", root, _root.left, _root.right, _root.key);
 
-    auto result = fast_string_cmp(_new.key, _root.key);
+    auto result = compare(key, prefix, _root);
 
     if (__glibc_likely(result != 0)) {
         auto &sub_tree_id = result == -1 ? _root.left : _root.right;
-        if (_insert(sub_tree_id, new_node, balance_change)) {
+        if (_insert(sub_tree_id, new_node, key, prefix, balance_change, replaced)) {
             return true;
         }
         height_increase = result * balance_change;
     } else {
-        // found existing node, replace it
-        root = new_node;
-        _new.left = _root.left;
-        _new.right = _root.right;
-        _new.balance_factor = _root.balance_factor;
+        // found existing node, update it in place (optimistic readers validate
+        // their search anyway), so overwrites do not leak nodes
+        replaced = _root.data;
+        _root.data = _new.data;
         return true;
     }
 
@@ -224,28 +572,116 @@ bool IndexTree::_insert(int32_t &root, int32_t new_node, int &balance_change) {
 }
 
 
-// allocate a new tree node from mapped memory
+// Returns whether the height of the subtree decreased. A node with two
+// children is replaced by its successor node, which takes over its links.
+bool IndexTree::_remove(int32_t &root, const PolarString &key, int64_t prefix, int32_t &removed) {
+    if (root == -1) {
+        return false;
+    }
+    auto &_root = nodes[root];
+    auto result = compare(key, prefix, _root);
+    if (__glibc_likely(result != 0)) {
+        auto &sub_tree_id = result == -1 ? _root.left : _root.right;
+        return _remove(sub_tree_id, key, prefix, removed) && shrink(root, -result);
+    }
+
+    removed = root;
+    if (_root.left == -1 || _root.right == -1) {
+        root = _root.left == -1 ? _root.right : _root.left;
+        return true;
+    }
+    int32_t successor;
+    auto right_shrunk = removeMin(_root.right, successor);
+    auto &_successor = nodes[successor];
+    _successor.left = _root.left;
+    _successor.right = _root.right;
+    _successor.balance_factor = _root.balance_factor;
+    root = successor;
+    return right_shrunk && shrink(root, -1);
+}
+
+
+// unlink the leftmost node of the subtree, returns whether its height decreased
+bool IndexTree::removeMin(int32_t &root, int32_t &removed) {
+    auto &_root = nodes[root];
+    if (_root.left == -1) {
+        removed = root;
+        root = _root.right;
+        return true;
+    }
+    return removeMin(_root.left, removed) && shrink(root, 1);
+}
+
+
+// one side of root lost a level (the left one for direction 1, the right one
+// for -1), returns whether the height of root decreased as well
+bool IndexTree::shrink(int32_t &root, int direction) {
+    auto &_root = nodes[root];
+    _root.balance_factor += direction;
+    if (_root.balance_factor == 0) {
+        return true;
+    }
+    if (_root.balance_factor == 1 || _root.balance_factor == -1) {
+        return false;
+    }
+    return balance(root) == 1;
+}
+
+
+// allocate a new tree node from mapped memory, reusing the nodes of removed keys
 uint32_t IndexTree::allocateNode() {
+    if (*free_node != -1) {
+        auto node = *free_node;
+        *free_node = nodes[node].left;
+        return (uint32_t) node;
+    }
+    return appendNode();
+}
+
+
+uint32_t IndexTree::appendNode() {
     if (__glibc_unlikely(*node_count >= current_capacity)) {
-//        printf("Re-mapping index file to extend size\n");
-        // extend the index file size
-        int ret = ftruncate(index_file_fd, index_file_size * 2);
-        assert(ret == 0);
-        file_map = mremap(file_map, index_file_size, index_file_size * 2, MREMAP_MAYMOVE);
-        assert(file_map != MAP_FAILED);
-        index_file_size *= 2;
-        current_capacity = (uint32_t) (index_file_size - 2 * sizeof(uint32_t)) / sizeof(Node);
-        initFileMap();
+        bool grown = growNodes();
+        assert(grown);
     }
     *node_count += 1;
     return *node_count - 1;
 }
 
 
+// extend the index file size, existing nodes stay where they are
+bool IndexTree::growNodes() {
+    auto new_size = grown_size(index_file_size);
+    if (!grow_mapping(-1, file_map, index_file_size, new_size, false)) {
+        return false;
+    }
+    index_file_size = new_size;
+    initFileMap();
+    return true;
+}
+
+
+// The node is marked free, so scans never see a node that is about to be reused,
+// and its key goes back to the arena.
+void IndexTree::freeNode(int32_t node) {
+    if (nodes[node].key_length > KEY_PREFIX_LENGTH) {
+        key_arena.release(nodes[node].key_offset, nodes[node].key_length);
+    }
+    nodes[node].data = INDEX_NOT_FOUND;
+    nodes[node].right = -1;
+    nodes[node].left = *free_node;
+    *free_node = node;
+}
+
+
 void IndexTree::initFileMap() {
     madvise(file_map, index_file_size, MADV_RANDOM);
     node_count = reinterpret_cast<uint32_t*>(file_map);
     root_node = reinterpret_cast<int32_t*>(node_count + 1);
-    nodes = reinterpret_cast<Node*>(root_node + 1);
+    free_node = root_node + 1;
+    nodes = reinterpret_cast<Node*>((char*) file_map + INDEX_TREE_HEADER_SIZE);
+    // publish the new capacity only after the new node pointer
+    current_capacity.store((uint32_t) ((index_file_size - INDEX_TREE_HEADER_SIZE) / sizeof(Node)),
+                           std::memory_order_release);
 //    printf("Index file map: %p %p %p\n", node_count, root_node, nodes);
-}
\ No newline at end of file
+}
\ No newline at end of file
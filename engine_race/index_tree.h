@@ -6,61 +6,126 @@
 #define TRIVIALKV_INDEX_TREE_H
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include <cstddef>
 
-#include "include/polar_string.h"
-
-using polar_race::PolarString;
-
-struct IndexData {
-    int32_t slice;
-    uint32_t offset;
-    uint32_t length;
-};
-
-const IndexData INDEX_NOT_FOUND = {-1, 0, 0};
-
-const int MAX_KEY_LENGTH = 1024;
+#include "index.h"
+#include "key_arena.h"
 
 template<class T>
 struct IndexItem {
     using DataType = T;
-    char key[MAX_KEY_LENGTH + 1] = { 0 };
+    // leading bytes of the key, zero padded, so short keys need no key arena access
+    char prefix[KEY_PREFIX_LENGTH] = { 0 };
+    // offset of the full key in the key arena, only used for keys longer than the prefix
+    uint64_t key_offset = 0;
     T data;
+    uint16_t key_length = 0;
     int16_t balance_factor = 0;
     int32_t left = -1;
     int32_t right = -1;
 };
 
 
-class IndexTree {
+class IndexTree : public Index {
 public:
     using Node = IndexItem<IndexData>;
     using NodeData = Node::DataType;
 
-    explicit IndexTree(const std::string &filename);
-    ~IndexTree();
-    const NodeData &search(const PolarString &key);
-    void insert(const PolarString &key, IndexData data);
+    class Iterator : public Index::Iterator {
+    public:
+        bool valid() const override { return !path.empty(); }
+        PolarString key() const override { return tree->nodeKey(tree->nodes[path.back()]); }
+        const NodeData &data() const override { return tree->nodes[path.back()].data; }
+        void next() override;
+    private:
+        friend class IndexTree;
+        explicit Iterator(IndexTree *tree): tree(tree) {}
+        void pushLeft(int32_t node);
+        IndexTree *tree;
+        // nodes whose left subtree has been visited, at most the tree height
+        std::vector<int32_t> path;
+    };
+
+    IndexTree(const std::string &filename, size_t initial_size,
+              const std::string &key_filename, size_t key_arena_size);
+    ~IndexTree() override;
+    const NodeData &search(const PolarString &key) override;
+    void searchBatch(const std::vector<PolarString> &keys, const std::vector<uint32_t> &batch,
+                     IndexData *results) override;
+    bool reserve(size_t key_size) override;
+    IndexData insert(const PolarString &key, IndexData data) override;
+    IndexData remove(const PolarString &key) override;
+    void sync() override;
+    void snapshot(Snapshot *snapshot) override;
+    void checkpointed() override { key_arena.reuseSealed(); }
+    bool keysAwaitCheckpoint() const override { return key_arena.awaitsCheckpoint(); }
+    Iterator *seek(const PolarString &lower) override;
+    uint64_t scan(uint64_t cursor, size_t limit, const ScanVisitor &visitor) override;
+    void beginLoad() override;
+    IndexData load(const PolarString &key, const IndexData &data) override;
+    void endLoad(const ScanVisitor &dropped) override;
 private:
     void initFileMap();
     uint32_t allocateNode();
+    uint32_t appendNode();
+    bool growNodes();
+    void fillNode(Node &node, const PolarString &key);
+    int32_t link(const std::vector<int32_t> &order, size_t begin, size_t end, int &height);
+    void freeNode(int32_t node);
     int balance(int32_t &root);
-    bool _insert(int32_t &root, int32_t new_node, int &balance_change);
+    bool _insert(int32_t &root, int32_t new_node, const PolarString &key, int64_t prefix, int &balance_change,
+                 IndexData &replaced);
+    bool _remove(int32_t &root, const PolarString &key, int64_t prefix, int32_t &removed);
+    bool removeMin(int32_t &root, int32_t &removed);
+    bool shrink(int32_t &root, int direction);
     int rotateOnce(int32_t &root, int direction);
     int rotateTwice(int32_t &root, int direction);
+    int compare(const PolarString &key, int64_t prefix, const Node &node) const;
+    PolarString nodeKey(const Node &node) const;
+    int32_t searchFlat(const PolarString &key, int64_t prefix, uint32_t capacity) const;
+    void copyFlat(size_t slot, int32_t node);
+    void refreshFlat(const PolarString &key, int64_t prefix);
 
-    int index_file_fd;
     size_t index_file_size;
-    uint32_t current_capacity;
+    std::atomic<uint32_t> current_capacity;
 
     void *file_map;
     uint32_t *node_count;
     int32_t *root_node;
+    // first node of removed keys, which are marked by INDEX_NOT_FOUND as their
+    // data, chained by their left links and reused before the file grows
+    int32_t *free_node;
     Node *nodes;
 
+    // Copy of the upper FLAT_TREE_HEIGHT levels of the tree in memory, in
+    // breadth-first (Eytzinger) order from slot 1: the children of slot i are
+    // 2i and 2i + 1. The prefixes of the nodes are enough to decide the
+    // direction of most steps, so a search touches no node on these levels.
+    // The node slots reach one level deeper, to the nodes the walk goes on
+    // with. Empty subtrees are all -1.
+    int64_t *flat_prefix;
+    int32_t *flat_node;
+
+    // first node of a load into an empty tree, -1 when no such load is running,
+    // and whether its keys have come in ascending order so far
+    int64_t load_first = -1;
+    bool load_sorted = false;
+
+    KeyArena key_arena;
+
 };
 
-const int INIT_INDEX_FILE_SIZE = 16 * 1024 * 1024;
+// node count, root, free list head and padding, so that nodes stay 8-byte aligned
+const size_t INDEX_TREE_HEADER_SIZE = 16;
+// AVL trees are at most 1.44 log2(n) high, anything deeper is a torn read
+const int MAX_INDEX_TREE_HEIGHT = 64;
+// number of tree walks interleaved by searchBatch
+const int SEARCH_GROUP_SIZE = 8;
+// levels kept in the flat copy, 24 KB per index: more of them crowd the
+// nodes of keys with a common prefix out of the cache
+const int FLAT_TREE_HEIGHT = 10;
+const size_t FLAT_TREE_SLOTS = (size_t) 1 << FLAT_TREE_HEIGHT;
 
 #endif //TRIVIALKV_INDEX_TREE_H
@@ -0,0 +1,191 @@
+//
+// Created by Harry Chen on 2019/4/20.
+//
+
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "key_arena.h"
+#include "crc32c.h"
+
+// large enough for any 16-bit key length
+const char KeyArena::invalid_key[1 << 16] = { 0 };
+
+
+KeyArena::KeyArena(const std::string &filename, size_t initial_size) {
+    struct stat st = {};
+    arena_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+    assert(arena_file_fd > 0);
+    fstat(arena_file_fd, &st);
+    arena_file_size = (size_t) st.st_size;
+
+    bool need_init = false;
+    if (arena_file_size == 0) {
+        int ret = ftruncate(arena_file_fd, initial_size);
+        need_init = true;
+        assert(ret == 0);
+        arena_file_size = initial_size;
+    }
+
+    file_map = map_growable(arena_file_fd, arena_file_size);
+    assert(file_map != nullptr);
+    initFileMap();
+
+    if (need_init) {
+        *used_size = 0;
+    }
+    // the loaded checkpoint may refer to any key stored so far
+    sealed_size = *used_size;
+    loadFree();
+}
+
+KeyArena::~KeyArena() {
+    saveFree();
+    unmap_growable(file_map);
+    close(arena_file_fd);
+}
+
+
+uint64_t KeyArena::append(const char *key, size_t size) {
+    if (size < free_blocks.size() && !free_blocks[size].empty()) {
+        auto offset = free_blocks[size].back();
+        free_blocks[size].pop_back();
+        reused.insert(offset);
+        memcpy(data + offset, key, size);
+        return offset;
+    }
+    bool reserved = reserve(size);
+    assert(reserved);
+    auto offset = *used_size;
+    memcpy(data + offset, key, size);
+    *used_size += size;
+    return offset;
+}
+
+
+void KeyArena::release(uint64_t offset, size_t size) {
+    if (reused.erase(offset) != 0 || offset >= sealed_size) {
+        // in no checkpoint
+        addFree(offset, size);
+    } else {
+        released.push_back({offset, (uint32_t) size});
+        waiting_size += size;
+    }
+}
+
+
+void KeyArena::seal() {
+    sealed.insert(sealed.end(), released.begin(), released.end());
+    released.clear();
+    reused.clear();
+    sealed_size = *used_size;
+}
+
+
+void KeyArena::reuseSealed() {
+    for (auto &block: sealed) {
+        addFree(block.first, block.second);
+        waiting_size -= block.second;
+    }
+    sealed.clear();
+}
+
+
+// extend the arena file to hold size more bytes, stored keys stay where they are
+bool KeyArena::reserve(size_t size) {
+    if (__glibc_likely(*used_size + size <= arena_file_size - sizeof(uint64_t))) {
+        return true;
+    }
+    auto new_size = grown_size(arena_file_size, *used_size + size + sizeof(uint64_t));
+    if (!grow_mapping(arena_file_fd, file_map, arena_file_size, new_size)) {
+        return false;
+    }
+    arena_file_size = new_size;
+    initFileMap();
+    return true;
+}
+
+
+// On a clean exit, the last checkpoint holds the whole index, and the free
+// space is chained through the free keys themselves (each one is longer than
+// a link), from a list header right past the used part of the arena. The next
+// start takes the list back and marks it as taken before any key can be
+// stored over it, so a start after a crash never finds a stale one.
+void KeyArena::saveFree() {
+    FreeListHeader list = {FREE_LIST_MAGIC, *used_size, 0, 0, 0};
+    for (size_t size = 0; size < free_blocks.size(); ++size) {
+        for (auto offset: free_blocks[size]) {
+            memcpy(data + offset, &list.first, sizeof(list.first));
+            list.checksum = crc32c(data + offset, sizeof(list.first), (uint32_t) list.checksum);
+            list.first = offset << 16 | size;
+            list.count++;
+        }
+    }
+    if (list.count == 0 || !reserve(sizeof(list))) {
+        return;
+    }
+    fdatasync(arena_file_fd);
+    memcpy(data + *used_size, &list, sizeof(list));
+    fdatasync(arena_file_fd);
+}
+
+
+void KeyArena::loadFree() {
+    FreeListHeader list = {};
+    if (*used_size + sizeof(list) > arena_file_size - sizeof(uint64_t)) {
+        return;
+    }
+    memcpy(&list, data + *used_size, sizeof(list));
+    if (list.magic != FREE_LIST_MAGIC || list.used_size != *used_size) {
+        return;
+    }
+    // the links are checked in reverse order of saving
+    std::vector<uint64_t> links;
+    for (auto link = list.first; links.size() < list.count; ) {
+        auto offset = link >> 16, size = link & 0xffff;
+        if (size <= sizeof(link) || offset + size > *used_size) {
+            break;
+        }
+        links.push_back(link);
+        memcpy(&link, data + offset, sizeof(link));
+    }
+    uint32_t checksum = 0;
+    for (auto i = links.size(); i > 0; --i) {
+        checksum = crc32c(data + (links[i - 1] >> 16), sizeof(uint64_t), checksum);
+    }
+    if (links.size() == list.count && checksum == list.checksum) {
+        for (auto link: links) {
+            addFree(link >> 16, link & 0xffff);
+        }
+    }
+    memset(data + *used_size, 0, sizeof(list));
+    fdatasync(arena_file_fd);
+}
+
+
+void KeyArena::addFree(uint64_t offset, size_t size) {
+    if (size >= free_blocks.size()) {
+        free_blocks.resize(size + 1);
+    }
+    free_blocks[size].push_back(offset);
+}
+
+
+// fdatasync also writes back the pages dirtied through the mapping
+void KeyArena::sync() {
+    fdatasync(arena_file_fd);
+}
+
+
+void KeyArena::initFileMap() {
+    madvise(file_map, arena_file_size, MADV_RANDOM);
+    used_size = reinterpret_cast<uint64_t*>(file_map);
+    data = reinterpret_cast<char*>(used_size + 1);
+    // publish the new capacity only after the new data pointer
+    capacity.store(arena_file_size - sizeof(uint64_t), std::memory_order_release);
+}
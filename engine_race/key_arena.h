@@ -0,0 +1,92 @@
+//
+// Created by Harry Chen on 2019/4/20.
+//
+
+#ifndef TRIVIALKV_KEY_ARENA_H
+#define TRIVIALKV_KEY_ARENA_H
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <utility>
+#include <atomic>
+#include <cstdint>
+
+#include "utils.hpp"
+
+// Storage of full keys, referenced by offset from index nodes. The space of a
+// removed key is reused for a key of the same size, but only once no
+// checkpoint that recovery may load refers to it: a key stored since the last
+// checkpoint was copied is in none, any other one waits until the next
+// checkpoint is recorded. The free space is kept in memory, and saved in the
+// arena file only when the process exits cleanly (after a crash it stays
+// unused until RebuildIndex writes a new arena).
+class KeyArena {
+public:
+    KeyArena(const std::string &filename, size_t initial_size);
+    ~KeyArena();
+    // makes room for appending size bytes, false past the mapping reservation
+    bool reserve(size_t size);
+    // the room must have been reserved
+    uint64_t append(const char *key, size_t size);
+    // the key stored at offset is no longer referenced by the index
+    void release(uint64_t offset, size_t size);
+    // called while the index is copied into a checkpoint, and once that
+    // checkpoint is recorded, which frees the keys released before the copy
+    void seal();
+    void reuseSealed();
+    // whether a good part of the arena waits for a checkpoint to be reused
+    bool awaitsCheckpoint() const {
+        return waiting_size != 0 && waiting_size * KEY_ARENA_WAITING_FRACTION >= *used_size;
+    }
+    void sync();
+    // a reference read concurrently with a writer may be garbage, so it is
+    // checked against the mapping and a dummy key is returned when it is out of range
+    const char *at(uint64_t offset, size_t size) const {
+        auto limit = capacity.load(std::memory_order_acquire);
+        auto base = data;
+        return __glibc_likely(offset + size <= limit) ? base + offset : invalid_key;
+    }
+private:
+    void initFileMap();
+    void addFree(uint64_t offset, size_t size);
+    void saveFree();
+    void loadFree();
+
+    // the list of free space saved on exit
+    struct FreeListHeader {
+        uint64_t magic;
+        uint64_t used_size;
+        uint64_t count;
+        // link to the last free key saved, as offset << 16 | size
+        uint64_t first;
+        uint64_t checksum;
+    };
+    static const uint64_t FREE_LIST_MAGIC = 0x45455246564b5654; // "TVKVFREE"
+
+    using Block = std::pair<uint64_t, uint32_t>;
+    // offsets of reusable space by key size
+    std::vector<std::vector<uint64_t>> free_blocks;
+    // released since the last copy and released before it, both may still
+    // be referenced by a checkpoint
+    std::vector<Block> released, sealed;
+    uint64_t waiting_size = 0;
+    // keys stored since the last copy: appended past sealed_size, or reused
+    uint64_t sealed_size;
+    std::unordered_set<uint64_t> reused;
+    static const int KEY_ARENA_WAITING_FRACTION = 4;
+
+    int arena_file_fd;
+    size_t arena_file_size;
+    std::atomic<size_t> capacity;
+
+    void *file_map;
+    uint64_t *used_size;
+    char *data;
+
+    static const char invalid_key[];
+};
+
+const size_t INIT_KEY_ARENA_SIZE = 4 * 1024 * 1024;
+
+#endif //TRIVIALKV_KEY_ARENA_H
@@ -0,0 +1,72 @@
+//
+// Created by Harry Chen on 2019/5/2.
+//
+
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+static bool valid_options(const Options &options) {
+    // offsets inside a slice are 32-bit and must not overflow while writers race
+    return options.shard_count > 0 &&
+           options.slice_size >= 4096 && options.slice_size <= (1u << 31) &&
+           options.max_slice_count > 0 &&
+           options.initial_index_size >= 4096 &&
+           options.index_type >= Options::kAVLTree && options.index_type <= Options::kHashTable &&
+           options.shard_routing >= Options::kRouteByHash && options.shard_routing <= Options::kRouteByPrefix;
+}
+
+// not recorded in the manifest, checked on every open
+static bool valid_durability(const Options &options) {
+    return options.durability >= Options::kDurabilityNone && options.durability <= Options::kDurabilitySync &&
+           (options.durability != Options::kDurabilityPeriodic || options.sync_interval_ms > 0);
+}
+
+static RetCode save_manifest(const std::string &filename, const Options &options) {
+    Manifest manifest = {
+            MANIFEST_MAGIC, MANIFEST_VERSION,
+            options.shard_count, options.slice_size, options.max_slice_count, options.initial_index_size,
+            (uint32_t) options.index_type, (uint32_t) options.shard_routing
+    };
+    // write aside and rename, so a crash never leaves a partial manifest
+    auto temp_filename = filename + ".tmp";
+    int fd = open(temp_filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return polar_race::kIOError;
+    auto written = write(fd, &manifest, sizeof(manifest));
+    auto synced = fsync(fd);
+    close(fd);
+    if (written != sizeof(manifest) || synced != 0 || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        return polar_race::kIOError;
+    }
+    return polar_race::kSucc;
+}
+
+RetCode load_manifest(const std::string &dir, Options &options) {
+    if (!valid_durability(options)) return polar_race::kInvalidArgument;
+    auto filename = dir + ".manifest";
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        // a new store
+        if (!valid_options(options)) return polar_race::kInvalidArgument;
+        return save_manifest(filename, options);
+    }
+
+    Manifest manifest = {};
+    auto size = read(fd, &manifest, sizeof(manifest));
+    close(fd);
+    if (size != sizeof(manifest) || manifest.magic != MANIFEST_MAGIC) {
+        return polar_race::kCorruption;
+    }
+    if (manifest.version != MANIFEST_VERSION) {
+        return polar_race::kNotSupported;
+    }
+    options.shard_count = manifest.shard_count;
+    options.slice_size = manifest.slice_size;
+    options.max_slice_count = manifest.max_slice_count;
+    options.initial_index_size = manifest.initial_index_size;
+    options.index_type = (Options::IndexType) manifest.index_type;
+    options.shard_routing = (Options::ShardRouting) manifest.shard_routing;
+    return valid_options(options) ? polar_race::kSucc : polar_race::kCorruption;
+}
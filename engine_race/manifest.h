@@ -0,0 +1,43 @@
+//
+// Created by Harry Chen on 2019/5/2.
+//
+
+#ifndef TRIVIALKV_MANIFEST_H
+#define TRIVIALKV_MANIFEST_H
+
+#include <string>
+#include <cstdint>
+
+#include "include/engine.h"
+
+using polar_race::Options;
+using polar_race::RetCode;
+
+// on-disk copy of the options a store was created with, saved as <dir>.manifest
+struct Manifest {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shard_count;
+    uint32_t slice_size;
+    uint32_t max_slice_count;
+    uint32_t initial_index_size;
+    uint32_t index_type;
+    uint32_t shard_routing;
+};
+
+const uint32_t MANIFEST_MAGIC = 0x564b5654; // "TVKV"
+// 2: 64-bit value lengths in the index
+// 3: free node list in the AVL tree index header
+// 4: memcmp key order in the AVL and B+ tree indexes
+// 5: index checkpoints with a write-ahead log, instead of tombstones
+// 6: values framed with their key and a CRC32C in slices
+// 7: sequence numbers and deletions in slice records, trailers on blob files
+// 8: start sequence numbers of slices in the usage file
+const uint32_t MANIFEST_VERSION = 8;
+
+// replace options with the ones of an existing store,
+// or check and record them if the store is new;
+// stores of another format version are kNotSupported
+RetCode load_manifest(const std::string &dir, Options &options);
+
+#endif //TRIVIALKV_MANIFEST_H
@@ -6,27 +6,137 @@
 #define TRIVIALKV_UTILS_H
 
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "include/engine.h"
 
 using polar_race::PolarString;
+using polar_race::Options;
 
 #define inline inline __attribute__((always_inline))
 
-// at most 64 concurrent access
-const int DATABASE_SHARDS = 1 << 7;
 
-inline int get_shard_number(const PolarString &key) {
-    auto shard_bits = __builtin_ctz(DATABASE_SHARDS);
-//    assert(shard_bits <= 8);
-    auto shard_num = 0;
-    shard_num = (uint8_t) (key.data()[0]) >> (8 - shard_bits);
-    return shard_num;
+
+using MappingList = std::vector<std::pair<void*, size_t>>;
+
+inline void unmap_all(MappingList &mappings) {
+    for (auto &mapping: mappings) {
+        munmap(mapping.first, mapping.second);
+    }
+    mappings.clear();
+}
+
+// make files created in (or renamed into) the directory of path durable
+inline void sync_parent_directory(const std::string &path) {
+    auto slash = path.rfind('/');
+    auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// large files are read and written in pieces of this size
+const size_t FILE_IO_CHUNK_SIZE = 1 << 20;
+
+// at position in the file
+inline bool write_fully(int fd, const char *data, size_t size, off_t position = 0) {
+    for (size_t done = 0; done < size; ) {
+        auto length = size - done < FILE_IO_CHUNK_SIZE ? size - done : FILE_IO_CHUNK_SIZE;
+        auto written = pwrite(fd, data + done, length, position + done);
+        if (written <= 0) return false;
+        done += written;
+    }
+    return true;
 }
 
+inline bool read_fully(int fd, char *data, size_t size, off_t position = 0) {
+    for (size_t done = 0; done < size; ) {
+        auto length = size - done < FILE_IO_CHUNK_SIZE ? size - done : FILE_IO_CHUNK_SIZE;
+        auto got = pread(fd, data + done, length, position + done);
+        if (got <= 0) return false;
+        done += got;
+    }
+    return true;
+}
 
 inline long round_up(long a, long b) {
     return ((a + b - 1) / b) * b;
 }
 
+// Files that grow in place (index nodes, B+ tree pages and key arenas) are mapped
+// into address space reserved up front. Growing one only maps the added segment
+// behind the existing mapping, which never moves, so optimistic readers (see
+// Database::read) can keep walking it and no page table is rebuilt. Indexes map
+// their checkpoint privately (see Database::checkpoint), then neither their
+// changes nor the space they grow by ever reach the file.
+const size_t GROWABLE_MAP_RESERVATION = 16ull << 30;
+// growable files double up to this size, and grow by this much from then on
+const size_t GROWABLE_MAP_SEGMENT = 64 << 20;
+
+// nullptr if the file is larger than the reservation or can not be mapped
+inline void *map_growable(int fd, size_t size, bool shared = true) {
+    if (size > GROWABLE_MAP_RESERVATION) {
+        return nullptr;
+    }
+    auto base = mmap(nullptr, GROWABLE_MAP_RESERVATION, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    auto map = mmap(base, size, PROT_READ | PROT_WRITE, (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, 0);
+    if (map != base) {
+        munmap(base, GROWABLE_MAP_RESERVATION);
+        return nullptr;
+    }
+    return base;
+}
+
+// the size to grow a file of size bytes to, so that it holds at least needed
+// bytes; it stops at the reservation unless needed is beyond it
+inline size_t grown_size(size_t size, size_t needed = 0) {
+    do {
+        size = size < GROWABLE_MAP_SEGMENT ? size * 2 : size + GROWABLE_MAP_SEGMENT;
+    } while (size < needed);
+    return size > GROWABLE_MAP_RESERVATION && needed <= GROWABLE_MAP_RESERVATION ? GROWABLE_MAP_RESERVATION : size;
+}
+
+// Extends the file from old_size to new_size and maps the added part, a
+// private mapping grows by anonymous memory and leaves the file alone. Fails
+// past the reservation, or if the file or the mapping can not be extended.
+inline bool grow_mapping(int fd, void *base, size_t old_size, size_t new_size, bool shared = true) {
+    if (new_size > GROWABLE_MAP_RESERVATION || new_size <= old_size) {
+        return false;
+    }
+    if (shared && ftruncate(fd, new_size) != 0) {
+        return false;
+    }
+    // the page holding the old end of file is mapped already
+    auto start = (size_t) round_up(old_size, 4096);
+    auto end = (size_t) round_up(new_size, 4096);
+    if (end > start) {
+        auto map = shared ?
+            mmap((char*) base + start, end - start, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, start) :
+            mmap((char*) base + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void unmap_growable(void *base) {
+    munmap(base, GROWABLE_MAP_RESERVATION);
+}
+
 inline int min(int a, int b) {
     return  (a < b) ? a : b;
 }
@@ -36,15 +146,78 @@ inline int max(int a, int b) {
     return  (a > b) ? a : b;
 }
 
-inline int fast_string_cmp(const char* a, const char *b) {
-    auto fast_this = reinterpret_cast<const int64_t*>(a);
-    auto fast_that = reinterpret_cast<const int64_t*>(b);
-    auto fast_result = *fast_this - *fast_that;
-    if (fast_result != 0) return fast_result < 0 ? -1 : 1;
-    auto result = strcmp(a, b);
+// first 8 bytes of a key, zero padded, as they are stored in the indexes
+inline int64_t raw_prefix(const PolarString &key) {
+    int64_t result = 0;
+    memcpy(&result, key.data(), key.size() < sizeof(result) ? key.size() : sizeof(result));
+    return result;
+}
+
+// Stored prefix bytes as a big-endian integer with the sign bit flipped, so
+// that comparing two of them as signed integers gives the memcmp order.
+inline int64_t ordered_prefix(int64_t raw) {
+    return (int64_t) (__builtin_bswap64((uint64_t) raw) ^ (1ull << 63));
+}
+
+// first 8 bytes of a key as an ordered integer, zero padded
+inline int64_t key_prefix(const char *prefix) {
+    int64_t result;
+    memcpy(&result, prefix, sizeof(result));
+    return ordered_prefix(result);
+}
+
+inline int64_t key_prefix(const PolarString &key) {
+    return ordered_prefix(raw_prefix(key));
+}
+
+// Compare the ordered prefixes first, and only look at the rest of the keys when
+// they are equal. Keys are ordered like memcmp, a key comes before its extensions
+// (also those continuing with zero bytes).
+inline int fast_key_cmp(int64_t prefix_a, const PolarString &a, int64_t prefix_b, const PolarString &b) {
+    if (prefix_a != prefix_b) return prefix_a < prefix_b ? -1 : 1;
+    auto skip_a = a.size() < sizeof(prefix_a) ? a.size() : sizeof(prefix_a);
+    auto skip_b = b.size() < sizeof(prefix_b) ? b.size() : sizeof(prefix_b);
+    auto result = PolarString(a.data() + skip_a, a.size() - skip_a).compare(
+            PolarString(b.data() + skip_b, b.size() - skip_b));
+    if (result == 0 && a.size() != b.size()) result = a.size() < b.size() ? -1 : 1;
     return result < 0 ? -1 : result > 0 ? 1 : 0;
 }
 
+inline int fast_string_cmp(const PolarString &a, const PolarString &b) {
+    return fast_key_cmp(key_prefix(a), a, key_prefix(b), b);
+}
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    auto result = (unsigned __int128) a * b;
+    return (uint64_t) result ^ (uint64_t) (result >> 64);
+}
+
+// multiply-xorshift hash over 8-byte words, in the spirit of wyhash
+inline uint64_t key_hash(const PolarString &key) {
+    const uint64_t seed = 0xa0761d6478bd642full, multiplier = 0xe7037ed1a0b428dbull;
+    auto data = key.data();
+    auto size = key.size();
+    auto result = seed ^ size;
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        result = hash_mix(result ^ word, multiplier);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, size);
+    return hash_mix(hash_mix(result ^ tail, multiplier), seed);
+}
+
+inline uint32_t get_shard_number(const PolarString &key, uint32_t shard_count, Options::ShardRouting routing) {
+    if (routing == Options::kRouteByPrefix) {
+        uint64_t first = key.empty() ? 0 : (uint8_t) key.data()[0];
+        return (uint32_t) (first * shard_count >> 8);
+    }
+    // map the high half of the hash onto [0, shard_count) with a multiply-shift,
+    // hash indexes use the low half to place keys inside a shard
+    return (uint32_t) ((key_hash(key) >> 32) * shard_count >> 32);
+}
+
 #undef inline
 
 #endif //TRIVIALKV_UTILS_H
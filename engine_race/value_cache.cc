@@ -0,0 +1,514 @@
+//
+// Created by Harry Chen on 2019/5/12.
+//
+
+#include <cstring>
+#include <new>
+
+#include "value_cache.h"
+#include "utils.hpp"
+
+// allocator and table space charged to every entry on top of its own size
+static const uint64_t ENTRY_OVERHEAD = 48;
+static const size_t INITIAL_SLOTS = 64;
+static const uint64_t SKETCH_SEED = 0x9e3779b97f4a7c15ull;
+
+namespace {
+
+// Every thread gets a reader slot, the same one in all caches, and hands it
+// back when it exits.
+pthread_mutex_t reader_slot_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<int> free_reader_slots;
+int next_reader_slot = 0;
+
+struct ReaderSlot {
+    int index;
+    ReaderSlot() {
+        pthread_mutex_lock(&reader_slot_lock);
+        if (free_reader_slots.empty()) {
+            index = next_reader_slot++;
+        } else {
+            index = free_reader_slots.back();
+            free_reader_slots.pop_back();
+        }
+        pthread_mutex_unlock(&reader_slot_lock);
+    }
+    ~ReaderSlot() {
+        pthread_mutex_lock(&reader_slot_lock);
+        free_reader_slots.push_back(index);
+        pthread_mutex_unlock(&reader_slot_lock);
+    }
+};
+
+thread_local ReaderSlot reader_slot;
+
+}
+
+ValueCache::ValueCache(uint64_t capacity):
+    partitions(new Partition[VALUE_CACHE_PARTITIONS]),
+    reader_memory(new char[READER_SLOTS * sizeof(Reader) + 64]),
+    partition_capacity(capacity / VALUE_CACHE_PARTITIONS) {
+    // about one counter per 64 bytes of the budget, so there are a few
+    // counters for every entry the partition can hold
+    sketch_size = SKETCH_BLOCK_SIZE;
+    while (sketch_size < partition_capacity / 64) {
+        sketch_size *= 2;
+    }
+    // a power of 2 around ten accesses per counter
+    sketch_period = sketch_size * 8;
+    for (uint32_t i = 0; i < VALUE_CACHE_PARTITIONS; ++i) {
+        auto &partition = partitions[i];
+        pthread_mutex_init(&partition.lock, nullptr);
+        partition.version.store(0);
+        partition.table.store(newTable(INITIAL_SLOTS));
+        partition.hand.store(0);
+        partition.used.store(0);
+        partition.sketch.reset(new std::atomic<uint8_t>[sketch_size]);
+        for (uint64_t j = 0; j < sketch_size; ++j) {
+            partition.sketch[j].store(0, std::memory_order_relaxed);
+        }
+    }
+    readers = reinterpret_cast<Reader*>((reinterpret_cast<uintptr_t>(reader_memory.get()) + 63) & ~(uintptr_t) 63);
+    for (int i = 0; i < READER_SLOTS; ++i) {
+        auto reader = new (&readers[i]) Reader();
+        reader->epoch.store(0);
+        reader->hits.store(0);
+        reader->misses.store(0);
+        reader->rejections.store(0);
+        for (uint32_t j = 0; j < VALUE_CACHE_PARTITIONS; ++j) {
+            reader->accesses[j].store(0);
+        }
+    }
+    // 0 marks a reader outside the cache
+    epoch.store(1);
+}
+
+// no reader is left, everything is freed right away
+ValueCache::~ValueCache() {
+    for (uint32_t i = 0; i < VALUE_CACHE_PARTITIONS; ++i) {
+        auto &partition = partitions[i];
+        auto table = partition.table.load();
+        for (size_t slot = 0; slot < table->size; ++slot) {
+            auto entry = table->slots()[slot].entry.load();
+            if (entry != nullptr) {
+                operator delete(entry);
+            }
+        }
+        operator delete(table);
+        for (auto &retired : partition.retired) {
+            operator delete(retired.memory);
+        }
+        pthread_mutex_destroy(&partition.lock);
+    }
+}
+
+bool ValueCache::lookup(const PolarString &key, uint64_t hash, std::string *value) {
+    auto &partition = partitionOf(hash);
+    auto &counters = own();
+    record(partition, hash, counters);
+    bool found = false;
+    auto reader = enter();
+    bool done = reader != nullptr && optimisticFind(partition, key, hash, found, value);
+    leave(reader);
+    if (!done) {
+        // too much write contention, or no reader slot left
+        pthread_mutex_lock(&partition.lock);
+        Entry *entry;
+        found = find(partition.table.load(std::memory_order_relaxed), key, hash, &entry) >= 0;
+        if (found) {
+            copyEntry(entry, value);
+        }
+        pthread_mutex_unlock(&partition.lock);
+    }
+    (found ? counters.hits : counters.misses).fetch_add(1, std::memory_order_relaxed);
+    return found;
+}
+
+// Admission is decided before taking the lock, against the entry the clock
+// would evict first; under the lock, the clock only makes room.
+void ValueCache::insert(const PolarString &key, uint64_t hash, const PolarString &value,
+                        const std::function<bool()> &valid) {
+    auto size = sizeof(Entry) + key.size() + value.size();
+    if (size + ENTRY_OVERHEAD > partition_capacity / 8) {
+        // a few large values would push out many small ones
+        return;
+    }
+    auto &partition = partitionOf(hash);
+    if (partition.used.load(std::memory_order_relaxed) + size + ENTRY_OVERHEAD > partition_capacity) {
+        uint64_t victim;
+        auto reader = enter();
+        if (reader == nullptr) {
+            pthread_mutex_lock(&partition.lock);
+        }
+        bool rejected = peekVictim(partition, victim) && frequency(partition, victim) >= frequency(partition, hash);
+        if (reader == nullptr) {
+            pthread_mutex_unlock(&partition.lock);
+        }
+        leave(reader);
+        if (rejected) {
+            own().rejections.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&partition.lock);
+    // the version is odd before valid() is checked, see erase
+    partition.version.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!valid()) {
+        partition.version.fetch_add(1, std::memory_order_release);
+        pthread_mutex_unlock(&partition.lock);
+        return;
+    }
+    auto table = partition.table.load(std::memory_order_relaxed);
+    auto existing = find(table, key, hash);
+    if (existing >= 0) {
+        // cached by another reader meanwhile
+        evict(partition, (size_t) existing);
+    }
+    // the clock hand passes referenced entries once, clearing their bit
+    while (partition.used.load(std::memory_order_relaxed) + size + ENTRY_OVERHEAD > partition_capacity) {
+        auto hand = partition.hand.load(std::memory_order_relaxed);
+        auto victim = table->slots()[hand].entry.load(std::memory_order_relaxed);
+        if (victim != nullptr && !victim->referenced.exchange(false, std::memory_order_relaxed)) {
+            // another entry may be shifted into the slot, the hand stays
+            evict(partition, hand);
+            ++partition.evictions;
+            continue;
+        }
+        partition.hand.store((hand + 1) & (table->size - 1), std::memory_order_relaxed);
+    }
+
+    auto entry = new (operator new(size)) Entry();
+    entry->hash = hash;
+    entry->key_length = (uint32_t) key.size();
+    entry->value_length = (uint32_t) value.size();
+    entry->referenced.store(false, std::memory_order_relaxed);
+    memcpy(const_cast<char*>(entry->key()), key.data(), key.size());
+    memcpy(const_cast<char*>(entry->value()), value.data(), value.size());
+    if ((partition.count + 1) * 2 > table->size) {
+        grow(partition);
+    }
+    place(partition.table.load(std::memory_order_relaxed), entry);
+    partition.used.store(partition.used.load(std::memory_order_relaxed) + charge(*entry), std::memory_order_relaxed);
+    ++partition.count;
+    ++partition.admissions;
+    partition.version.fetch_add(1, std::memory_order_release);
+    pthread_mutex_unlock(&partition.lock);
+}
+
+// Most updated keys are not cached, which is found out without the lock. A
+// reader can not cache the key again in between: it would have to see the
+// index before the update, and then its insert is not valid any more. An
+// insert makes the version odd before checking, so either this waits for
+// the insert to finish, or the insert sees the update.
+void ValueCache::erase(const PolarString &key, uint64_t hash) {
+    auto &partition = partitionOf(hash);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool cached = true;
+    auto reader = enter();
+    if (reader != nullptr && !optimisticFind(partition, key, hash, cached, nullptr)) {
+        cached = true;
+    }
+    leave(reader);
+    if (!cached) {
+        return;
+    }
+    pthread_mutex_lock(&partition.lock);
+    partition.version.fetch_add(1, std::memory_order_acq_rel);
+    auto slot = find(partition.table.load(std::memory_order_relaxed), key, hash);
+    if (slot >= 0) {
+        evict(partition, (size_t) slot);
+    }
+    partition.version.fetch_add(1, std::memory_order_release);
+    pthread_mutex_unlock(&partition.lock);
+}
+
+void ValueCache::clear() {
+    for (uint32_t i = 0; i < VALUE_CACHE_PARTITIONS; ++i) {
+        auto &partition = partitions[i];
+        pthread_mutex_lock(&partition.lock);
+        partition.version.fetch_add(1, std::memory_order_acq_rel);
+        auto table = partition.table.load(std::memory_order_relaxed);
+        for (size_t slot = 0; slot < table->size; ++slot) {
+            auto entry = table->slots()[slot].entry.load(std::memory_order_relaxed);
+            if (entry != nullptr) {
+                table->slots()[slot].hash.store(0, std::memory_order_relaxed);
+                table->slots()[slot].entry.store(nullptr, std::memory_order_release);
+                retire(partition, entry);
+            }
+        }
+        partition.count = 0;
+        partition.hand.store(0, std::memory_order_relaxed);
+        partition.used.store(0, std::memory_order_relaxed);
+        partition.version.fetch_add(1, std::memory_order_release);
+        pthread_mutex_unlock(&partition.lock);
+    }
+}
+
+void ValueCache::stats(polar_race::CacheStats *stats) {
+    *stats = polar_race::CacheStats();
+    for (int i = 0; i < READER_SLOTS; ++i) {
+        stats->hits += readers[i].hits.load(std::memory_order_relaxed);
+        stats->misses += readers[i].misses.load(std::memory_order_relaxed);
+        stats->rejections += readers[i].rejections.load(std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < VALUE_CACHE_PARTITIONS; ++i) {
+        auto &partition = partitions[i];
+        pthread_mutex_lock(&partition.lock);
+        stats->admissions += partition.admissions;
+        stats->evictions += partition.evictions;
+        stats->entries += partition.count;
+        stats->bytes += partition.used.load(std::memory_order_relaxed);
+        pthread_mutex_unlock(&partition.lock);
+    }
+}
+
+ValueCache::Reader &ValueCache::own() {
+    return readers[reader_slot.index % READER_SLOTS];
+}
+
+// The epoch is announced before anything of the table is read, see reclaim.
+ValueCache::Reader *ValueCache::enter() {
+    auto index = reader_slot.index;
+    if (__glibc_unlikely(index >= READER_SLOTS)) {
+        return nullptr;
+    }
+    auto reader = &readers[index];
+    reader->epoch.store(epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return reader;
+}
+
+void ValueCache::leave(Reader *reader) {
+    if (reader != nullptr) {
+        reader->epoch.store(0, std::memory_order_release);
+    }
+}
+
+// The table is searched and the value copied without the lock, and the
+// result is kept only if no writer changed the table meanwhile. Entries
+// found are not freed before the reader leaves, even if they are evicted.
+bool ValueCache::optimisticFind(Partition &partition, const PolarString &key, uint64_t hash,
+                                bool &found, std::string *value) {
+    for (int i = 0; i < OPTIMISTIC_LOOKUP_RETRIES; ++i) {
+        auto version = partition.version.load(std::memory_order_acquire);
+        if (version % 2 != 0) {
+            continue;
+        }
+        Entry *entry;
+        found = find(partition.table.load(std::memory_order_acquire), key, hash, &entry) >= 0;
+        if (found && value != nullptr) {
+            copyEntry(entry, value);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (partition.version.load(std::memory_order_relaxed) == version) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a hit sets the reference bit only if it is clear, so hot entries are not written
+void ValueCache::copyEntry(Entry *entry, std::string *value) {
+    if (!entry->referenced.load(std::memory_order_relaxed)) {
+        entry->referenced.store(true, std::memory_order_relaxed);
+    }
+    value->assign(entry->value(), entry->value_length);
+}
+
+// Probes at most the whole table, which a reader racing with writers might
+// otherwise never leave.
+int64_t ValueCache::find(Table *table, const PolarString &key, uint64_t hash, Entry **entry) {
+    auto mask = table->size - 1;
+    auto slots = table->slots();
+    auto i = home(table, hash);
+    for (size_t probes = 0; probes < table->size; ++probes, i = (i + 1) & mask) {
+        auto current = slots[i].entry.load(std::memory_order_acquire);
+        if (current == nullptr) {
+            break;
+        }
+        if (current->hash == hash && PolarString(current->key(), current->key_length) == key) {
+            if (entry != nullptr) {
+                *entry = current;
+            }
+            return (int64_t) i;
+        }
+    }
+    return -1;
+}
+
+// The first entry from the hand on whose reference bit is clear, or the
+// first entry at all, read without the lock: admission only needs a guess.
+bool ValueCache::peekVictim(Partition &partition, uint64_t &hash) {
+    auto table = partition.table.load(std::memory_order_acquire);
+    auto mask = table->size - 1;
+    auto hand = partition.hand.load(std::memory_order_relaxed);
+    bool any = false;
+    for (size_t i = 0; i < VICTIM_SEARCH_SLOTS && i < table->size; ++i) {
+        auto entry = table->slots()[(hand + i) & mask].entry.load(std::memory_order_acquire);
+        if (entry == nullptr) {
+            continue;
+        }
+        if (!entry->referenced.load(std::memory_order_relaxed)) {
+            hash = entry->hash;
+            return true;
+        }
+        if (!any) {
+            hash = entry->hash;
+            any = true;
+        }
+    }
+    return any;
+}
+
+ValueCache::Table *ValueCache::newTable(size_t size) {
+    auto table = static_cast<Table*>(operator new(sizeof(Table) + size * sizeof(Slot)));
+    table->size = size;
+    auto slots = table->slots();
+    for (size_t i = 0; i < size; ++i) {
+        new (&slots[i]) Slot();
+        slots[i].hash.store(0, std::memory_order_relaxed);
+        slots[i].entry.store(nullptr, std::memory_order_relaxed);
+    }
+    return table;
+}
+
+// the hash is stored before the entry, which readers load first
+void ValueCache::place(Table *table, Entry *entry) {
+    auto mask = table->size - 1;
+    auto slots = table->slots();
+    auto i = home(table, entry->hash);
+    while (slots[i].entry.load(std::memory_order_relaxed) != nullptr) {
+        i = (i + 1) & mask;
+    }
+    slots[i].hash.store(entry->hash, std::memory_order_relaxed);
+    slots[i].entry.store(entry, std::memory_order_release);
+}
+
+// Unlinks an entry with the lock held and retires it. The entries behind it
+// in its run are shifted back where their probes can still find them, so no
+// tombstones are needed.
+void ValueCache::evict(Partition &partition, size_t slot) {
+    auto table = partition.table.load(std::memory_order_relaxed);
+    auto slots = table->slots();
+    auto entry = slots[slot].entry.load(std::memory_order_relaxed);
+    partition.used.store(partition.used.load(std::memory_order_relaxed) - charge(*entry), std::memory_order_relaxed);
+    --partition.count;
+    auto mask = table->size - 1;
+    auto hole = slot;
+    for (auto i = (slot + 1) & mask; slots[i].entry.load(std::memory_order_relaxed) != nullptr; i = (i + 1) & mask) {
+        // an entry may fill the hole if the hole lies on its probe path
+        auto moved_hash = slots[i].hash.load(std::memory_order_relaxed);
+        auto from_home = (i - home(table, moved_hash)) & mask;
+        if (from_home >= ((i - hole) & mask)) {
+            slots[hole].hash.store(moved_hash, std::memory_order_relaxed);
+            slots[hole].entry.store(slots[i].entry.load(std::memory_order_relaxed), std::memory_order_release);
+            hole = i;
+        }
+    }
+    slots[hole].hash.store(0, std::memory_order_relaxed);
+    slots[hole].entry.store(nullptr, std::memory_order_release);
+    retire(partition, entry);
+}
+
+void ValueCache::grow(Partition &partition) {
+    auto old = partition.table.load(std::memory_order_relaxed);
+    auto table = newTable(old->size * 2);
+    for (size_t i = 0; i < old->size; ++i) {
+        auto entry = old->slots()[i].entry.load(std::memory_order_relaxed);
+        if (entry != nullptr) {
+            place(table, entry);
+        }
+    }
+    partition.table.store(table, std::memory_order_release);
+    partition.hand.store(0, std::memory_order_relaxed);
+    retire(partition, old);
+}
+
+// Memory unlinked with the lock held is tagged with the current epoch. A
+// reader entering after the epoch has moved past it can not find the memory
+// any more, see reclaim.
+void ValueCache::retire(Partition &partition, void *memory) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    partition.retired.push_back({memory, epoch.load(std::memory_order_relaxed)});
+    if (partition.retired.size() >= RECLAIM_BATCH) {
+        reclaim(partition);
+    }
+}
+
+// Moves the epoch on, and frees the memory retired before the epoch every
+// reader still inside entered in.
+void ValueCache::reclaim(Partition &partition) {
+    epoch.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto oldest = UINT64_MAX;
+    for (int i = 0; i < READER_SLOTS; ++i) {
+        auto entered = readers[i].epoch.load(std::memory_order_relaxed);
+        if (entered != 0 && entered < oldest) {
+            oldest = entered;
+        }
+    }
+    size_t kept = 0;
+    for (auto &retired : partition.retired) {
+        if (retired.epoch < oldest) {
+            operator delete(retired.memory);
+        } else {
+            partition.retired[kept++] = retired;
+        }
+    }
+    partition.retired.resize(kept);
+}
+
+// All counters of a key are in the same block of the sketch, picked by the
+// low bits of the mixed hash, and the high bits pick SKETCH_COUNTERS of them
+// within the block. Counting an access thus touches a single cache line.
+void ValueCache::counters(uint64_t hash, uint32_t *offsets) const {
+    auto mixed = hash_mix(hash, SKETCH_SEED);
+    auto block = (mixed & (sketch_size / SKETCH_BLOCK_SIZE - 1)) * SKETCH_BLOCK_SIZE;
+    for (int i = 0; i < SKETCH_COUNTERS; ++i) {
+        offsets[i] = (uint32_t) (block + ((mixed >> (64 - 6 * (i + 1))) & (SKETCH_BLOCK_SIZE - 1)));
+    }
+}
+
+// Counters are bumped without a lock. Concurrent increments may get lost,
+// which only makes the estimate a little low. Every thread ages the sketch
+// after sketch_period accesses of its own, which ages it about every
+// sketch_period accesses in total.
+void ValueCache::record(Partition &partition, uint64_t hash, Reader &reader) {
+    uint32_t offsets[SKETCH_COUNTERS];
+    counters(hash, offsets);
+    for (auto offset : offsets) {
+        auto &counter = partition.sketch[offset];
+        auto count = counter.load(std::memory_order_relaxed);
+        if (count < UINT8_MAX) {
+            counter.store(count + 1, std::memory_order_relaxed);
+        }
+    }
+    auto &accesses = reader.accesses[&partition - partitions.get()];
+    if (((accesses.fetch_add(1, std::memory_order_relaxed) + 1) & (sketch_period - 1)) == 0) {
+        age(partition);
+    }
+}
+
+// the smallest counter of the key is the closest to its access count
+uint32_t ValueCache::frequency(Partition &partition, uint64_t hash) const {
+    uint32_t offsets[SKETCH_COUNTERS];
+    counters(hash, offsets);
+    uint32_t result = UINT8_MAX;
+    for (auto offset : offsets) {
+        uint32_t count = partition.sketch[offset].load(std::memory_order_relaxed);
+        result = count < result ? count : result;
+    }
+    return result;
+}
+
+void ValueCache::age(Partition &partition) {
+    for (uint64_t i = 0; i < sketch_size; ++i) {
+        partition.sketch[i].store(partition.sketch[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    }
+}
+
+uint64_t ValueCache::charge(const Entry &entry) {
+    return sizeof(Entry) + entry.key_length + entry.value_length + ENTRY_OVERHEAD;
+}
@@ -0,0 +1,152 @@
+//
+// Created by Harry Chen on 2019/5/12.
+//
+
+#ifndef TRIVIALKV_VALUE_CACHE_H
+#define TRIVIALKV_VALUE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <pthread.h>
+
+#include "include/engine.h"
+
+using polar_race::PolarString;
+
+// Copies of hot values in memory, in front of the slices of all shards, so
+// that reading them needs neither an index search nor a shard. The cache is
+// split into partitions by the hash of the key, each with its own lock and
+// an equal part of the memory budget. A partition evicts by CLOCK, and admits
+// a value only if a frequency sketch (TinyLFU) has seen its key more often
+// than the key it would evict, so a scan of cold keys never flushes the hot
+// ones. Hits take no lock: the table of a partition is searched under a
+// seqlock, and evicted entries are only freed once no reader can still copy
+// from them (epoch based reclamation).
+class ValueCache {
+public:
+    explicit ValueCache(uint64_t capacity);
+    ~ValueCache();
+    // copies the cached value of key, returns false if it is not cached
+    bool lookup(const PolarString &key, uint64_t hash, std::string *value);
+    // Offers a value just read from a shard. It is cached only if valid()
+    // returns true under the lock of the partition: an update erases its key
+    // after changing the index, so the value can not become stale unnoticed.
+    void insert(const PolarString &key, uint64_t hash, const PolarString &value,
+                const std::function<bool()> &valid);
+    void erase(const PolarString &key, uint64_t hash);
+    void clear();
+    void stats(polar_race::CacheStats *stats);
+
+private:
+    static const uint32_t VALUE_CACHE_PARTITIONS = 64;
+    static const int SKETCH_COUNTERS = 4;
+    static const uint64_t SKETCH_BLOCK_SIZE = 64;
+    static const int READER_SLOTS = 256;
+    // a lookup falls back to the lock after this many changes of the table
+    static const int OPTIMISTIC_LOOKUP_RETRIES = 4;
+    // retired memory of a partition that is freed at once
+    static const size_t RECLAIM_BATCH = 64;
+    // slots from the hand on that admission looks at for a victim
+    static const size_t VICTIM_SEARCH_SLOTS = 64;
+
+    // the key and the value follow the entry in the same allocation
+    struct Entry {
+        uint64_t hash;
+        uint32_t key_length;
+        uint32_t value_length;
+        std::atomic<bool> referenced;
+        const char *key() const { return reinterpret_cast<const char*>(this + 1); }
+        const char *value() const { return key() + key_length; }
+    };
+    struct Slot {
+        std::atomic<uint64_t> hash;
+        std::atomic<Entry*> entry;
+    };
+    // open addressing with linear probing, and the ring of the clock at the
+    // same time; a power of 2 at most half full, the slots follow the table
+    struct Table {
+        size_t size;
+        Slot *slots() { return reinterpret_cast<Slot*>(this + 1); }
+    };
+    // memory unlinked while readers may still use it, and the epoch it was unlinked in
+    struct Retired {
+        void *memory;
+        uint64_t epoch;
+    };
+    struct Partition {
+        // serializes writers, readers only check the version
+        pthread_mutex_t lock;
+        // seqlock over the table, odd while a writer is modifying it
+        std::atomic<uint64_t> version;
+        std::atomic<Table*> table;
+        size_t count = 0;
+        std::atomic<size_t> hand;
+        std::atomic<uint64_t> used;
+        std::vector<Retired> retired;
+        // count-min sketch of saturating counters, halved every sketch_period
+        // accesses so that old popularity fades
+        std::unique_ptr<std::atomic<uint8_t>[]> sketch;
+        uint64_t admissions = 0;
+        uint64_t evictions = 0;
+    };
+    // The epoch a reading thread entered the cache in (0 while it is not
+    // reading it), and its counters, on cache lines of their own. Threads
+    // beyond READER_SLOTS share the counters and read under the lock.
+    struct alignas(64) Reader {
+        std::atomic<uint64_t> epoch;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> rejections;
+        // accesses of every partition, counting up to its next aging
+        std::atomic<uint32_t> accesses[VALUE_CACHE_PARTITIONS];
+    };
+
+    Partition &partitionOf(uint64_t hash) { return partitions[hash % VALUE_CACHE_PARTITIONS]; }
+    void counters(uint64_t hash, uint32_t *offsets) const;
+    void record(Partition &partition, uint64_t hash, Reader &reader);
+    uint32_t frequency(Partition &partition, uint64_t hash) const;
+    void age(Partition &partition);
+    // the counters of this thread
+    Reader &own();
+    // enters or leaves a read of the cache by this thread, nullptr if it has no slot
+    Reader *enter();
+    static void leave(Reader *reader);
+    // Sets found to whether the key is cached, and copies its value unless
+    // value is nullptr. Returns false if writers kept changing the table,
+    // then the caller looks under the lock.
+    static bool optimisticFind(Partition &partition, const PolarString &key, uint64_t hash,
+                               bool &found, std::string *value);
+    static void copyEntry(Entry *entry, std::string *value);
+    // slot of the key, or -1; entry is set to the entry matched in it, as
+    // the slot may already hold another one for a reader without the lock
+    static int64_t find(Table *table, const PolarString &key, uint64_t hash, Entry **entry = nullptr);
+    static size_t home(const Table *table, uint64_t hash) {
+        return (hash / VALUE_CACHE_PARTITIONS) & (table->size - 1);
+    }
+    // hash of the entry the clock would evict next, false if there is none
+    static bool peekVictim(Partition &partition, uint64_t &hash);
+    static Table *newTable(size_t size);
+    static void place(Table *table, Entry *entry);
+    void evict(Partition &partition, size_t slot);
+    void grow(Partition &partition);
+    void retire(Partition &partition, void *memory);
+    void reclaim(Partition &partition);
+    static uint64_t charge(const Entry &entry);
+
+    std::unique_ptr<Partition[]> partitions;
+    // READER_SLOTS readers, aligned to a cache line within reader_memory
+    std::unique_ptr<char[]> reader_memory;
+    Reader *readers;
+    // advanced whenever retired memory is reclaimed
+    std::atomic<uint64_t> epoch;
+    uint64_t partition_capacity;
+    // counters of a sketch and accesses between agings, powers of 2
+    uint64_t sketch_size;
+    uint64_t sketch_period;
+};
+
+#endif //TRIVIALKV_VALUE_CACHE_H
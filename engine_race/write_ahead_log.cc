@@ -0,0 +1,102 @@
+//
+// Created by Harry Chen on 2019/5/6.
+//
+
+#include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "write_ahead_log.h"
+#include "crc32c.h"
+#include "utils.hpp"
+
+
+WriteAheadLog::WriteAheadLog(const std::string &filename): used_size(0) {
+    struct stat st = {};
+    log_file_fd = open(filename.c_str(), O_RDWR|O_CREAT, 0644);
+    assert(log_file_fd > 0);
+    fstat(log_file_fd, &st);
+    log_file_size = (size_t) st.st_size;
+
+    if (log_file_size == 0) {
+        // no log yet, a zeroed file holds no records
+        int ret = ftruncate(log_file_fd, INIT_LOG_SIZE);
+        assert(ret == 0);
+        log_file_size = INIT_LOG_SIZE;
+    }
+    file_map = map_growable(log_file_fd, log_file_size);
+    assert(file_map != nullptr);
+    madvise(file_map, log_file_size, MADV_SEQUENTIAL);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    unmap_growable(file_map);
+    close(log_file_fd);
+}
+
+
+void WriteAheadLog::replay(const ReplayVisitor &visitor) {
+    auto base = static_cast<char*>(file_map);
+    size_t position = 0;
+    while (position + sizeof(LogRecordHeader) <= log_file_size) {
+        auto record = reinterpret_cast<LogRecordHeader*>(base + position);
+        if ((record->type != LOG_INSERT && record->type != LOG_REMOVE) || record->key_length > MAX_KEY_LENGTH ||
+            position + recordSize(record->key_length) > log_file_size || record->checksum != checksum(record)) {
+            break;
+        }
+        visitor(record->type, {reinterpret_cast<char*>(record + 1), record->key_length}, record->data);
+        position += recordSize(record->key_length);
+    }
+    used_size = position;
+    // Records behind a torn one may have been written before it, and must not
+    // show up behind the records appended from now on. Truncating the file
+    // zeroes them, also in the mapping.
+    int ret = ftruncate(log_file_fd, used_size);
+    assert(ret == 0);
+    ret = ftruncate(log_file_fd, log_file_size);
+    assert(ret == 0);
+}
+
+
+bool WriteAheadLog::append(uint8_t type, const PolarString &key, const IndexData &data) {
+    auto size = recordSize(key.size());
+    if (__glibc_unlikely(used_size + size > log_file_size)) {
+        auto new_size = grown_size(log_file_size, used_size + size);
+        if (!grow_mapping(log_file_fd, file_map, log_file_size, new_size)) {
+            return false;
+        }
+        log_file_size = new_size;
+    }
+    // the space after the last record is zeroed, which pads the key
+    auto record = reinterpret_cast<LogRecordHeader*>(static_cast<char*>(file_map) + used_size);
+    record->type = type;
+    record->reserved = 0;
+    record->key_length = (uint16_t) key.size();
+    record->data = data;
+    memcpy(record + 1, key.data(), key.size());
+    record->checksum = checksum(record);
+    used_size += size;
+    return true;
+}
+
+
+void WriteAheadLog::sync() {
+    fdatasync(log_file_fd);
+}
+
+
+void WriteAheadLog::sync(size_t size) {
+    if (size > 0) {
+        msync(file_map, (size_t) round_up(size, 4096), MS_SYNC);
+    }
+}
+
+
+uint32_t WriteAheadLog::checksum(const LogRecordHeader *record) {
+    auto start = reinterpret_cast<const char*>(record) + sizeof(record->checksum);
+    return crc32c(start, sizeof(LogRecordHeader) - sizeof(record->checksum) + record->key_length);
+}
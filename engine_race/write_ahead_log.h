@@ -0,0 +1,60 @@
+//
+// Created by Harry Chen on 2019/5/6.
+//
+
+#ifndef TRIVIALKV_WRITE_AHEAD_LOG_H
+#define TRIVIALKV_WRITE_AHEAD_LOG_H
+
+#include <string>
+#include <functional>
+#include <cstdint>
+
+#include "index.h"
+
+const uint8_t LOG_INSERT = 1;
+const uint8_t LOG_REMOVE = 2;
+
+// followed by the key, padded to 8 bytes
+struct LogRecordHeader {
+    // CRC32C of the rest of the record, so that a record torn by a crash is recognized
+    uint32_t checksum;
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t key_length;
+    IndexData data;
+};
+
+// Append-only log of the index updates of one shard since its last checkpoint,
+// saved as <shard>.<generation>.log. Records are appended through a shared
+// mapping, so they survive a crash of the process as soon as they are copied.
+class WriteAheadLog {
+public:
+    explicit WriteAheadLog(const std::string &filename);
+    ~WriteAheadLog();
+    // Visits the records in the order they were appended, up to the first
+    // incomplete one, which is cut off together with anything after it.
+    using ReplayVisitor = std::function<void(uint8_t type, const PolarString &key, const IndexData &data)>;
+    void replay(const ReplayVisitor &visitor);
+    // false if the log can not grow to hold the record, nothing is appended then
+    bool append(uint8_t type, const PolarString &key, const IndexData &data);
+    // fdatasync also writes back the pages dirtied through the mapping
+    void sync();
+    // flushes the records in the first size bytes (and any in the same pages)
+    void sync(size_t size);
+    // bytes of records in the log
+    size_t size() const { return used_size; }
+private:
+    static uint32_t checksum(const LogRecordHeader *record);
+    static size_t recordSize(size_t key_length) {
+        return (sizeof(LogRecordHeader) + key_length + 7) & ~(size_t) 7;
+    }
+
+    int log_file_fd;
+    size_t log_file_size;
+    void *file_map;
+    size_t used_size;
+};
+
+const size_t INIT_LOG_SIZE = 1024 * 1024;
+
+#endif //TRIVIALKV_WRITE_AHEAD_LOG_H
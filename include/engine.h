@@ -1,7 +1,10 @@
 // Copyright [2018] Alibaba Cloud All rights reserved
 #ifndef INCLUDE_ENGINE_H_
 #define INCLUDE_ENGINE_H_
+#include <stdint.h>
 #include <string>
+#include <utility>
+#include <vector>
 #include "polar_string.h"
 
 namespace polar_race {
@@ -19,6 +22,139 @@ enum RetCode {
   kOutOfMemory = 9,
 };
 
+// Layout of a store. The options only take effect when the store is
+// created; an existing store is always opened with the options recorded
+// in its manifest. Only the durability settings, verify_read_interval and
+// cache_size are chosen on every open.
+struct Options {
+  enum IndexType {
+    kAVLTree = 0,    // ordered, the default
+    kBPlusTree = 1,  // ordered, page-sized nodes
+    kHashTable = 2,  // point lookups only, Range is not supported
+  };
+
+  enum ShardRouting {
+    kRouteByHash = 0,    // spread keys evenly, whatever their prefixes
+    kRouteByPrefix = 1,  // every shard holds a contiguous range of first bytes
+  };
+
+  enum Durability {
+    kDurabilityNone = 0,      // leave writing back to the kernel
+    kDurabilityPeriodic = 1,  // flush every sync_interval_ms
+    kDurabilitySync = 2,      // updates return once they are flushed
+  };
+
+  // number of independently locked partitions
+  uint32_t shard_count = 128;
+  // size of each data file of a shard
+  uint32_t slice_size = 32 * 1024 * 1024;
+  // most data files a single shard may create
+  uint32_t max_slice_count = 4096;
+  // size the index files of a shard start with, they grow on demand
+  uint32_t initial_index_size = 16 * 1024 * 1024;
+  IndexType index_type = kAVLTree;
+  ShardRouting shard_routing = kRouteByHash;
+  // concurrent updates waiting for kDurabilitySync share a single flush
+  Durability durability = kDurabilityNone;
+  uint32_t sync_interval_ms = 100;
+  // every thread verifies the checksum of one in this many values it reads,
+  // 1 verifies all of them and 0 leaves checking to Scrub; chosen on every open
+  uint32_t verify_read_interval = 16;
+  // memory for copies of frequently read values, 0 disables the cache;
+  // chosen on every open
+  uint64_t cache_size = 0;
+};
+
+// Counters of the value cache since the engine was opened
+struct CacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  // values cached, and values turned away as read less often than the ones
+  // they would have replaced
+  uint64_t admissions = 0;
+  uint64_t rejections = 0;
+  uint64_t evictions = 0;
+  // values cached now, and the memory charged for them
+  uint64_t entries = 0;
+  uint64_t bytes = 0;
+};
+
+// A value that does not match its checksum, with the data file (slice) of
+// its shard it is stored in and its position there
+struct CorruptedValue {
+  std::string key;
+  uint32_t shard = 0;
+  int32_t slice = 0;
+  uint32_t offset = 0;
+  uint64_t length = 0;
+};
+
+// Outcome of a pass of Engine::Scrub
+struct ScrubReport {
+  // bytes of the records verified
+  uint64_t verified_bytes = 0;
+  std::vector<CorruptedValue> corrupted;
+};
+
+// A value handed out by Engine::ReadPinned without copying. value() points
+// into the store and stays valid until the view is reset or destroyed, and
+// the engine keeps the bytes in place for that long. Reset every view before
+// closing the engine.
+class ReadView {
+ public:
+  typedef void (*Release)(void* pin);
+
+  ReadView() : release_(NULL), pin_(NULL) { }
+
+  ~ReadView() { Reset(); }
+
+  ReadView(const ReadView&) = delete;
+  ReadView& operator=(const ReadView&) = delete;
+
+  const PolarString& value() const { return value_; }
+
+  void Reset() {
+    if (release_ != NULL) {
+      release_(pin_);
+    }
+    release_ = NULL;
+    pin_ = NULL;
+    value_.clear();
+    buffer_.clear();
+  }
+
+  // For engines: point at bytes kept alive until release(pin) is called.
+  void Pin(const PolarString& value, Release release, void* pin) {
+    Reset();
+    value_ = value;
+    release_ = release;
+    pin_ = pin;
+  }
+
+  // For engines that can not pin: hold a private copy instead.
+  void Assign(std::string&& value) {
+    Reset();
+    buffer_ = std::move(value);
+    value_ = buffer_;
+  }
+
+ private:
+  PolarString value_;
+  Release release_;
+  void* pin_;
+  std::string buffer_;
+};
+
+// Pass to Engine::BulkLoad to hand over the pairs one at a time
+class BulkSource {
+ public:
+  virtual ~BulkSource() {}
+
+  // Set the next pair, which must stay valid until the following call,
+  // or return false at the end
+  virtual bool Next(PolarString* key, PolarString* value) = 0;
+};
+
 // Pass to Engine::Range for callback
 class Visitor {
  public:
@@ -33,6 +169,18 @@ class Engine {
   static RetCode Open(const std::string& name,
       Engine** eptr);
 
+  // Open engine, creating it with the given options if it does not exist
+  static RetCode Open(const std::string& name,
+      const Options& options,
+      Engine** eptr);
+
+  // Rebuild the index of every shard of a store that is not open from its
+  // data files, after its index files were lost or damaged. Values are
+  // found again with their latest update, and deleted keys stay deleted.
+  // Shards are rebuilt in parallel, each needing about 100 bytes of memory
+  // per key it holds.
+  static RetCode RebuildIndex(const std::string& name);
+
   Engine() { }
 
   // Close engine
@@ -42,10 +190,58 @@ class Engine {
   virtual RetCode Write(const PolarString& key,
       const PolarString& value) = 0;
 
-  // Read value of a key
+  // Read value of a key, kCorruption if it does not match its checksum
   virtual RetCode Read(const PolarString& key,
       std::string* value) = 0;
 
+  // Delete a key, kNotFound if it does not exist. Its space is reclaimed
+  // later, like that of an overwritten value
+  virtual RetCode Delete(const PolarString& key) = 0;
+
+  // Read value of a key without copying it, see ReadView
+  virtual RetCode ReadPinned(const PolarString& key,
+      ReadView* view) = 0;
+
+  // Read the values of several keys at once. statuses[i] is kSucc,
+  // kNotFound or kCorruption for keys[i], and values[i] holds its value
+  // on success.
+  virtual RetCode MultiGet(const std::vector<PolarString>& keys,
+      std::vector<std::string>* values,
+      std::vector<RetCode>* statuses) = 0;
+
+  // Reclaim the space of overwritten values right away, instead of waiting
+  // for the engine to do so in the background. kFull if a shard has no room
+  // left to move its live values into
+  virtual RetCode Compact() = 0;
+
+  // Verify the checksums of all values, kCorruption if any does not match.
+  // The engine also does so slowly in the background, see LastScrub
+  virtual RetCode Scrub() = 0;
+
+  // Scrub, and describe what was verified and found corrupted in report
+  virtual RetCode Scrub(ScrubReport* report) = 0;
+
+  // What the last scrub in the background found, kNotFound if none has
+  // completed since the engine was opened
+  virtual RetCode LastScrub(ScrubReport* report) = 0;
+
+  // Write values[i] for every keys[i], a later pair wins over an earlier
+  // one with the same key. On failure, part of the batch may already be
+  // written, and that part is flushed as for a successful batch.
+  virtual RetCode WriteBatch(const std::vector<PolarString>& keys,
+      const std::vector<PolarString>& values) = 0;
+
+  // Write all pairs of source, e.g. to populate a new store. Values are
+  // appended to the data files as they come, and the index of an empty
+  // shard is built from all of its keys at once, in a single pass if they
+  // come in ascending order. A later pair wins over an earlier one with the
+  // same key. Other operations wait until the load is complete, which
+  // leaves it durable.
+  virtual RetCode BulkLoad(BulkSource& source) = 0;
+
+  // Counters of the value cache, kNotSupported if it is disabled
+  virtual RetCode GetCacheStats(CacheStats* stats) = 0;
+
 
   /*
    * NOTICE: Implement 'Range' in quarter-final,
@@ -58,6 +254,9 @@ class Engine {
   // upper=="" is treated as a key after all keys in the database.
   // Therefore the following call will traverse the entire database:
   //   Range("", "", visitor)
+  // Stops with kIOError if the value of a large key can not be mapped.
+  // Keys are visited once each and in order, updates made meanwhile (also
+  // by the visitor) may or may not be seen.
   virtual RetCode Range(const PolarString& lower,
       const PolarString& upper,
       Visitor &visitor) = 0;
@@ -0,0 +1,127 @@
+#include <assert.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define BATCH_CNT 100
+#define BATCH_SIZE 1000
+
+char k[1024];
+char v[9024];
+std::map<std::string, std::string> kvs;
+
+void check_all(Engine *engine) {
+    std::string value;
+    for (auto &kv : kvs) {
+        RetCode ret = engine->Read(kv.first, &value);
+        assert(ret == kSucc);
+        assert(value == kv.second);
+    }
+}
+
+void check_multi_get(Engine *engine) {
+    std::vector<std::string> key_data;
+    for (auto &kv : kvs) {
+        key_data.push_back(kv.first);
+        if (key_data.size() % 7 == 0) {
+            // a key that was never written
+            gen_random(k, 17);
+            key_data.push_back(k);
+        }
+    }
+    std::vector<PolarString> keys(key_data.begin(), key_data.end());
+    std::vector<std::string> values;
+    std::vector<RetCode> statuses;
+    RetCode ret = engine->MultiGet(keys, &values, &statuses);
+    assert(ret == kSucc);
+    assert(values.size() == keys.size() && statuses.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto it = kvs.find(key_data[i]);
+        if (it == kvs.end()) {
+            assert(statuses[i] == kNotFound);
+        } else {
+            assert(statuses[i] == kSucc);
+            assert(values[i] == it->second);
+        }
+    }
+}
+
+int main() {
+
+    Engine *engine = NULL;
+    printf_(
+        "======================= batch test "
+        "============================");
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    RetCode ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    // key and value counts must match
+    std::vector<PolarString> keys(1, "key"), values;
+    ret = engine->WriteBatch(keys, values);
+    assert(ret == kInvalidArgument);
+
+    // empty batch
+    keys.clear();
+    ret = engine->WriteBatch(keys, values);
+    assert(ret == kSucc);
+
+    // nothing written yet
+    keys.assign(1, "key");
+    std::vector<std::string> read_values;
+    std::vector<RetCode> statuses;
+    ret = engine->MultiGet(keys, &read_values, &statuses);
+    assert(ret == kSucc);
+    assert(statuses.size() == 1 && statuses[0] == kNotFound);
+
+    for (int i = 0; i < BATCH_CNT; ++i) {
+        // the polar strings of a batch point into these
+        std::vector<std::string> key_data, value_data;
+        for (int j = 0; j < BATCH_SIZE; ++j) {
+            if (!kvs.empty() && j % 10 == 0) {
+                // overwrite a key of an earlier batch
+                key_data.push_back(kvs.begin()->first);
+            } else if (j % 10 == 5) {
+                // repeat a key of this batch, the later value wins
+                key_data.push_back(key_data[j - 1]);
+            } else {
+                gen_random(k, 16);
+                key_data.push_back(k);
+            }
+            gen_random(v, j % 500);
+            value_data.push_back(v);
+        }
+        keys.assign(key_data.begin(), key_data.end());
+        values.assign(value_data.begin(), value_data.end());
+        ret = engine->WriteBatch(keys, values);
+        assert(ret == kSucc);
+        for (int j = 0; j < BATCH_SIZE; ++j) {
+            kvs[key_data[j]] = value_data[j];
+        }
+    }
+
+    check_all(engine);
+    check_multi_get(engine);
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    check_multi_get(engine);
+    delete engine;
+
+    printf_(
+        "======================= batch test pass :) "
+        "======================");
+
+    return 0;
+}
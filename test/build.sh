@@ -1,6 +1,6 @@
 #!/bin/bash
 
-test=('single_thread_test.cc' 'multi_thread_test.cc' 'crash_test.cc')
+test=('single_thread_test.cc' 'multi_thread_test.cc' 'crash_test.cc' 'range_test.cc' 'batch_test.cc' 'compaction_test.cc' 'delete_test.cc' 'durability_test.cc' 'checksum_test.cc' 'rebuild_test.cc' 'bulk_load_test.cc' 'cache_test.cc')
 
 rm -rf ./data/test-*
 for f in ${test[@]}; do
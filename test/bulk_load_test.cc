@@ -0,0 +1,212 @@
+#include <assert.h>
+#include <stdio.h>
+#include <glob.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 20000
+
+// hands out the pairs of two vectors
+class VectorSource : public BulkSource {
+public:
+    VectorSource(const std::vector<std::string> &keys, const std::vector<std::string> &values):
+        keys(keys), values(values) {}
+    bool Next(PolarString *key, PolarString *value) override {
+        if (next == keys.size()) {
+            return false;
+        }
+        *key = keys[next];
+        *value = values[next];
+        ++next;
+        return true;
+    }
+private:
+    const std::vector<std::string> &keys;
+    const std::vector<std::string> &values;
+    size_t next = 0;
+};
+
+class CheckVisitor : public Visitor {
+public:
+    explicit CheckVisitor(const std::map<std::string, std::string> &expected): it(expected.begin()) {}
+    int count = 0;
+    void Visit(const PolarString &key, const PolarString &value) override {
+        assert(key.ToString() == it->first);
+        assert(value.ToString() == it->second);
+        ++it;
+        ++count;
+    }
+private:
+    std::map<std::string, std::string>::const_iterator it;
+};
+
+void check_all(Engine *engine, const std::map<std::string, std::string> &expected, Options::IndexType index_type) {
+    std::string value;
+    for (auto &pair : expected) {
+        RetCode ret = engine->Read(pair.first, &value);
+        assert(ret == kSucc);
+        assert(value == pair.second);
+    }
+    if (index_type != Options::kHashTable) {
+        CheckVisitor visitor(expected);
+        RetCode ret = engine->Range("", "", visitor);
+        assert(ret == kSucc);
+        assert(visitor.count == (int) expected.size());
+    }
+}
+
+void test_index(Options::IndexType index_type, const char *name) {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.index_type = index_type;
+    options.shard_count = 4;
+    options.slice_size = 1024 * 1024;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("%s index, open engine_path: %s\n", name, engine_path.c_str());
+
+    // keys in ascending order, long enough for the key arena every other time
+    std::map<std::string, std::string> expected;
+    std::vector<std::string> keys, values;
+    for (int i = 0; i < KEY_CNT; ++i) {
+        char k[64], v[256];
+        snprintf(k, sizeof(k), i % 2 == 0 ? "%08d" : "%08d-with-a-longer-suffix", i);
+        gen_random(v, 100 + i % 100);
+        keys.push_back(k);
+        values.push_back(v);
+        expected[k] = v;
+    }
+    VectorSource sorted(keys, values);
+    ret = engine->BulkLoad(sorted);
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+
+    // the loaded store takes updates as usual
+    for (int i = 0; i < KEY_CNT; i += 7) {
+        ret = engine->Delete(keys[i]);
+        assert(ret == kSucc);
+        expected.erase(keys[i]);
+    }
+    for (int i = 3; i < KEY_CNT; i += 7) {
+        ret = engine->Write(keys[i], "overwritten");
+        assert(ret == kSucc);
+        expected[keys[i]] = "overwritten";
+    }
+    check_all(engine, expected, index_type);
+    delete engine;
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+
+    // loading into shards that are not empty any more
+    keys.resize(KEY_CNT / 10);
+    values.resize(KEY_CNT / 10);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        values[i] = "reloaded";
+        expected[keys[i]] = values[i];
+    }
+    VectorSource reload(keys, values);
+    ret = engine->BulkLoad(reload);
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+    delete engine;
+
+    // random keys with duplicates into a new store, the last pair of a key wins
+    engine_path = std::string("./data/test-") + std::to_string(asm_rdtsc());
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    expected.clear();
+    keys.clear();
+    values.clear();
+    for (int i = 0; i < KEY_CNT; ++i) {
+        char k[32], v[256];
+        gen_random(k, i % 3 == 0 ? 6 : 20);
+        gen_random(v, 100);
+        keys.push_back(k);
+        values.push_back(v);
+        if (i % 5 == 0) {
+            keys.push_back(keys[i / 2]);
+            values.push_back("duplicate");
+        }
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        expected[keys[i]] = values[i];
+    }
+    VectorSource unsorted(keys, values);
+    ret = engine->BulkLoad(unsorted);
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+    // the space of the dropped duplicates can be reclaimed
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+    delete engine;
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine, expected, index_type);
+    delete engine;
+}
+
+size_t shard_files(const std::string &engine_path) {
+    glob_t files;
+    size_t count = 0;
+    if (glob((engine_path + ".*.metadata").c_str(), 0, nullptr, &files) == 0) {
+        count = files.gl_pathc;
+    }
+    globfree(&files);
+    return count;
+}
+
+// a load creates only the shards its keys go to
+void test_few_shards() {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 64;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("few shards, open engine_path: %s\n", engine_path.c_str());
+
+    std::vector<std::string> keys = {"first", "second", "third"}, values = {"1", "2", "3"};
+    VectorSource source(keys, values);
+    ret = engine->BulkLoad(source);
+    assert(ret == kSucc);
+    auto created = shard_files(engine_path);
+    assert(created >= 1 && created <= keys.size());
+    std::string value;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ret = engine->Read(keys[i], &value);
+        assert(ret == kSucc && value == values[i]);
+    }
+    delete engine;
+    assert(shard_files(engine_path) == created);
+}
+
+int main() {
+
+    printf_(
+        "======================= bulk load test "
+        "============================");
+
+    test_index(Options::kAVLTree, "AVL tree");
+    test_index(Options::kBPlusTree, "B+ tree");
+    test_index(Options::kHashTable, "hash");
+    test_few_shards();
+
+    printf_(
+        "======================= bulk load test pass :) "
+        "======================");
+
+    return 0;
+}
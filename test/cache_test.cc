@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 5000
+#define HOT_CNT 50
+#define THREAD_NUM 4
+
+std::string ks[KEY_CNT];
+std::string vs[KEY_CNT];
+
+class OneSource : public BulkSource {
+public:
+    OneSource(const std::string &key, const std::string &value): key(key), value(value) {}
+    bool Next(PolarString *k, PolarString *v) override {
+        if (done) {
+            return false;
+        }
+        *k = key;
+        *v = value;
+        done = true;
+        return true;
+    }
+private:
+    std::string key, value;
+    bool done = false;
+};
+
+void check(Engine *engine, int i) {
+    std::string value;
+    RetCode ret = engine->Read(ks[i], &value);
+    assert(ret == kSucc);
+    assert(value == vs[i]);
+}
+
+void read_hot(Engine *engine, int id) {
+    for (int round = 0; round < 100; ++round) {
+        for (int i = id; i < HOT_CNT; i += 2) {
+            check(engine, i);
+        }
+    }
+}
+
+int main() {
+
+    printf_(
+        "======================= cache test "
+        "============================");
+
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 4;
+    options.slice_size = 1024 * 1024;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    // a store opened without a cache has no counters
+    CacheStats stats;
+    ret = engine->GetCacheStats(&stats);
+    assert(ret == kNotSupported);
+    for (int i = 0; i < KEY_CNT; ++i) {
+        char k[32], v[256];
+        gen_random(k, 16);
+        ks[i] = k;
+        gen_random(v, 200);
+        vs[i] = v;
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    delete engine;
+
+    // room for about 1500 of the values
+    options.cache_size = 512 * 1024;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+
+    // hot keys are read often, and stay cached through a scan of all keys
+    for (int round = 0; round < 10; ++round) {
+        for (int i = 0; i < HOT_CNT; ++i) {
+            check(engine, i);
+        }
+    }
+    for (int i = 0; i < KEY_CNT; ++i) {
+        check(engine, i);
+    }
+    ret = engine->GetCacheStats(&stats);
+    assert(ret == kSucc);
+    assert(stats.hits > 0 && stats.admissions >= HOT_CNT);
+    assert(stats.rejections + stats.evictions > 0);
+    assert(stats.bytes <= options.cache_size);
+    auto hits = stats.hits;
+    for (int i = 0; i < HOT_CNT; ++i) {
+        check(engine, i);
+    }
+    ret = engine->GetCacheStats(&stats);
+    assert(ret == kSucc);
+    assert(stats.hits == hits + HOT_CNT);
+
+    // updates never leave an old value behind in the cache
+    for (int i = 0; i < HOT_CNT; i += 3) {
+        vs[i] = "overwritten";
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    std::vector<PolarString> keys, values;
+    for (int i = 1; i < HOT_CNT; i += 3) {
+        vs[i] = "batched";
+        keys.push_back(ks[i]);
+        values.push_back(vs[i]);
+    }
+    ret = engine->WriteBatch(keys, values);
+    assert(ret == kSucc);
+    for (int i = 0; i < HOT_CNT; ++i) {
+        check(engine, i);
+    }
+    ret = engine->Delete(ks[2]);
+    assert(ret == kSucc);
+    std::string value;
+    ret = engine->Read(ks[2], &value);
+    assert(ret == kNotFound);
+    vs[5] = "loaded";
+    OneSource source(ks[5], vs[5]);
+    ret = engine->BulkLoad(source);
+    assert(ret == kSucc);
+    check(engine, 5);
+
+    // MultiGet takes what it can from the cache
+    keys.clear();
+    for (int i = 0; i < HOT_CNT * 2; ++i) {
+        keys.push_back(ks[i]);
+    }
+    std::vector<std::string> multi_values;
+    std::vector<RetCode> statuses;
+    ret = engine->MultiGet(keys, &multi_values, &statuses);
+    assert(ret == kSucc);
+    for (int i = 0; i < HOT_CNT * 2; ++i) {
+        if (i == 2) {
+            assert(statuses[i] == kNotFound);
+        } else {
+            assert(statuses[i] == kSucc && multi_values[i] == vs[i]);
+        }
+    }
+
+    // readers racing with a writer: once the writer is done, every reader
+    // must see its last values
+    vs[2] = "restored";
+    ret = engine->Write(ks[2], vs[2]);
+    assert(ret == kSucc);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < THREAD_NUM; ++t) {
+        readers.emplace_back([engine]() {
+            std::string value;
+            for (int round = 0; round < 2000; ++round) {
+                engine->Read(ks[round % HOT_CNT], &value);
+            }
+        });
+    }
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < HOT_CNT; ++i) {
+            vs[i] = std::to_string(round) + "-" + std::to_string(i);
+            ret = engine->Write(ks[i], vs[i]);
+            assert(ret == kSucc);
+        }
+    }
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    std::thread hot[2] = {std::thread(read_hot, engine, 0), std::thread(read_hot, engine, 1)};
+    hot[0].join();
+    hot[1].join();
+    delete engine;
+
+    printf_(
+        "======================= cache test pass :) "
+        "======================");
+
+    return 0;
+}
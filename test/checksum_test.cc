@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 1000
+
+std::string ks[KEY_CNT];
+std::string vs[KEY_CNT];
+
+// flips a byte of a data file behind the back of the engine
+void flip_byte(const std::string &filename, off_t offset) {
+    int fd = open(filename.c_str(), O_RDWR);
+    assert(fd >= 0);
+    char c;
+    auto done = pread(fd, &c, 1, offset);
+    assert(done == 1);
+    c ^= 0x20;
+    done = pwrite(fd, &c, 1, offset);
+    assert(done == 1);
+    close(fd);
+}
+
+void check_others(Engine *engine) {
+    std::string value;
+    for (int i = 1; i < KEY_CNT; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        assert(ret == kSucc);
+        assert(value == vs[i]);
+    }
+}
+
+int main() {
+
+    printf_(
+        "======================= checksum test "
+        "============================");
+
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 1;
+    options.slice_size = 1024 * 1024;
+    options.initial_index_size = 4096;
+    options.verify_read_interval = 1;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    for (int i = 0; i < KEY_CNT; ++i) {
+        char k[32], v[256];
+        gen_random(k, 16);
+        ks[i] = k;
+        gen_random(v, 200);
+        vs[i] = v;
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    ret = engine->Scrub();
+    assert(ret == kSucc);
+    delete engine;
+
+    // the first value starts behind the 24-byte record header at the
+    // start of the first slice of the only shard
+    flip_byte(engine_path + ".0.0.data", 24 + 5);
+
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    std::string value;
+    ret = engine->Read(ks[0], &value);
+    assert(ret == kCorruption);
+    ReadView view;
+    ret = engine->ReadPinned(ks[0], &view);
+    assert(ret == kCorruption);
+    std::vector<PolarString> keys = {ks[0], ks[1]};
+    std::vector<std::string> values;
+    std::vector<RetCode> statuses;
+    ret = engine->MultiGet(keys, &values, &statuses);
+    assert(ret == kSucc);
+    assert(statuses[0] == kCorruption);
+    assert(statuses[1] == kSucc && values[1] == vs[1]);
+    check_others(engine);
+    ret = engine->Scrub();
+    assert(ret == kCorruption);
+    ScrubReport report;
+    ret = engine->Scrub(&report);
+    assert(ret == kCorruption);
+    assert(report.verified_bytes > 0 && report.corrupted.size() == 1);
+    assert(report.corrupted[0].key == ks[0] && report.corrupted[0].shard == 0);
+    assert(report.corrupted[0].slice == 0 && report.corrupted[0].offset == 24);
+    assert(report.corrupted[0].length == vs[0].size());
+    // no scrub has completed in the background yet
+    ret = engine->LastScrub(&report);
+    assert(ret == kNotFound);
+    delete engine;
+
+    // without verified reads, the corruption is only found by scrubbing
+    options.verify_read_interval = 0;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    ret = engine->Read(ks[0], &value);
+    assert(ret == kSucc);
+    assert(value != vs[0]);
+    ret = engine->Scrub();
+    assert(ret == kCorruption);
+
+    // overwriting the value leaves nothing corrupted behind
+    ret = engine->Write(ks[0], vs[0]);
+    assert(ret == kSucc);
+    ret = engine->Read(ks[0], &value);
+    assert(ret == kSucc);
+    assert(value == vs[0]);
+    ret = engine->Scrub(&report);
+    assert(ret == kSucc && report.corrupted.empty());
+    check_others(engine);
+    delete engine;
+
+    printf_(
+        "======================= checksum test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <stdio.h>
+#include <glob.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 20
+#define ROUND_CNT 300
+#define HASH_KEY_CNT 10000
+
+char k[1024];
+char v[9024];
+std::string ks[KEY_CNT];
+std::string vs[KEY_CNT];
+
+void check_all(Engine *engine) {
+    std::string value;
+    for (int i = 0; i < KEY_CNT; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        assert(ret == kSucc);
+        assert(value == vs[i]);
+    }
+}
+
+int main() {
+
+    Engine *engine = NULL;
+    printf_(
+        "======================= compaction test "
+        "============================");
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    // a single shard with room for about 25 rounds of values, so it only
+    // keeps accepting overwrites if their space is reclaimed
+    Options options;
+    options.shard_count = 1;
+    options.slice_size = 64 * 1024;
+    options.max_slice_count = 8;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("open engine_path: %s\n", engine_path.c_str());
+
+    for (int i = 0; i < KEY_CNT; ++i) {
+        gen_random(k, 16);
+        ks[i] = k;
+    }
+
+    ReadView view;
+    std::string pinned_value;
+    for (int round = 0; round < ROUND_CNT; ++round) {
+        for (int i = 0; i < KEY_CNT; ++i) {
+            // every 7th key is a blob, stored outside of the slices
+            gen_random(v, i % 7 == 0 ? 9000 : 1000);
+            vs[i] = v;
+            if (i % 7 == 0) {
+                vs[i] += std::string(20000, 'b');
+            }
+            ret = engine->Write(ks[i], vs[i]);
+            assert(ret == kSucc);
+        }
+        if (round == 10) {
+            // a pinned value survives any number of compactions
+            ret = engine->ReadPinned(ks[1], &view);
+            assert(ret == kSucc);
+            pinned_value = vs[1];
+        }
+        ret = engine->Compact();
+        assert(ret == kSucc);
+        check_all(engine);
+    }
+    assert(view.value() == pinned_value);
+    view.Reset();
+
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    for (int i = 0; i < KEY_CNT; ++i) {
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+        ret = engine->Compact();
+        assert(ret == kSucc);
+    }
+    check_all(engine);
+    delete engine;
+
+    // a hash index is scanned in chunks of home slots while a writer keeps
+    // moving entries around, no live value may be left behind in a victim
+    engine_path = std::string("./data/test-") + std::to_string(asm_rdtsc());
+    options.index_type = Options::kHashTable;
+    options.slice_size = 1024 * 1024;
+    options.max_slice_count = 32;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    std::vector<std::string> hash_ks(HASH_KEY_CNT * 2), hash_vs(HASH_KEY_CNT * 2);
+    for (int i = 0; i < HASH_KEY_CNT * 2; ++i) {
+        gen_random(k, 16);
+        hash_ks[i] = k;
+    }
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < HASH_KEY_CNT; ++i) {
+            gen_random(v, 200);
+            hash_vs[i] = v;
+            ret = engine->Write(hash_ks[i], hash_vs[i]);
+            assert(ret == kSucc);
+        }
+    }
+    std::thread writer([&]() {
+        for (int i = HASH_KEY_CNT; i < HASH_KEY_CNT * 2; ++i) {
+            hash_vs[i] = hash_ks[i];
+            RetCode ret = engine->Write(hash_ks[i], hash_vs[i]);
+            assert(ret == kSucc);
+            if (i % 3 == 0) {
+                ret = engine->Delete(hash_ks[i - 1]);
+                assert(ret == kSucc);
+                hash_vs[i - 1].clear();
+            }
+        }
+    });
+    for (int i = 0; i < 5; ++i) {
+        ret = engine->Compact();
+        assert(ret == kSucc);
+    }
+    writer.join();
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    std::string value;
+    for (int i = 0; i < HASH_KEY_CNT * 2; ++i) {
+        ret = engine->Read(hash_ks[i], &value);
+        if (hash_vs[i].empty()) {
+            assert(ret == kNotFound);
+        } else {
+            assert(ret == kSucc);
+            assert(value == hash_vs[i]);
+        }
+    }
+    delete engine;
+
+    // both slices of a shard are full, and the live value left in the mostly
+    // dead one has nowhere to go: Compact gives up instead of retrying forever
+    engine_path = std::string("./data/test-") + std::to_string(asm_rdtsc());
+    options.index_type = Options::kAVLTree;
+    options.slice_size = 4096;
+    options.max_slice_count = 2;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    // 9 records of 440 bytes fill a slice
+    for (int i = 0; i < 9; ++i) {
+        gen_random(v, 400);
+        vs[i] = v;
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    for (int i = 1; i < 10; ++i) {
+        gen_random(v, 400);
+        vs[i == 9 ? 1 : i] = v;
+        ret = engine->Write(ks[i == 9 ? 1 : i], v);
+        assert(ret == kSucc);
+    }
+    ret = engine->Compact();
+    assert(ret == kFull);
+    for (int i = 0; i < 9; ++i) {
+        ret = engine->Read(ks[i], &value);
+        assert(ret == kSucc);
+        assert(value == vs[i]);
+    }
+    delete engine;
+
+    // blobs overwritten before a restart are still deleted after it
+    engine_path = std::string("./data/test-") + std::to_string(asm_rdtsc());
+    options.slice_size = 64 * 1024;
+    options.max_slice_count = 8;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    for (int round = 0; round < 3; ++round) {
+        vs[0] = std::string(20000, 'a' + round);
+        ret = engine->Write(ks[0], vs[0]);
+        assert(ret == kSucc);
+    }
+    delete engine;
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    ret = engine->Read(ks[0], &value);
+    assert(ret == kSucc);
+    assert(value == vs[0]);
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    glob_t blobs;
+    assert(glob((engine_path + ".*.blob").c_str(), 0, nullptr, &blobs) == 0);
+    assert(blobs.gl_pathc == 1);
+    globfree(&blobs);
+    delete engine;
+
+    printf_(
+        "======================= compaction test pass :) "
+        "======================");
+
+    return 0;
+}
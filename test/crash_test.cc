@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
 #include <atomic>
 #include <errno.h>
@@ -14,6 +15,8 @@
 using namespace polar_race;
 
 #define KV_CNT 30000
+#define ROUND_CNT 8
+#define ROUND_KV_CNT 3000
 
 char k[1024];
 char v[9024];
@@ -27,6 +30,81 @@ void handler(int signal) {
     need_kill = true;
 }
 
+// every round deletes a fifth of the keys and overwrites the others
+bool round_deletes(int round, int i) {
+    return (i + round) % 5 == 0;
+}
+
+std::string round_value(int round, int i) {
+    return vs[i].substr(0, 100 + round * 50) + std::to_string(round);
+}
+
+bool matches(Engine *engine, int i, bool exists, const std::string &expected) {
+    std::string value;
+    RetCode ret = engine->Read(ks[i], &value);
+    return exists ? ret == kSucc && value == expected : ret == kNotFound;
+}
+
+// Kills the writer anywhere in a round of updates, also while it closes the
+// engine. After a restart, the updates of the round must have been applied
+// up to some point and not at all from there on.
+void crash_rounds(const std::string &engine_path) {
+    bool exists[ROUND_KV_CNT];
+    std::string expected[ROUND_KV_CNT];
+    for (int i = 0; i < ROUND_KV_CNT; ++i) {
+        exists[i] = false;
+    }
+    srand(42);
+    for (int round = 1; round <= ROUND_CNT; ++round) {
+        int signal_at = rand() % (ROUND_KV_CNT + 1);
+        need_kill = false;
+        pid_t fpid = fork();
+        if (fpid == 0) { // child
+            Engine *engine = NULL;
+            RetCode ret = Engine::Open(engine_path, &engine);
+            assert(ret == kSucc);
+            for (int i = 0; i < ROUND_KV_CNT; ++i) {
+                if (i == signal_at) {
+                    kill(getppid(), SIGUSR1);
+                }
+                if (round_deletes(round, i)) {
+                    ret = engine->Delete(ks[i]);
+                    assert(ret == kSucc || ret == kNotFound);
+                } else {
+                    ret = engine->Write(ks[i], round_value(round, i));
+                    assert(ret == kSucc);
+                }
+            }
+            if (signal_at == ROUND_KV_CNT) {
+                kill(getppid(), SIGUSR1);
+            }
+            delete engine;
+            exit(0);
+        }
+        assert(fpid > 0);
+        int res;
+        while (!need_kill && waitpid(fpid, &res, WNOHANG) == 0);
+        // the child may have finished already
+        kill(fpid, 9);
+        waitpid(fpid, &res, 0);
+
+        Engine *engine = NULL;
+        RetCode ret = Engine::Open(engine_path, &engine);
+        assert(ret == kSucc);
+        int i = 0;
+        for (; i < ROUND_KV_CNT && matches(engine, i, !round_deletes(round, i), round_value(round, i)); ++i) {
+            exists[i] = !round_deletes(round, i);
+            expected[i] = round_value(round, i);
+        }
+        assert(i >= signal_at);
+        printf("round %d: killed after %d of %d updates\n", round, i, ROUND_KV_CNT);
+        for (; i < ROUND_KV_CNT; ++i) {
+            assert(matches(engine, i, exists[i], expected[i]));
+        }
+        delete engine;
+    }
+}
+
 
 int main() {
 
@@ -93,6 +171,9 @@ int main() {
             ret = engine->Read(ks[i], &value);
             assert(ret == kNotFound);
         }
+        delete engine;
+
+        crash_rounds(engine_path + "-rounds");
         printf_( "======================= crash test pass :) " "======================");
 
     } else {
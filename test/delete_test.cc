@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 5000
+#define ROUND_CNT 100
+
+char k[1024];
+char v[9024];
+std::string ks[KEY_CNT];
+std::string vs[KEY_CNT];
+bool deleted[KEY_CNT];
+
+class CountVisitor : public Visitor {
+public:
+    int count = 0;
+    void Visit(const PolarString &key, const PolarString &value) override {
+        (void)key;
+        (void)value;
+        count++;
+    }
+};
+
+void check_all(Engine *engine) {
+    std::string value;
+    for (int i = 0; i < KEY_CNT; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        if (deleted[i]) {
+            assert(ret == kNotFound);
+        } else {
+            assert(ret == kSucc);
+            assert(value == vs[i]);
+        }
+    }
+}
+
+// total size of the index checkpoints and key arenas of all shards
+size_t index_size(const std::string &engine_path) {
+    size_t size = 0;
+    for (auto suffix : {".*.index", ".*.bptree", ".*.hash", ".*.keys"}) {
+        glob_t files;
+        if (glob((engine_path + suffix).c_str(), 0, nullptr, &files) == 0) {
+            for (size_t i = 0; i < files.gl_pathc; ++i) {
+                struct stat st = {};
+                stat(files.gl_pathv[i], &st);
+                size += st.st_size;
+            }
+        }
+        globfree(&files);
+    }
+    return size;
+}
+
+void test_index(Options::IndexType index_type, const char *name) {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    // few slices, so deleted values must be reclaimed to keep on writing
+    Options options;
+    options.index_type = index_type;
+    options.shard_count = 4;
+    options.slice_size = 256 * 1024;
+    options.max_slice_count = 8;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("%s index, open engine_path: %s\n", name, engine_path.c_str());
+
+    for (int i = 0; i < KEY_CNT; ++i) {
+        // short keys live in the index nodes, long ones in the key arena
+        gen_random(k, i % 2 == 0 ? 6 : 24);
+        ks[i] = std::string(k) + std::to_string(i);
+        gen_random(v, 100);
+        vs[i] = v;
+        deleted[i] = false;
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+
+    // nothing to delete
+    ret = engine->Delete("no such key");
+    assert(ret == kNotFound);
+
+    // delete every other key, twice
+    for (int i = 0; i < KEY_CNT; i += 2) {
+        ret = engine->Delete(ks[i]);
+        assert(ret == kSucc);
+        ret = engine->Delete(ks[i]);
+        assert(ret == kNotFound);
+        deleted[i] = true;
+    }
+    check_all(engine);
+    if (index_type != Options::kHashTable) {
+        CountVisitor visitor;
+        ret = engine->Range("", "", visitor);
+        assert(ret == kSucc);
+        assert(visitor.count == KEY_CNT / 2);
+    }
+
+    // churn through far more values than the slices hold, with no more keys
+    // than before, so removed nodes and the space of removed keys are enough
+    // (the checkpoints are written when the engine is closed)
+    delete engine;
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    auto filled_index_size = index_size(engine_path);
+    assert(filled_index_size > 0);
+    for (int round = 0; round < ROUND_CNT; ++round) {
+        for (int i = round % 3; i < KEY_CNT; i += 3) {
+            if (deleted[i]) {
+                gen_random(v, 100 + round);
+                vs[i] = v;
+                ret = engine->Write(ks[i], vs[i]);
+            } else {
+                ret = engine->Delete(ks[i]);
+            }
+            assert(ret == kSucc);
+            deleted[i] = !deleted[i];
+        }
+        ret = engine->Compact();
+        assert(ret == kSucc);
+    }
+    check_all(engine);
+    delete engine;
+    assert(index_size(engine_path) == filled_index_size);
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    for (int i = 0; i < KEY_CNT; ++i) {
+        if (!deleted[i]) {
+            ret = engine->Delete(ks[i]);
+            assert(ret == kSucc);
+            deleted[i] = true;
+        }
+    }
+    check_all(engine);
+    if (index_type != Options::kHashTable) {
+        CountVisitor visitor;
+        ret = engine->Range("", "", visitor);
+        assert(ret == kSucc);
+        assert(visitor.count == 0);
+    }
+    delete engine;
+}
+
+// a window of keys moving on, like expiring sessions: new keys come in at
+// the top, the oldest ones are deleted, and the index does not grow
+void test_moving_keys(Options::IndexType index_type, const char *name) {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.index_type = index_type;
+    options.shard_count = 2;
+    options.slice_size = 256 * 1024;
+    options.max_slice_count = 8;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("%s index, moving keys, open engine_path: %s\n", name, engine_path.c_str());
+
+    const int window = 2000, step = 400;
+    int first = 0, next = 0;
+    auto key_of = [](int i) {
+        snprintf(k, sizeof(k), "session-%08d", i);
+        return std::string(k);
+    };
+    size_t settled_index_size = 0;
+    for (int round = 0; round < 60; ++round) {
+        for (int i = 0; i < step; ++i, ++next) {
+            ret = engine->Write(key_of(next), key_of(next) + "-value");
+            assert(ret == kSucc);
+        }
+        for (; next - first > window; ++first) {
+            ret = engine->Delete(key_of(first));
+            assert(ret == kSucc);
+        }
+        ret = engine->Compact();
+        assert(ret == kSucc);
+        if (round == 10 || round == 59) {
+            delete engine;
+            auto size = index_size(engine_path);
+            if (round == 10) {
+                settled_index_size = size;
+            } else {
+                assert(size <= settled_index_size);
+            }
+            ret = Engine::Open(engine_path, &engine);
+            assert(ret == kSucc);
+        }
+    }
+    std::string value;
+    for (int i = 0; i < next; ++i) {
+        ret = engine->Read(key_of(i), &value);
+        if (i < first) {
+            assert(ret == kNotFound);
+        } else {
+            assert(ret == kSucc && value == key_of(i) + "-value");
+        }
+    }
+    if (index_type != Options::kHashTable) {
+        CountVisitor visitor;
+        ret = engine->Range("", "", visitor);
+        assert(ret == kSucc);
+        assert(visitor.count == window);
+    }
+    delete engine;
+}
+
+int main() {
+
+    printf_(
+        "======================= delete test "
+        "============================");
+
+    test_index(Options::kAVLTree, "AVL tree");
+    test_index(Options::kBPlusTree, "B+ tree");
+    test_index(Options::kHashTable, "hash");
+    test_moving_keys(Options::kAVLTree, "AVL tree");
+    test_moving_keys(Options::kBPlusTree, "B+ tree");
+    test_moving_keys(Options::kHashTable, "hash");
+
+    printf_(
+        "======================= delete test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define THREAD_CNT 8
+#define KV_CNT 500
+
+std::string ks[THREAD_CNT][KV_CNT];
+std::string vs[THREAD_CNT][KV_CNT];
+
+void writer(Engine *engine, int id) {
+    std::vector<PolarString> keys, values;
+    for (int i = 0; i < KV_CNT; ++i) {
+        if (i % 10 == 9) {
+            // every tenth value goes with a batch of the following ones
+            keys.assign(ks[id] + i, ks[id] + KV_CNT);
+            values.assign(vs[id] + i, vs[id] + KV_CNT);
+            RetCode ret = engine->WriteBatch(keys, values);
+            assert(ret == kSucc);
+        }
+        RetCode ret = engine->Write(ks[id][i], vs[id][i]);
+        assert(ret == kSucc);
+    }
+}
+
+void check_all(Engine *engine) {
+    std::string value;
+    for (int t = 0; t < THREAD_CNT; ++t) {
+        for (int i = 0; i < KV_CNT; ++i) {
+            RetCode ret = engine->Read(ks[t][i], &value);
+            assert(ret == kSucc);
+            assert(value == vs[t][i]);
+        }
+    }
+}
+
+void test_durability(Options::Durability durability, const char *name) {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 4;
+    options.initial_index_size = 4096;
+    options.slice_size = 1024 * 1024;
+    options.durability = durability;
+    options.sync_interval_ms = 10;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREAD_CNT; ++t) {
+        threads.emplace_back(writer, engine, t);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("%s: %d writes in %ld ms\n", name, THREAD_CNT * KV_CNT, (long) elapsed);
+
+    // a deleted key stays deleted
+    ret = engine->Delete(ks[0][0]);
+    assert(ret == kSucc);
+    ret = engine->Write(ks[0][0], vs[0][0]);
+    assert(ret == kSucc);
+    check_all(engine);
+    delete engine;
+
+    // re-open with another durability
+    options.durability = Options::kDurabilitySync;
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    delete engine;
+}
+
+// Wipes the record of value from the slices, as if it never left the page
+// cache. With torn, only the pages in the middle of the value are wiped, as
+// if the ones holding the header and the key had been written back already.
+void wipe_record(const std::string &engine_path, const std::string &key, const std::string &value,
+                 bool torn = false) {
+    glob_t files;
+    int ret = glob((engine_path + ".*.data").c_str(), 0, nullptr, &files);
+    assert(ret == 0);
+    bool found = false;
+    for (size_t i = 0; i < files.gl_pathc; ++i) {
+        FILE *file = fopen(files.gl_pathv[i], "r+b");
+        assert(file != NULL);
+        std::string data(1024 * 1024, '\0');
+        data.resize(fread(&data[0], 1, data.size(), file));
+        auto position = data.find(value + key);
+        if (position != std::string::npos) {
+            // the header comes first, 24 bytes
+            std::string zeros(torn ? value.size() - 2 * 4096 : 24 + value.size() + key.size(), '\0');
+            fseek(file, (long) (torn ? position + 4096 : position - 24), SEEK_SET);
+            auto written = fwrite(zeros.data(), 1, zeros.size(), file);
+            assert(written == zeros.size());
+            found = true;
+        }
+        fclose(file);
+    }
+    globfree(&files);
+    assert(found);
+}
+
+// A log record may reach the disk ahead of the value it refers to, which
+// then is a lost update: replaying the log leaves the older value in place.
+void test_lost_value() {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 1;
+    options.initial_index_size = 4096;
+    options.slice_size = 1024 * 1024;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    ret = engine->Write("lost", "old value");
+    assert(ret == kSucc);
+    delete engine;
+
+    std::string new_value(200, 'n'), kept_value(200, 'k'), torn_value(4 * 4096, 't');
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the child crashes right after its updates
+        ret = Engine::Open(engine_path, options, &engine);
+        assert(ret == kSucc);
+        ret = engine->Write("lost", new_value);
+        assert(ret == kSucc);
+        ret = engine->Write("kept", kept_value);
+        assert(ret == kSucc);
+        ret = engine->Write("torn", torn_value);
+        assert(ret == kSucc);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    wipe_record(engine_path, "lost", new_value);
+    wipe_record(engine_path, "torn", torn_value, true);
+
+    ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    std::string value;
+    ret = engine->Read("lost", &value);
+    assert(ret == kSucc && value == "old value");
+    ret = engine->Read("kept", &value);
+    assert(ret == kSucc && value == kept_value);
+    ret = engine->Read("torn", &value);
+    assert(ret == kNotFound);
+    delete engine;
+}
+
+int main() {
+
+    printf_(
+        "======================= durability test "
+        "============================");
+
+    for (int t = 0; t < THREAD_CNT; ++t) {
+        for (int i = 0; i < KV_CNT; ++i) {
+            char k[32], v[1024];
+            gen_random(k, 16);
+            ks[t][i] = k;
+            gen_random(v, i % 2 == 0 ? 100 : 1000);
+            vs[t][i] = v;
+        }
+    }
+
+    // periodic flushes need an interval
+    Engine *engine = NULL;
+    Options options;
+    options.durability = Options::kDurabilityPeriodic;
+    options.sync_interval_ms = 0;
+    RetCode ret = Engine::Open(
+        std::string("./data/test-") + std::to_string(asm_rdtsc()), options, &engine);
+    assert(ret == kInvalidArgument);
+
+    test_durability(Options::kDurabilityNone, "none");
+    test_durability(Options::kDurabilityPeriodic, "periodic");
+    test_durability(Options::kDurabilitySync, "sync");
+    test_lost_value();
+
+    printf_(
+        "======================= durability test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KV_CNT 10000
+
+// all keys share the first 8 bytes, so ordering is decided by the full key
+const std::string prefix = "rangekey";
+
+char k[1024];
+char v[9024];
+std::map<std::string, std::string> kvs;
+
+class CheckVisitor : public Visitor {
+public:
+    CheckVisitor(std::map<std::string, std::string>::iterator begin,
+                 std::map<std::string, std::string>::iterator end)
+        : expected(begin), end(end) {}
+
+    void Visit(const PolarString &key, const PolarString &value) override {
+        assert(expected != end);
+        assert(key == expected->first);
+        assert(value == expected->second);
+        ++expected;
+        ++count;
+    }
+
+    bool finished() const { return expected == end; }
+
+    int count = 0;
+
+private:
+    std::map<std::string, std::string>::iterator expected, end;
+};
+
+// overwrites every key it visits, which must not hold up the range
+class RewriteVisitor : public Visitor {
+public:
+    explicit RewriteVisitor(Engine *engine) : engine(engine) {}
+
+    void Visit(const PolarString &key, const PolarString &value) override {
+        std::string current = key.ToString();
+        assert(count == 0 || previous < current);
+        assert(value == kvs[current]);
+        kvs[current] = "rewritten " + value.ToString();
+        RetCode ret = engine->Write(key, kvs[current]);
+        assert(ret == kSucc);
+        previous = current;
+        ++count;
+    }
+
+    int count = 0;
+
+private:
+    Engine *engine;
+    std::string previous;
+};
+
+void check_range(Engine *engine, const std::string &lower, const std::string &upper) {
+    auto begin = lower.empty() ? kvs.begin() : kvs.lower_bound(lower);
+    auto end = upper.empty() ? kvs.end() : kvs.lower_bound(upper);
+    if (!upper.empty() && !lower.empty() && upper < lower) end = begin;
+    CheckVisitor visitor(begin, end);
+    RetCode ret = engine->Range(lower, upper, visitor);
+    assert(ret == kSucc);
+    assert(visitor.finished());
+}
+
+// raw binary keys, ordered byte by byte like memcmp
+void write_binary_keys(Engine *engine) {
+    for (int i = 0; i < KV_CNT; ++i) {
+        // 8-byte integers like the benchmark writes, in native byte order
+        uint64_t number = ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ ((uint64_t) i << 56);
+        std::string key(reinterpret_cast<const char *>(&number), sizeof(number));
+        if (i % 4 == 0) {
+            // longer keys with embedded zero bytes
+            key += std::string(i % 3, '\0') + "tail" + std::string(1, (char) (i & 0xff));
+        }
+        gen_random(v, 57);
+        kvs[key] = v;
+        RetCode ret = engine->Write(key, v);
+        assert(ret == kSucc);
+    }
+    // a key comes before its extensions, also those with zero bytes
+    const char *short_keys[] = {"", "a", "ab"};
+    for (auto short_key : short_keys) {
+        for (int zeros = 0; zeros < 10; ++zeros) {
+            auto key = std::string(short_key) + std::string(zeros, '\0');
+            if (key.empty()) continue;
+            kvs[key] = key + "value";
+            RetCode ret = engine->Write(key, key + "value");
+            assert(ret == kSucc);
+        }
+    }
+}
+
+void test_engine(const Options &options, const char *name) {
+    Engine *engine = NULL;
+    kvs.clear();
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("%s, open engine_path: %s\n", name, engine_path.c_str());
+
+    // empty engine
+    check_range(engine, "", "");
+
+    for (int i = 0; i < KV_CNT; ++i) {
+        gen_random(k, 11);
+        gen_random(v, 113);
+        kvs[prefix + k] = v;
+        ret = engine->Write(prefix + k, v);
+        assert(ret == kSucc);
+    }
+
+    // overwrite some keys
+    int i = 0;
+    for (auto &kv : kvs) {
+        if (i++ % 3 == 0) {
+            gen_random(v, 211);
+            kv.second = v;
+            ret = engine->Write(kv.first, v);
+            assert(ret == kSucc);
+        }
+    }
+
+    check_range(engine, "", "");
+    check_range(engine, prefix + "A", "");
+    check_range(engine, "", prefix + "m");
+    check_range(engine, prefix + "Q", prefix + "d");
+    check_range(engine, prefix + "d", prefix + "Q");
+    check_range(engine, kvs.begin()->first, kvs.rbegin()->first);
+    for (int j = 0; j < 100; ++j) {
+        gen_random(k, 3);
+        std::string lower = prefix + k;
+        gen_random(k, 3);
+        std::string upper = prefix + k;
+        if (upper < lower) std::swap(lower, upper);
+        check_range(engine, lower, upper);
+    }
+
+    write_binary_keys(engine);
+    check_range(engine, "", "");
+    check_range(engine, std::string("a\0", 2), std::string("ab\0\0", 4));
+    check_range(engine, std::string("\x80", 1), std::string("\xff", 1));
+    check_range(engine, std::string("\0\0", 2), std::string("\x7f\xff", 2));
+    for (int j = 0; j < 100; ++j) {
+        std::string lower(1 + j % 9, '\0'), upper(1 + j % 5, '\0');
+        for (auto &c : lower) c = (char) rand();
+        for (auto &c : upper) c = (char) rand();
+        if (upper < lower) std::swap(lower, upper);
+        check_range(engine, lower, upper);
+    }
+
+    // the visitor writes into the engine while the range goes on
+    RewriteVisitor rewrite(engine);
+    ret = engine->Range("", "", rewrite);
+    assert(ret == kSucc);
+    assert(rewrite.count == (int) kvs.size());
+    check_range(engine, "", "");
+
+    delete engine;
+
+    // re-open
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_range(engine, "", "");
+    delete engine;
+}
+
+int main() {
+
+    printf_(
+        "======================= range test "
+        "============================");
+
+    Options options;
+    test_engine(options, "AVL tree");
+    options.index_type = Options::kBPlusTree;
+    test_engine(options, "B+ tree");
+    // shards holding consecutive key ranges
+    options.shard_routing = Options::kRouteByPrefix;
+    test_engine(options, "B+ tree routed by prefix");
+    options.index_type = Options::kAVLTree;
+    test_engine(options, "AVL tree routed by prefix");
+
+    printf_(
+        "======================= range test pass :) "
+        "======================");
+
+    return 0;
+}
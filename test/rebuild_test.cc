@@ -0,0 +1,239 @@
+#include <assert.h>
+#include <stdio.h>
+#include <glob.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/engine.h"
+#include "test_util.h"
+
+using namespace polar_race;
+
+#define KEY_CNT 3000
+
+char v[300 * 1024 + 1];
+std::string ks[KEY_CNT];
+std::string vs[KEY_CNT];
+bool deleted[KEY_CNT];
+
+void check_all(Engine *engine) {
+    std::string value;
+    for (int i = 0; i < KEY_CNT; ++i) {
+        RetCode ret = engine->Read(ks[i], &value);
+        if (deleted[i]) {
+            assert(ret == kNotFound);
+        } else {
+            assert(ret == kSucc);
+            assert(value == vs[i]);
+        }
+    }
+}
+
+// removes the files matching pattern, returns how many there were
+int remove_files(const std::string &pattern) {
+    glob_t files;
+    int count = 0;
+    if (glob(pattern.c_str(), 0, nullptr, &files) == 0) {
+        for (size_t i = 0; i < files.gl_pathc; ++i) {
+            unlink(files.gl_pathv[i]);
+            ++count;
+        }
+    }
+    globfree(&files);
+    return count;
+}
+
+// lose every checkpoint, log and key arena, and rebuild them
+void rebuild(const std::string &engine_path) {
+    int removed = remove_files(engine_path + ".*.index") + remove_files(engine_path + ".*.bptree") +
+                  remove_files(engine_path + ".*.hash");
+    assert(removed > 0);
+    remove_files(engine_path + ".*.log");
+    remove_files(engine_path + ".*.keys");
+    RetCode ret = Engine::RebuildIndex(engine_path);
+    assert(ret == kSucc);
+}
+
+void test_index(Options::IndexType index_type, const char *name) {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.index_type = index_type;
+    options.shard_count = 4;
+    options.slice_size = 1024 * 1024;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    printf("%s index, open engine_path: %s\n", name, engine_path.c_str());
+
+    for (int i = 0; i < KEY_CNT; ++i) {
+        char k[32];
+        gen_random(k, 16);
+        ks[i] = k;
+        // a few values are large enough for blob files
+        gen_random(v, i % 500 == 0 ? 300 * 1024 : 100);
+        vs[i] = v;
+        deleted[i] = false;
+    }
+    std::vector<PolarString> keys(ks, ks + KEY_CNT / 2);
+    std::vector<PolarString> values(vs, vs + KEY_CNT / 2);
+    ret = engine->WriteBatch(keys, values);
+    assert(ret == kSucc);
+    for (int i = KEY_CNT / 2; i < KEY_CNT; ++i) {
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    // older records of overwritten and deleted keys are still in the slices
+    for (int i = 0; i < KEY_CNT; i += 3) {
+        gen_random(v, i % 1000 == 0 ? 300 * 1024 : 200);
+        vs[i] = v;
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+    }
+    for (int i = 1; i < KEY_CNT; i += 3) {
+        ret = engine->Delete(ks[i]);
+        assert(ret == kSucc);
+        deleted[i] = true;
+    }
+    check_all(engine);
+    delete engine;
+
+    // there is nothing to rebuild for a missing store
+    ret = Engine::RebuildIndex(engine_path + "-missing");
+    assert(ret == kNotFound);
+
+    rebuild(engine_path);
+
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    // the space of the old records is dead and can be reclaimed
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    check_all(engine);
+    ret = engine->Scrub();
+    assert(ret == kSucc);
+
+    // the rebuilt store keeps working, and can be rebuilt again
+    for (int i = 1; i < KEY_CNT; i += 6) {
+        ret = engine->Write(ks[i], vs[i]);
+        assert(ret == kSucc);
+        deleted[i] = false;
+    }
+    delete engine;
+    ret = Engine::RebuildIndex(engine_path);
+    assert(ret == kSucc);
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+
+    // writers racing on the same keys, the rebuilt index keeps the values the
+    // index ended up with
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.emplace_back([engine, t]() {
+            for (int round = 0; round < 200; ++round) {
+                for (int i = 0; i < 30; ++i) {
+                    // long values keep the copies of the writers overlapping
+                    std::string value = std::to_string(t) + "-" + std::to_string(round) + std::string((round + t) % 2 * 40000, 'x');
+                    RetCode ret = round % 7 == 0 && i % 2 == 0 ? engine->Delete(ks[i]) : engine->Write(ks[i], value);
+                    assert(ret == kSucc || ret == kNotFound);
+                }
+            }
+        });
+    }
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    std::string value;
+    for (int i = 0; i < 30; ++i) {
+        ret = engine->Read(ks[i], &value);
+        deleted[i] = ret == kNotFound;
+        if (!deleted[i]) {
+            assert(ret == kSucc);
+            vs[i] = value;
+        }
+    }
+    delete engine;
+    ret = Engine::RebuildIndex(engine_path);
+    assert(ret == kSucc);
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    check_all(engine);
+    delete engine;
+}
+
+// Compaction reclaims the slice holding a deletion, while the deleted value
+// is left behind in an older slice full of live values.
+void test_compacted_deletion() {
+    Engine *engine = NULL;
+    std::string engine_path =
+        std::string("./data/test-") + std::to_string(asm_rdtsc());
+    Options options;
+    options.shard_count = 1;
+    options.slice_size = 1024 * 1024;
+    options.initial_index_size = 4096;
+    RetCode ret = Engine::Open(engine_path, options, &engine);
+    assert(ret == kSucc);
+    std::string value(100, 'v');
+    ret = engine->Write("deleted", value);
+    assert(ret == kSucc);
+    for (int i = 0; i < 9000; ++i) {
+        ret = engine->Write("live-" + std::to_string(i), value);
+        assert(ret == kSucc);
+    }
+    ret = engine->Delete("deleted");
+    assert(ret == kSucc);
+    // the slices after the first one end up mostly dead
+    for (int round = 0; round < 300; ++round) {
+        for (int i = 0; i < 100; ++i) {
+            ret = engine->Write("churn-" + std::to_string(i), value);
+            assert(ret == kSucc);
+        }
+    }
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    delete engine;
+
+    rebuild(engine_path);
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    std::string read;
+    ret = engine->Read("deleted", &read);
+    assert(ret == kNotFound);
+    for (int i = 0; i < 9000; i += 100) {
+        ret = engine->Read("live-" + std::to_string(i), &read);
+        assert(ret == kSucc && read == value);
+    }
+    // compacting again keeps the deletion as long as the value is there
+    ret = engine->Compact();
+    assert(ret == kSucc);
+    delete engine;
+    rebuild(engine_path);
+    ret = Engine::Open(engine_path, &engine);
+    assert(ret == kSucc);
+    ret = engine->Read("deleted", &read);
+    assert(ret == kNotFound);
+    delete engine;
+}
+
+int main() {
+
+    printf_(
+        "======================= rebuild test "
+        "============================");
+
+    test_index(Options::kAVLTree, "AVL tree");
+    test_index(Options::kBPlusTree, "B+ tree");
+    test_index(Options::kHashTable, "hash");
+    test_compacted_deletion();
+
+    printf_(
+        "======================= rebuild test pass :) "
+        "======================");
+
+    return 0;
+}
@@ -5,3 +5,21 @@ echo --------------------------------------
 ./multi_thread_test
 echo --------------------------------------
 ./crash_test
+echo --------------------------------------
+./range_test
+echo --------------------------------------
+./batch_test
+echo --------------------------------------
+./compaction_test
+echo --------------------------------------
+./delete_test
+echo --------------------------------------
+./durability_test
+echo --------------------------------------
+./checksum_test
+echo --------------------------------------
+./rebuild_test
+echo --------------------------------------
+./bulk_load_test
+echo --------------------------------------
+./cache_test
@@ -14,6 +14,21 @@ char v[9024];
 std::string ks[KV_CNT];
 std::string vs_1[KV_CNT];
 std::string vs_2[KV_CNT];
+
+// values around the old 64 KB limit, one still kept in a slice and one stored as a blob
+const size_t big_sizes[] = {65535, 65536, 65537, 1 << 20, 9 << 20};
+std::string big_ks[5];
+std::string big_vs[5];
+
+void check_big_values(Engine *engine) {
+    std::string value;
+    for (int i = 0; i < 5; ++i) {
+        RetCode ret = engine->Read(big_ks[i], &value);
+        assert(ret == kSucc);
+        assert(value == big_vs[i]);
+    }
+}
+
 int main() {
 
     Engine *engine = NULL;
@@ -99,6 +114,19 @@ int main() {
         }
     }
 
+    ////////////////////////////////////
+    for (int i = 0; i < 5; ++i) {
+        gen_random(k, 19);
+        big_ks[i] = k;
+        big_vs[i].resize(big_sizes[i]);
+        for (size_t j = 0; j < big_sizes[i]; ++j) {
+            big_vs[i][j] = (char) (j * 131 + i);
+        }
+        ret = engine->Write(big_ks[i], big_vs[i]);
+        assert(ret == kSucc);
+    }
+    check_big_values(engine);
+
     delete engine;
 
     // re-open
@@ -115,6 +143,35 @@ int main() {
         }
     }
 
+    check_big_values(engine);
+
+    // pinned reads
+    ReadView view;
+    for (int i = 0; i < KV_CNT; ++i) {
+        ret = engine->ReadPinned(ks[i], &view);
+        assert(ret == kSucc);
+        assert(view.value() == (i % 2 == 0 ? vs_2[i] : vs_1[i]));
+    }
+
+    // a view keeps the old value after the key is overwritten
+    ret = engine->ReadPinned(ks[0], &view);
+    assert(ret == kSucc);
+    ret = engine->Write(ks[0], vs_1[0]);
+    assert(ret == kSucc);
+    assert(view.value() == vs_2[0]);
+    view.Reset();
+
+    for (int i = 0; i < 5; ++i) {
+        ret = engine->ReadPinned(big_ks[i], &view);
+        assert(ret == kSucc);
+        assert(view.value() == big_vs[i]);
+    }
+
+    gen_random(k, 24);
+    ret = engine->ReadPinned(k, &view);
+    assert(ret == kNotFound);
+    assert(view.value().empty());
+
     printf_(
         "======================= single thread test pass :) "
         "======================");